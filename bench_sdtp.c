@@ -0,0 +1,571 @@
+/**
+ * \file bench_sdtp.c
+ * \brief Microbenchmarks do checksum, da tabela de conexoes e do
+ * tratamento dos pacotes no servidor
+ * \author Joao Borges
+ *
+ * Inclui o servidor_sdtp.c sem o seu main (SERVIDOR_SEM_MAIN) e chama as
+ * suas funcoes diretamente, sem sockets:
+ * - checksum: checksum() com cada implementacao disponivel (ver
+ *   checksum_impls), para varios tamanhos e alinhamentos dos dados
+ * - conexao: get_socket_sdtp de tuplas novas (insere) e existentes
+ *   (busca), e remove_socket_sdtp, de 10 a 1M conexoes
+ * - handle: handle_socket_sdtp com pacotes sinteticos (SYN, ACK, dados e
+ *   FIN), no v1 e no v2, em BENCH_HANDLE conexoes de cada vez
+ *
+ * Cada caso e executado -a vezes para aquecimento, e entao -r vezes,
+ * medidas. A saida tem uma linha por caso, com campos separados por
+ * espacos, em um formato estavel, que pode ser comparado entre versoes
+ * (por exemplo, com join nos dois primeiros campos):
+ *
+ *     caso parametro ns/op ns/op_min ciclos/op ops repeticoes
+ *
+ * ns/op e ciclos/op sao as medianas das repeticoes, e ns/op_min a menor.
+ * Os ciclos sao os do contador de tempo do processador (rdtsc), e valem 0
+ * fora do x86. As linhas iniciadas por # sao comentarios.
+ *
+ * Opcoes:
+ * - -r N: repeticoes medidas (padrao BENCH_REPETICOES)
+ * - -a N: repeticoes de aquecimento (padrao BENCH_AQUECIMENTO)
+ * - -n N: maximo de conexoes nos casos da tabela (padrao 1000000)
+ * - -f texto: executa apenas os casos cujo nome contem o texto
+ */
+#define SERVIDOR_SEM_MAIN
+#include "servidor_sdtp.c"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+/// \defgroup bench Parametros dos microbenchmarks
+/// \{
+#define BENCH_REPETICOES  7         ///< Repeticoes medidas (padrao)
+#define BENCH_AQUECIMENTO 2         ///< Repeticoes de aquecimento (padrao)
+#define BENCH_FASES       4         ///< Maximo de fases por caso
+#define BENCH_REPMAX      101       ///< Maximo de repeticoes
+#define BENCH_BYTES       (1 << 26) ///< Bytes somados por repeticao
+                                    ///< (checksum)
+#define BENCH_OPS         100000    ///< Minimo de operacoes por repeticao
+                                    ///< (tabela)
+#define BENCH_HANDLE      1000      ///< Conexoes por repeticao (handle)
+#define BENCH_V2          65536     ///< Bytes por conexao no v2 (handle)
+/// \}
+
+/**
+ * Medida de uma fase de um caso, em uma repeticao
+ */
+struct amostra_bench
+{
+    uint64_t ns;              ///< Tempo total (ns)
+    uint64_t ciclos;          ///< Ciclos totais
+    unsigned long ops;        ///< Operacoes realizadas
+};
+
+/**
+ * Funcao de um caso, que realiza uma repeticao e preenche a amostra de
+ * cada uma de suas fases
+ */
+typedef void (*caso_bench)(void *arg, struct amostra_bench *a);
+
+int repeticoes = BENCH_REPETICOES;
+int aquecimento = BENCH_AQUECIMENTO;
+const char *filtro = NULL;
+
+/**
+ * Evita que o compilador descarte os resultados medidos
+ */
+volatile uint32_t sumidouro;
+
+/**
+ * Worker usado por todos os casos, sem socket
+ */
+struct worker_sdtp worker;
+
+/**
+ * Contador de ciclos do processador, quando disponivel
+ */
+static inline uint64_t ciclos()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Relogio monotonico, em nanosegundos
+ */
+static inline uint64_t relogio_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Cronometro de uma fase: inicia a medida
+ */
+static inline void cronometro_inicia(struct amostra_bench *a)
+{
+    a->ns     -= relogio_ns();
+    a->ciclos -= ciclos();
+}
+
+/**
+ * Cronometro de uma fase: encerra a medida, acumulando as operacoes
+ */
+static inline void cronometro_para(struct amostra_bench *a,
+        unsigned long ops)
+{
+    a->ciclos += ciclos();
+    a->ns     += relogio_ns();
+    a->ops    += ops;
+}
+
+/**
+ * Gerador pseudoaleatorio deterministico (xorshift64), para que todas as
+ * execucoes usem as mesmas tuplas e a mesma ordem
+ */
+static inline uint64_t sorteia(uint64_t *estado)
+{
+    *estado ^= *estado << 13;
+    *estado ^= *estado >> 7;
+    *estado ^= *estado << 17;
+
+    return *estado;
+}
+
+int compara_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Executa um caso, com aquecimento e repeticoes, e imprime uma linha por
+ * fase
+ *
+ * \param nomes Nome de cada fase
+ * \param nfases Quantidade de fases
+ * \param parametro Parametro do caso (sem espacos)
+ * \param fn Funcao do caso
+ * \param arg Argumento da funcao
+ */
+void executa_caso(const char **nomes, int nfases, const char *parametro,
+        caso_bench fn, void *arg)
+{
+    struct amostra_bench a[BENCH_FASES];
+    double ns[BENCH_FASES][BENCH_REPMAX];
+    double cic[BENCH_FASES][BENCH_REPMAX];
+    unsigned long ops[BENCH_FASES];
+    int f, r, algum = 0;
+
+    for (f = 0; f < nfases; f++)
+        algum |= filtro == NULL || strstr(nomes[f], filtro) != NULL;
+
+    if (!algum)
+        return;
+
+    for (r = 0; r < aquecimento; r++)
+    {
+        memset(a, 0x0, sizeof(a));
+        fn(arg, a);
+    }
+
+    for (r = 0; r < repeticoes; r++)
+    {
+        memset(a, 0x0, sizeof(a));
+        fn(arg, a);
+
+        for (f = 0; f < nfases; f++)
+        {
+            ns[f][r]  = a[f].ops ? (double)a[f].ns / a[f].ops : 0.0;
+            cic[f][r] = a[f].ops ? (double)a[f].ciclos / a[f].ops : 0.0;
+            ops[f]    = a[f].ops;
+        }
+    }
+
+    for (f = 0; f < nfases; f++)
+    {
+        if (filtro != NULL && strstr(nomes[f], filtro) == NULL)
+            continue;
+
+        qsort(ns[f], repeticoes, sizeof(double), compara_double);
+        qsort(cic[f], repeticoes, sizeof(double), compara_double);
+
+        printf("%s %s %.2f %.2f %.2f %lu %d\n", nomes[f], parametro,
+                ns[f][repeticoes / 2], ns[f][0], cic[f][repeticoes / 2],
+                ops[f], repeticoes);
+        fflush(stdout);
+    }
+}
+
+/**
+ * Caso do checksum: um tamanho e um alinhamento dos dados
+ */
+struct caso_checksum
+{
+    char *buf;                ///< Dados (alinhados a 64 bytes)
+    int tamanho;              ///< Bytes por chamada
+    int alinhamento;          ///< Deslocamento em relacao ao alinhamento
+};
+
+void bench_checksum(void *arg, struct amostra_bench *a)
+{
+    struct caso_checksum *c = (struct caso_checksum *)arg;
+    unsigned long n = BENCH_BYTES / c->tamanho, i;
+    char *buf = c->buf + c->alinhamento;
+    uint32_t acc = 0;
+
+    if (n < 1000)
+        n = 1000;
+
+    cronometro_inicia(&a[0]);
+
+    for (i = 0; i < n; i++)
+        acc += checksum(buf, c->tamanho);
+
+    cronometro_para(&a[0], n);
+
+    sumidouro = acc;
+}
+
+/**
+ * Caso da tabela de conexoes: insere, busca e remove todas as tuplas,
+ * em uma tabela nova, quantas vezes forem necessarias para BENCH_OPS
+ * operacoes
+ */
+struct caso_tabela
+{
+    struct sockaddr_in *tuplas; ///< Tuplas das conexoes
+    uint32_t *ordem;          ///< Ordem (embaralhada) da busca e remocao
+    struct socket_sdtp **s;   ///< Sockets sdtp de cada tupla
+    int n;                    ///< Quantidade de conexoes
+};
+
+void bench_tabela(void *arg, struct amostra_bench *a)
+{
+    struct caso_tabela *c = (struct caso_tabela *)arg;
+    struct worker_sdtp *w = &worker;
+    int voltas = c->n < BENCH_OPS ? BENCH_OPS / c->n : 1;
+    int v, i;
+
+    for (v = 0; v < voltas; v++)
+    {
+        init_tabela(&w->tabela);
+
+        cronometro_inicia(&a[0]);
+        for (i = 0; i < c->n; i++)
+            c->s[i] = get_socket_sdtp(w, &c->tuplas[i]);
+        cronometro_para(&a[0], c->n);
+
+        cronometro_inicia(&a[1]);
+        for (i = 0; i < c->n; i++)
+        {
+            if (get_socket_sdtp(w, &c->tuplas[c->ordem[i]])
+                    != c->s[c->ordem[i]])
+            {
+                fprintf(stderr, "bench: busca de conexao incorreta\n");
+                exit(1);
+            }
+        }
+        cronometro_para(&a[1], c->n);
+
+        cronometro_inicia(&a[2]);
+        for (i = 0; i < c->n; i++)
+            remove_socket_sdtp(w, c->s[c->ordem[i]]);
+        cronometro_para(&a[2], c->n);
+
+        free(w->tabela.slots);
+        free(w->tabela.antiga);
+    }
+}
+
+/**
+ * Caso do tratamento dos pacotes: BENCH_HANDLE conexoes fazem o 3-way
+ * handshake, enviam os dados em ordem e o FIN, fase a fase
+ */
+struct caso_handle
+{
+    struct sockaddr_in *tuplas; ///< Tuplas das conexoes
+    struct socket_sdtp **s;   ///< Sockets sdtp de cada conexao
+    int n;                    ///< Quantidade de conexoes
+    int versao;               ///< Versao do cabecalho
+    char *dados;              ///< Dados enviados por todas as conexoes
+    uint32_t tamanho;         ///< Bytes por conexao
+    uint32_t mss;             ///< Bytes por segmento
+    uint16_t soma;            ///< Checksum dos dados (FIN v2)
+};
+
+void bench_handle(void *arg, struct amostra_bench *a)
+{
+    struct caso_handle *c = (struct caso_handle *)arg;
+    struct worker_sdtp *w = &worker;
+    struct pacote_sdtp p;
+    uint32_t seq;
+    int i, erros = 0;
+
+    init_tabela(&w->tabela);
+
+    for (i = 0; i < c->n; i++)
+        c->s[i] = get_socket_sdtp(w, &c->tuplas[i]);
+
+    cronometro_inicia(&a[0]);
+    for (i = 0; i < c->n; i++)
+    {
+        memset(&p, 0x0, sizeof(p));
+        p.versao = 1;
+        p.flags  = TH_SYN|TH_SACK|(c->versao == SDTP_V2 ? TH_V2 : 0);
+        handle_socket_sdtp(w, c->s[i], &p);
+    }
+    cronometro_para(&a[0], c->n);
+
+    cronometro_inicia(&a[1]);
+    for (i = 0; i < c->n; i++)
+    {
+        memset(&p, 0x0, sizeof(p));
+        p.versao = c->versao;
+        p.flags  = TH_ACK;
+        handle_socket_sdtp(w, c->s[i], &p);
+    }
+    cronometro_para(&a[1], c->n);
+
+    // cada segmento e enviado a todas as conexoes, que assim crescem juntas
+    cronometro_inicia(&a[2]);
+    for (seq = 0; seq < c->tamanho; seq += c->mss)
+    {
+        for (i = 0; i < c->n; i++)
+        {
+            p.versao  = c->versao;
+            p.seqnum  = seq;
+            p.acknum  = 0;
+            p.window  = 0;
+            p.datalen = c->tamanho - seq < c->mss ? c->tamanho - seq
+                                                  : c->mss;
+            p.flags   = 0x0;
+            p.dados   = c->dados + seq;
+            handle_socket_sdtp(w, c->s[i], &p);
+        }
+    }
+    cronometro_para(&a[2], (unsigned long)c->n
+            * ((c->tamanho + c->mss - 1) / c->mss));
+
+    cronometro_inicia(&a[3]);
+    for (i = 0; i < c->n; i++)
+    {
+        memset(&p, 0x0, sizeof(p));
+        p.versao = c->versao;
+        p.flags  = TH_FIN;
+
+        if (c->versao == SDTP_V2)
+        {
+            p.seqnum = c->tamanho;
+            p.acknum = c->soma;
+        }
+
+        if (handle_socket_sdtp(w, c->s[i], &p) == 0 || p.flags != TH_ACK)
+            erros++;
+    }
+    cronometro_para(&a[3], c->n);
+
+    for (i = 0; i < c->n; i++)
+        remove_socket_sdtp(w, c->s[i]);
+
+    free(w->tabela.slots);
+    free(w->tabela.antiga);
+
+    // o FIN deve confirmar os dados, ou o caso nao mediu uma transferencia
+    if (erros > 0)
+    {
+        fprintf(stderr, "bench: %d transferencias sem ACK no FIN\n", erros);
+        exit(1);
+    }
+}
+
+/**
+ * Gera n tuplas (ip, porta) distintas, e uma ordem embaralhada delas
+ */
+void gera_tuplas(struct sockaddr_in *t, uint32_t *ordem, int n)
+{
+    uint64_t estado = 0x9e3779b97f4a7c15ull;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        t[i].sin_family      = AF_INET;
+        t[i].sin_addr.s_addr = htonl(0x0a000000 + i / 50000);
+        t[i].sin_port        = htons(1024 + i % 50000);
+    }
+
+    if (ordem == NULL)
+        return;
+
+    for (i = 0; i < n; i++)
+        ordem[i] = i;
+
+    for (i = n - 1; i > 0; i--)
+    {
+        uint32_t j = sorteia(&estado) % (i + 1);
+        uint32_t x = ordem[i];
+
+        ordem[i] = ordem[j];
+        ordem[j] = x;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const int tamanhos[] = { 20, 64, 255, 1500, 8952, 65536 };
+    static const int alinhamentos[] = { 0, 1, 3 };
+    static const char *fases_tabela[] =
+        { "conexao.insere", "conexao.busca", "conexao.remove" };
+    static const char *fases_handle[2][4] =
+    {
+        { "handle.v1.syn", "handle.v1.ack", "handle.v1.dados",
+          "handle.v1.fin" },
+        { "handle.v2.syn", "handle.v2.ack", "handle.v2.dados",
+          "handle.v2.fin" },
+    };
+    int maxconexoes = 1000000;
+    char parametro[64];
+    char *buf;
+    int opt, i, j, n;
+
+    while ((opt = getopt(argc, argv, "r:a:n:f:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'r':
+                repeticoes = atoi(optarg);
+                break;
+            case 'a':
+                aquecimento = atoi(optarg);
+                break;
+            case 'n':
+                maxconexoes = atoi(optarg);
+                break;
+            case 'f':
+                filtro = optarg;
+                break;
+            default:
+                printf("Erro: uso correto: ./bench_sdtp [-r repeticoes] "
+                        "[-a aquecimento] [-n conexoes] [-f filtro]\n");
+                return 1;
+        }
+    }
+
+    if (repeticoes < 1 || repeticoes > BENCH_REPMAX)
+    {
+        printf("Erro: as repeticoes devem estar entre 1 e %d\n",
+                BENCH_REPMAX);
+        return 1;
+    }
+
+    log_init(NULL, NIVEL_ERRO);
+
+    // worker sem socket, como o preparado pelo main do servidor; a
+    // memoria dos dados nao limita as janelas dos casos
+    semeia_gerador(&worker, 1, 0);
+    pool_init(&worker.pool_sockets, sizeof(struct socket_sdtp),
+            SOCKETS_SLAB);
+    pool_init(&worker.pool_blocos, BLOCO, BLOCOS_SLAB);
+    orcamento = (size_t)1 << 34;
+
+    if (evloop_init(&worker.ev) < 0)
+    {
+        perror("evloop");
+        return 1;
+    }
+
+    printf("# bench_sdtp: caso parametro ns/op ns/op_min ciclos/op ops "
+            "repeticoes\n");
+    printf("# %d repeticoes, %d de aquecimento, %ld processadores\n",
+            repeticoes, aquecimento, sysconf(_SC_NPROCESSORS_ONLN));
+
+    // checksum, com cada implementacao disponivel
+    buf = aligned_alloc(64, 65536 + 64);
+
+    for (i = 0; i < 65536 + 64; i++)
+        buf[i] = i * 31 + 7;
+
+    for (i = 0; checksum_impls[i].nome != NULL; i++)
+    {
+        char nome[64];
+        const char *nomes[1] = { nome };
+
+        if (checksum_seleciona(checksum_impls[i].nome) == NULL)
+            continue;
+
+        snprintf(nome, sizeof(nome), "checksum.%s", checksum_impls[i].nome);
+
+        for (j = 0; j < (int)(sizeof(tamanhos) / sizeof(int)); j++)
+        {
+            for (n = 0; n < (int)(sizeof(alinhamentos) / sizeof(int)); n++)
+            {
+                struct caso_checksum c = { buf, tamanhos[j],
+                    alinhamentos[n] };
+
+                snprintf(parametro, sizeof(parametro), "%d+%d", tamanhos[j],
+                        alinhamentos[n]);
+                executa_caso(nomes, 1, parametro, bench_checksum, &c);
+            }
+        }
+    }
+
+    checksum_seleciona(NULL);
+
+    // tabela de conexoes
+    for (n = 10; n <= maxconexoes; n *= 10)
+    {
+        struct caso_tabela c;
+
+        c.n      = n;
+        c.tuplas = malloc(n * sizeof(struct sockaddr_in));
+        c.ordem  = malloc(n * sizeof(uint32_t));
+        c.s      = malloc(n * sizeof(struct socket_sdtp *));
+        gera_tuplas(c.tuplas, c.ordem, n);
+
+        snprintf(parametro, sizeof(parametro), "%d", n);
+        executa_caso(fases_tabela, 3, parametro, bench_tabela, &c);
+
+        free(c.tuplas);
+        free(c.ordem);
+        free(c.s);
+    }
+
+    // tratamento dos pacotes, no v1 (lorem_ipsum.txt, MSS) e no v2
+    for (i = 0; i < 2; i++)
+    {
+        struct caso_handle c;
+
+        c.n       = BENCH_HANDLE;
+        c.versao  = i == 0 ? 1 : SDTP_V2;
+        c.tamanho = i == 0 ? LOREMSIZE : BENCH_V2;
+        c.mss     = i == 0 ? MSS : MSS2;
+        c.dados   = buf;
+        c.soma    = checksum(buf, c.tamanho);
+        c.tuplas  = malloc(c.n * sizeof(struct sockaddr_in));
+        c.s       = malloc(c.n * sizeof(struct socket_sdtp *));
+        gera_tuplas(c.tuplas, NULL, c.n);
+
+        // no v1, o FIN e conferido com o checksum do lorem_ipsum.txt
+        if (i == 0)
+            datasum = c.soma;
+
+        snprintf(parametro, sizeof(parametro), "%dx%u", c.n, c.tamanho);
+        executa_caso(fases_handle[i], 4, parametro, bench_handle, &c);
+
+        free(c.tuplas);
+        free(c.s);
+    }
+
+    free(buf);
+    evloop_destroy(&worker.ev);
+    log_finaliza();
+
+    return 0;
+}
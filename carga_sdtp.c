@@ -0,0 +1,828 @@
+/**
+ * @file carga_sdtp.c
+ * @brief Gerador de carga SDTP: muitos clientes simultaneos, em poucas
+ * threads, contra um servidor, medindo vazao e latencias
+ * @author Joao Borges
+ *
+ * Cada thread tem o seu laco de eventos e mantem ate -n/-t conexoes
+ * simultaneas, cada uma com o seu socket UDP (e, portanto, a sua tupla no
+ * servidor) e o seu motor de envio (ver \ref envio). Ao fim de uma
+ * transferencia, a conexao da lugar a uma nova, ate o total de -N
+ * transferencias. O fluxo de cada conexao e o do cliente_sdtp (ver
+ * \ref conexao): SYN, dados, FIN, devolvendo o cookie do servidor no ACK
+ * e nos dados.
+ *
+ * Ao final sao informados as conexoes por segundo, o goodput (bytes das
+ * transferencias corretas), os pacotes por segundo, os segmentos de dados
+ * por chamada de envio (com e sem GSO, ver \ref offload) e os percentis
+ * (p50, p99, p999) das latencias do handshake (do primeiro SYN ao SYN-ACK)
+ * e da transferencia (do primeiro SYN ao ACK do FIN).
+ *
+ * Para medir o ganho da segmentacao e da agregacao no kernel, a opcao -C
+ * executa a mesma carga com e sem GSO, e a opcao -U consulta as
+ * estatisticas do servidor antes e depois de cada execucao, informando os
+ * segmentos por chamada de recepcao (recvmmsg) do servidor. Por exemplo,
+ * contra "servidor_sdtp -E -U /tmp/sdtp.sock" e contra
+ * "servidor_sdtp -E -G -U /tmp/sdtp.sock" (sem GRO):
+ *
+ *     carga_sdtp -C -U /tmp/sdtp.sock -n 8 -N 64 -s 4000000 127.0.0.1 21020
+ *
+ * Opcoes:
+ * - -t N: threads (padrao 4)
+ * - -n N: conexoes simultaneas, no total (padrao 100)
+ * - -N N: transferencias (padrao o valor de -n)
+ * - -f arquivo: dados enviados (padrao ./lorem_ipsum.txt)
+ * - -s bytes: tamanho de cada transferencia; o arquivo e repetido ate ele
+ *   (padrao o tamanho do arquivo). No v1, o servidor so aceita o
+ *   lorem_ipsum.txt inteiro, e outros tamanhos sao recusados.
+ * - -m gbn|sr: modo de retransmissao (padrao gbn)
+ * - -S: nao pede a confirmacao seletiva (SACK)
+ * - -c reno|cubic: controle de congestionamento (padrao reno)
+ * - -v 1|2: versao do cabecalho (padrao 2)
+ * - -p perda: porcentagem dos datagramas enviados que e descartada pelo
+ *   proprio gerador, simulando perdas no caminho (padrao 0)
+ * - -G: nao usa a segmentacao no kernel (UDP_SEGMENT)
+ * - -C: executa a carga duas vezes, com e sem GSO, com um resultado para
+ *   cada
+ * - -U caminho: socket Unix das estatisticas do servidor (opcao -U do
+ *   servidor_sdtp), consultado antes e depois de cada execucao
+ * - -j: resultado em JSON, em uma linha, na saida padrao
+ * - -l N: nivel de log (padrao 1, aviso)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#include "sdtp.h"
+
+/// \defgroup carga Parametros do gerador
+/// @{
+#define CARGA_TENTATIVAS 10     ///< Envios do SYN e do FIN antes de desistir
+#define CARGA_THREADS    4      ///< Threads (padrao)
+#define CARGA_CONEXOES   100    ///< Conexoes simultaneas (padrao)
+#define CARGA_ESTAT      (1 << 20) ///< Maior texto das estatisticas
+/// @}
+
+/// \defgroup estat_carga Contadores lidos das estatisticas do servidor
+/// @{
+#define ESTAT_LOTES      0      ///< Chamadas de recepcao (recvmmsg)
+#define ESTAT_MENSAGENS  1      ///< Mensagens recebidas (agregadas ou nao)
+#define ESTAT_SEGMENTOS  2      ///< Segmentos recebidos, apos o GRO
+#define ESTAT_ENVIOS     3      ///< Chamadas de envio (sendmmsg)
+#define ESTAT_RESPOSTAS  4      ///< Respostas enviadas
+#define ESTAT_CAMPOS     5      ///< Quantidade de contadores
+/// @}
+
+struct thread_carga;
+
+/**
+ * Conexao simulada
+ */
+struct conexao_carga
+{
+    struct thread_carga *t;         ///< Thread dona da conexao
+    struct evfd_sdtp evsock;        ///< Registro do socket
+    struct conexao_sdtp cx;         ///< Conexao (ver \ref conexao)
+    struct rajada_sdtp rajada;      ///< Rajada dos segmentos (GSO)
+};
+
+/**
+ * Thread do gerador, com as suas conexoes e os seus resultados
+ */
+struct thread_carga
+{
+    pthread_t thread;               ///< Thread
+    int id;                         ///< Identificador
+    struct evloop_sdtp ev;          ///< Laco de eventos
+    struct conexao_carga **conexoes;///< Conexoes simultaneas (NULL se livre)
+    int simultaneas;                ///< Posicoes em conexoes
+    int ativas;                     ///< Conexoes em andamento
+    int restantes;                  ///< Transferencias ainda nao iniciadas
+    unsigned int semente;           ///< Estado do sorteio das perdas
+    uint64_t *handshakes;           ///< Latencias do handshake (us)
+    uint64_t *transferencias;       ///< Latencias das transferencias (us)
+    int nhandshakes;                ///< Latencias do handshake medidas
+    int corretas;                   ///< Transferencias corretas
+    int falhas;                     ///< Transferencias com RST ou sem resposta
+    unsigned long enviados;         ///< Datagramas enviados
+    unsigned long descartados;      ///< Datagramas descartados (perda)
+    unsigned long recebidos;        ///< Datagramas recebidos
+    unsigned long segmentos;        ///< Segmentos de dados enviados
+    unsigned long retransmissoes;   ///< Segmentos retransmitidos
+    unsigned long chamadas;         ///< Chamadas de envio dos segmentos
+    unsigned long rajadas;          ///< Segmentos enviados pelas rajadas
+    int gso;                        ///< Alguma conexao usou o GSO
+};
+
+/**
+ * Dados enviados por todas as conexoes
+ */
+char *dados;
+
+/**
+ * Tamanho de cada transferencia
+ */
+uint32_t tamanho;
+
+/**
+ * Endereco do servidor
+ */
+struct sockaddr_in servidor;
+
+/// \defgroup opcoes_carga Opcoes das conexoes
+/// @{
+int modo = ENVIO_GBN;               ///< ENVIO_GBN ou ENVIO_SR
+int usa_sack = 1;                   ///< Pede a confirmacao seletiva
+int versao = SDTP_V2;               ///< Versao pedida no SYN
+char *congestao = NULL;             ///< Controle de congestionamento
+double perda = 0.0;                 ///< Probabilidade de descarte no envio
+int usa_gso = 1;                    ///< Usa a segmentacao no kernel
+/// @}
+
+/**
+ * Socket Unix das estatisticas do servidor, ou NULL
+ */
+char *socket_estat = NULL;
+
+/**
+ * Nome das metricas do servidor somadas em cada contador @see estat_carga
+ */
+const char *metricas_estat[ESTAT_CAMPOS] =
+    { "sdtp_lotes_total", "sdtp_mensagens_total",
+      "sdtp_pacotes_recebidos_total", "sdtp_envios_total",
+      "sdtp_pacotes_enviados_total" };
+
+/**
+ * Envia um datagrama da conexao pela rajada (ver rajada_envia), salvo se
+ * o sorteio da perda o descartar, chamada pela conexao (ver \ref conexao)
+ */
+int envia_datagrama(struct conexao_sdtp *cx, struct iovec *iov, int n)
+{
+    struct conexao_carga *c = (struct conexao_carga *)cx->arg;
+    struct thread_carga *t = c->t;
+
+    if (perda > 0.0 && rand_r(&t->semente) < perda * ((double)RAND_MAX + 1))
+    {
+        t->descartados++;
+        return 0;
+    }
+
+    if (rajada_envia(&c->rajada, iov, n) < 0)
+        return -1;
+
+    t->enviados++;
+    return 0;
+}
+
+void encerra_conexao(struct conexao_sdtp *cx);
+void recebe_respostas(struct evfd_sdtp *e, uint32_t eventos);
+
+/**
+ * Inicia uma nova conexao na posicao informada da thread, enviando o SYN
+ *
+ * @return 0 em caso de sucesso, -1 se o socket nao pode ser criado
+ */
+int inicia_conexao(struct thread_carga *t, int i)
+{
+    struct conexao_carga *c = t->conexoes[i];
+    int sock;
+
+    if (c == NULL)
+    {
+        c = t->conexoes[i] = calloc(1, sizeof(struct conexao_carga));
+
+        if (c == NULL)
+            return -1;
+    }
+
+    c->t = t;
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+            ||
+        connect(sock, (struct sockaddr *)&servidor, sizeof(servidor)) < 0
+            ||
+        evloop_add_fd(&t->ev, &c->evsock, sock, EPOLLIN,
+            recebe_respostas, c) < 0)
+    {
+        LOG(NIVEL_ERRO, "Carga[%d]: socket: %s", t->id, strerror(errno));
+
+        if (sock >= 0)
+            close(sock);
+
+        // a posicao fica livre, mas a memoria e mantida: esta funcao pode
+        // ter sido chamada de dentro de conexao_recebe, que ainda testa
+        // o estado
+        c->cx.estado = CONEXAO_FIM;
+        return -1;
+    }
+
+    conexao_init(&c->cx, &t->ev, sock, modo, dados, tamanho, versao,
+            usa_sack, envia_datagrama, c);
+    rajada_init(&c->rajada, sock, usa_gso);
+
+    c->cx.max_tentativas = CARGA_TENTATIVAS;
+    c->cx.fim = encerra_conexao;
+
+    if (congestao != NULL)
+        envio_congestao(&c->cx.envio, congestao);
+
+    t->ativas++;
+    t->restantes--;
+
+    conexao_inicia(&c->cx);
+
+    return 0;
+}
+
+/**
+ * Encerra a conexao, registrando o seu resultado, e inicia a proxima
+ * transferencia na mesma posicao, se houver; chamada pela conexao ao fim
+ * da transferencia
+ */
+void encerra_conexao(struct conexao_sdtp *cx)
+{
+    struct conexao_carga *c = (struct conexao_carga *)cx->arg;
+    struct thread_carga *t = c->t;
+    int i;
+
+    if (cx->handshake)
+        t->handshakes[t->nhandshakes++] = cx->handshake;
+
+    if (cx->resultado == 0)
+        t->transferencias[t->corretas++] = agora_us() - cx->inicio;
+    else
+        t->falhas++;
+
+    t->segmentos      += cx->envio.segmentos;
+    t->retransmissoes += cx->envio.retransmissoes;
+    t->chamadas       += c->rajada.chamadas;
+    t->rajadas        += c->rajada.segmentos;
+    t->gso            |= c->rajada.gso;
+
+    // segmentos ainda na rajada nao saem mais pelo socket fechado
+    c->rajada.n = 0;
+
+    evloop_del_fd(&t->ev, &c->evsock);
+    close(cx->sock);
+
+    t->ativas--;
+
+    for (i = 0; t->conexoes[i] != c; i++)
+        ;
+
+    if (t->restantes > 0 && inicia_conexao(t, i) < 0)
+    {
+        t->falhas += t->restantes;
+        t->restantes = 0;
+    }
+}
+
+/**
+ * Recebe os pacotes do servidor para uma conexao, chamada pelo laco de
+ * eventos
+ */
+void recebe_respostas(struct evfd_sdtp *e, uint32_t eventos)
+{
+    struct conexao_carga *c = (struct conexao_carga *)e->arg;
+    struct thread_carga *t = c->t;
+
+    t->recebidos += conexao_recebe(&c->cx);
+}
+
+/**
+ * Laco de uma thread do gerador
+ */
+void *executa_thread(void *arg)
+{
+    struct thread_carga *t = (struct thread_carga *)arg;
+    int i;
+
+    for (i = 0; i < t->simultaneas && t->restantes > 0; i++)
+    {
+        if (inicia_conexao(t, i) < 0)
+        {
+            t->falhas += t->restantes;
+            t->restantes = 0;
+        }
+    }
+
+    while (t->ativas > 0)
+    {
+        if (evloop_executa(&t->ev, -1) < 0)
+        {
+            LOG(NIVEL_ERRO, "Carga[%d]: evloop_executa: %s", t->id,
+                    strerror(errno));
+            break;
+        }
+
+        // os segmentos de cada conexao na iteracao seguem juntos
+        for (i = 0; i < t->simultaneas; i++)
+        {
+            struct conexao_carga *c = t->conexoes[i];
+
+            if (c != NULL && c->rajada.n > 0)
+                rajada_descarrega(&c->rajada);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Compara duas latencias, para a ordenacao
+ */
+int compara_latencias(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Percentil (nearest-rank) de latencias ordenadas, em milisegundos
+ */
+double percentil(uint64_t *v, int n, double q)
+{
+    long i = (long)(q * n + 0.999999) - 1;
+
+    if (n == 0)
+        return 0.0;
+
+    if (i < 0)
+        i = 0;
+
+    return v[i < n ? i : n - 1] / 1000.0;
+}
+
+/**
+ * Junta e ordena as latencias de todas as threads
+ */
+uint64_t *junta_latencias(struct thread_carga *t, int nthreads, int hs,
+        int *n)
+{
+    uint64_t *v;
+    int i, k = 0;
+
+    for (i = 0; i < nthreads; i++)
+        k += hs ? t[i].nhandshakes : t[i].corretas;
+
+    v = malloc((k ? k : 1) * sizeof(uint64_t));
+
+    for (k = 0, i = 0; i < nthreads; i++)
+    {
+        int m = hs ? t[i].nhandshakes : t[i].corretas;
+
+        memcpy(v + k, hs ? t[i].handshakes : t[i].transferencias,
+                m * sizeof(uint64_t));
+        k += m;
+    }
+
+    qsort(v, k, sizeof(uint64_t), compara_latencias);
+
+    *n = k;
+    return v;
+}
+
+/**
+ * Razao entre dois contadores, ou 0 sem o divisor
+ */
+double razao(unsigned long long a, unsigned long long b)
+{
+    return b ? (double)a / b : 0.0;
+}
+
+/**
+ * Le as estatisticas do servidor pelo seu socket Unix (opcao -U do
+ * servidor_sdtp), somando as metricas de todos os workers em cada contador
+ *
+ * @param caminho Caminho do socket
+ * @param valores Contadores, indexados como em \ref estat_carga
+ * @return 0, ou -1 em caso de erro
+ */
+int le_estatisticas(const char *caminho, unsigned long long *valores)
+{
+    struct sockaddr_un end;
+    char *texto, *linha;
+    size_t lido = 0;
+    ssize_t n;
+    int sock, i;
+
+    if (strlen(caminho) >= sizeof(end.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&end, 0x0, sizeof(end));
+    end.sun_family = AF_UNIX;
+    strcpy(end.sun_path, caminho);
+
+    if ((texto = malloc(CARGA_ESTAT + 1)) == NULL)
+        return -1;
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+            ||
+        connect(sock, (struct sockaddr *)&end, sizeof(end)) < 0)
+    {
+        if (sock >= 0)
+            close(sock);
+
+        free(texto);
+        return -1;
+    }
+
+    // o servidor escreve todas as metricas e fecha a conexao
+    while (lido < CARGA_ESTAT
+            && (n = read(sock, texto + lido, CARGA_ESTAT - lido)) > 0)
+    {
+        lido += n;
+    }
+
+    close(sock);
+    texto[lido] = '\0';
+
+    memset(valores, 0x0, ESTAT_CAMPOS * sizeof(unsigned long long));
+
+    for (linha = strtok(texto, "\n"); linha != NULL;
+         linha = strtok(NULL, "\n"))
+    {
+        for (i = 0; i < ESTAT_CAMPOS; i++)
+        {
+            size_t t = strlen(metricas_estat[i]);
+
+            if (strncmp(linha, metricas_estat[i], t) == 0
+                    && (linha[t] == '{' || linha[t] == ' '))
+            {
+                char *valor = strrchr(linha, ' ');
+
+                if (valor != NULL)
+                    valores[i] += strtoull(valor + 1, NULL, 10);
+            }
+        }
+    }
+
+    free(texto);
+    return 0;
+}
+
+/**
+ * Executa a carga: divide as conexoes e as transferencias entre as
+ * threads, aguarda o seu termino e mostra o resultado
+ *
+ * @param nthreads Quantidade de threads
+ * @param simultaneas Conexoes simultaneas
+ * @param total Transferencias
+ * @param json Mostra o resultado em JSON
+ * @return A quantidade de transferencias com falha
+ */
+int executa_carga(int nthreads, int simultaneas, int total, int json)
+{
+    struct thread_carga *threads;
+    uint64_t *hs, *tr;
+    int nhs, ntr, i;
+    int corretas = 0, falhas = 0, gso = 0, estat = 0;
+    unsigned long enviados = 0, descartados = 0, recebidos = 0;
+    unsigned long segmentos = 0, retransmissoes = 0;
+    unsigned long chamadas = 0, rajadas = 0;
+    unsigned long long antes[ESTAT_CAMPOS], depois[ESTAT_CAMPOS];
+    uint64_t inicio;
+    double duracao;
+
+    // as conexoes e as transferencias sao divididas entre as threads
+    threads = calloc(nthreads, sizeof(struct thread_carga));
+
+    for (i = 0; i < nthreads; i++)
+    {
+        struct thread_carga *t = &threads[i];
+
+        t->id = i;
+        t->semente = 0x5d7f + i;
+        t->simultaneas = simultaneas / nthreads
+                       + (i < simultaneas % nthreads);
+        t->restantes = total / nthreads + (i < total % nthreads);
+        t->conexoes = calloc(t->simultaneas, sizeof(struct conexao_carga *));
+        t->handshakes = malloc((t->restantes + 1) * sizeof(uint64_t));
+        t->transferencias = malloc((t->restantes + 1) * sizeof(uint64_t));
+
+        if (evloop_init(&t->ev) < 0)
+        {
+            perror("evloop");
+            exit(1);
+        }
+    }
+
+    if (socket_estat != NULL && le_estatisticas(socket_estat, antes) < 0)
+    {
+        LOG(NIVEL_AVISO, "estatisticas em %s: %s", socket_estat,
+                strerror(errno));
+    }
+
+    inicio = agora_us();
+
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i].thread, NULL, executa_thread, &threads[i]);
+
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i].thread, NULL);
+
+    duracao = (agora_us() - inicio) / 1e6;
+
+    if (socket_estat != NULL)
+    {
+        if (le_estatisticas(socket_estat, depois) < 0)
+        {
+            LOG(NIVEL_AVISO, "estatisticas em %s: %s", socket_estat,
+                    strerror(errno));
+        }
+        else
+        {
+            for (i = 0; i < ESTAT_CAMPOS; i++)
+                depois[i] -= antes[i];
+
+            estat = 1;
+        }
+    }
+
+    for (i = 0; i < nthreads; i++)
+    {
+        corretas       += threads[i].corretas;
+        falhas         += threads[i].falhas;
+        enviados       += threads[i].enviados;
+        descartados    += threads[i].descartados;
+        recebidos      += threads[i].recebidos;
+        segmentos      += threads[i].segmentos;
+        retransmissoes += threads[i].retransmissoes;
+        chamadas       += threads[i].chamadas;
+        rajadas        += threads[i].rajadas;
+        gso            |= threads[i].gso;
+    }
+
+    hs = junta_latencias(threads, nthreads, 1, &nhs);
+    tr = junta_latencias(threads, nthreads, 0, &ntr);
+
+    if (duracao <= 0.0)
+        duracao = 1e-6;
+
+    if (json)
+    {
+        printf("{\"threads\":%d,\"simultaneas\":%d,\"transferencias\":%d,"
+               "\"tamanho\":%u,\"modo\":\"%s\",\"versao\":%d,\"sack\":%d,"
+               "\"congestao\":\"%s\",\"perda\":%.4f,"
+               "\"corretas\":%d,\"falhas\":%d,\"duracao_s\":%.6f,"
+               "\"conexoes_s\":%.2f,\"goodput_mbit_s\":%.3f,"
+               "\"pacotes_enviados_s\":%.1f,\"pacotes_recebidos_s\":%.1f,"
+               "\"descartados\":%lu,\"segmentos\":%lu,"
+               "\"retransmissoes\":%lu,\"gso\":%d,\"chamadas\":%lu,"
+               "\"segmentos_chamada\":%.2f,"
+               "\"handshake_ms\":{\"n\":%d,\"p50\":%.3f,\"p99\":%.3f,"
+               "\"p999\":%.3f,\"max\":%.3f},"
+               "\"transferencia_ms\":{\"n\":%d,\"p50\":%.3f,\"p99\":%.3f,"
+               "\"p999\":%.3f,\"max\":%.3f}",
+               nthreads, simultaneas, total, tamanho,
+               modo == ENVIO_GBN ? "gbn" : "sr", versao, usa_sack,
+               congestao != NULL ? congestao : "reno", perda,
+               corretas, falhas, duracao,
+               corretas / duracao, corretas * (double)tamanho * 8 / duracao / 1e6,
+               enviados / duracao, recebidos / duracao,
+               descartados, segmentos, retransmissoes, gso, chamadas,
+               chamadas ? (double)rajadas / chamadas : 0.0,
+               nhs, percentil(hs, nhs, 0.50), percentil(hs, nhs, 0.99),
+               percentil(hs, nhs, 0.999), percentil(hs, nhs, 1.0),
+               ntr, percentil(tr, ntr, 0.50), percentil(tr, ntr, 0.99),
+               percentil(tr, ntr, 0.999), percentil(tr, ntr, 1.0));
+
+        if (estat)
+        {
+            printf(",\"servidor\":{\"recvmmsg\":%llu,\"mensagens\":%llu,"
+                   "\"segmentos\":%llu,\"segmentos_chamada\":%.2f,"
+                   "\"sendmmsg\":%llu,\"respostas\":%llu,"
+                   "\"respostas_chamada\":%.2f}",
+                   depois[ESTAT_LOTES], depois[ESTAT_MENSAGENS],
+                   depois[ESTAT_SEGMENTOS],
+                   razao(depois[ESTAT_SEGMENTOS], depois[ESTAT_LOTES]),
+                   depois[ESTAT_ENVIOS], depois[ESTAT_RESPOSTAS],
+                   razao(depois[ESTAT_RESPOSTAS], depois[ESTAT_ENVIOS]));
+        }
+
+        printf("}\n");
+    }
+    else
+    {
+        printf("Carga: %d transferencias de %u bytes (%s, v%d%s), %d threads, "
+               "%d simultaneas%s\n", total, tamanho,
+               modo == ENVIO_GBN ? "gbn" : "sr", versao,
+               usa_sack ? ", sack" : "", nthreads, simultaneas,
+               gso ? ", gso" : "");
+        printf("  %d corretas, %d falhas em %.3f s: %.1f conexoes/s, "
+               "goodput %.3f Mbit/s\n", corretas, falhas, duracao,
+               corretas / duracao,
+               corretas * (double)tamanho * 8 / duracao / 1e6);
+        printf("  pacotes/s: %.0f enviados (%lu descartados), %.0f recebidos; "
+               "%lu segmentos, %lu retransmissoes\n", enviados / duracao,
+               descartados, recebidos / duracao, segmentos, retransmissoes);
+        printf("  envio: %lu chamadas, %.2f segmentos/chamada%s\n", chamadas,
+               razao(rajadas, chamadas), gso ? "" : " (sem gso)");
+
+        if (estat)
+        {
+            printf("  servidor: %llu recvmmsg, %.2f segmentos/chamada "
+                   "(%llu mensagens); %llu sendmmsg, %.2f respostas/chamada\n",
+                   depois[ESTAT_LOTES],
+                   razao(depois[ESTAT_SEGMENTOS], depois[ESTAT_LOTES]),
+                   depois[ESTAT_MENSAGENS], depois[ESTAT_ENVIOS],
+                   razao(depois[ESTAT_RESPOSTAS], depois[ESTAT_ENVIOS]));
+        }
+        printf("  handshake (ms):     p50 %.3f p99 %.3f p999 %.3f max %.3f\n",
+               percentil(hs, nhs, 0.50), percentil(hs, nhs, 0.99),
+               percentil(hs, nhs, 0.999), percentil(hs, nhs, 1.0));
+        printf("  transferencia (ms): p50 %.3f p99 %.3f p999 %.3f max %.3f\n",
+               percentil(tr, ntr, 0.50), percentil(tr, ntr, 0.99),
+               percentil(tr, ntr, 0.999), percentil(tr, ntr, 1.0));
+    }
+
+    for (i = 0; i < nthreads; i++)
+    {
+        for (int k = 0; k < threads[i].simultaneas; k++)
+            free(threads[i].conexoes[k]);
+
+        free(threads[i].conexoes);
+        free(threads[i].handshakes);
+        free(threads[i].transferencias);
+        evloop_destroy(&threads[i].ev);
+    }
+
+    free(threads);
+    free(hs);
+    free(tr);
+
+    return falhas;
+}
+
+int main(int argc, char *argv[])
+{
+    int nthreads = CARGA_THREADS;
+    int simultaneas = CARGA_CONEXOES;
+    int total = -1;
+    long tamanho_opt = -1;
+    char *arquivo = "./lorem_ipsum.txt";
+    int nivel = NIVEL_AVISO;
+    int json = 0;
+    int comparacao = 0;
+    int falhas;
+    int opt, i;
+
+    char *arq;
+    struct stat st;
+    int fd;
+
+    while ((opt = getopt(argc, argv, "t:n:N:f:s:m:Sc:v:p:jl:GCU:")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                nthreads = atoi(optarg);
+                break;
+            case 'n':
+                simultaneas = atoi(optarg);
+                break;
+            case 'N':
+                total = atoi(optarg);
+                break;
+            case 'f':
+                arquivo = optarg;
+                break;
+            case 's':
+                tamanho_opt = atol(optarg);
+                break;
+            case 'm':
+                if (strcmp(optarg, "gbn") == 0)
+                    modo = ENVIO_GBN;
+                else if (strcmp(optarg, "sr") == 0)
+                    modo = ENVIO_SR;
+                else
+                    goto uso;
+                break;
+            case 'S':
+                usa_sack = 0;
+                break;
+            case 'c':
+                congestao = optarg;
+                break;
+            case 'v':
+                versao = atoi(optarg);
+                if (versao != 1 && versao != SDTP_V2)
+                    goto uso;
+                break;
+            case 'p':
+                perda = atof(optarg) / 100.0;
+                break;
+            case 'j':
+                json = 1;
+                break;
+            case 'l':
+                nivel = atoi(optarg);
+                break;
+            case 'G':
+                usa_gso = 0;
+                break;
+            case 'C':
+                comparacao = 1;
+                break;
+            case 'U':
+                socket_estat = optarg;
+                break;
+            default:
+                goto uso;
+        }
+    }
+
+    if (total < 0)
+        total = simultaneas;
+
+    if (argc - optind != 2 || nthreads < 1 || simultaneas < 1)
+    {
+uso:
+        printf("Erro: uso correto: ./carga_sdtp [-t threads] [-n simultaneas] "
+                "[-N transferencias] [-f arquivo] [-s bytes] [-m gbn|sr] [-S] "
+                "[-c reno|cubic] [-v 1|2] [-p perda] [-j] [-l nivel] [-G] "
+                "[-C] [-U socket] ipservidor porta\n");
+        return 1;
+    }
+
+    if (simultaneas < nthreads)
+        nthreads = simultaneas;
+
+    // os dados de todas as conexoes, lidos do arquivo e repetidos ate o
+    // tamanho pedido
+    if ((fd = open(arquivo, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    {
+        printf("erro em abrir o arquivo\n");
+        return 1;
+    }
+
+    tamanho = tamanho_opt >= 0 ? tamanho_opt : st.st_size;
+
+    // o servidor v1 so confere o lorem_ipsum.txt (ver \ref conexao)
+    if (versao == 1 && tamanho != LOREMSIZE)
+    {
+        printf("o v1 so transfere os %d bytes do lorem_ipsum.txt; use -v 2 "
+                "para -s %u\n", LOREMSIZE, tamanho);
+        return 1;
+    }
+    dados = malloc(tamanho ? tamanho : 1);
+    arq = st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+            fd, 0) : NULL;
+
+    if (dados == NULL || arq == MAP_FAILED || (tamanho > 0 && arq == NULL))
+    {
+        printf("erro em ler o arquivo\n");
+        return 1;
+    }
+
+    for (i = 0; (uint32_t)i < tamanho; i += st.st_size)
+    {
+        memcpy(dados + i, arq, tamanho - i < st.st_size ? tamanho - i
+                                                        : st.st_size);
+    }
+
+    if (arq != NULL)
+        munmap(arq, st.st_size);
+    close(fd);
+
+    servidor.sin_family = AF_INET;
+    servidor.sin_addr.s_addr = inet_addr(argv[optind]);
+    servidor.sin_port = htons(atoi(argv[optind + 1]));
+
+    log_init(NULL, nivel);
+
+    if (comparacao)
+    {
+        // a mesma carga, primeiro com e depois sem a segmentacao no kernel
+        usa_gso = 1;
+        falhas  = executa_carga(nthreads, simultaneas, total, json);
+        usa_gso = 0;
+        falhas += executa_carga(nthreads, simultaneas, total, json);
+    }
+    else
+    {
+        falhas = executa_carga(nthreads, simultaneas, total, json);
+    }
+
+    free(dados);
+
+    log_finaliza();
+
+    return falhas > 0;
+}
@@ -1,269 +1,329 @@
 /**
  * @file cliente_sdtp.c
- * @brief Arquivo que contem uma versao inicial (incompleta) do cliente SDTP
+ * @brief Cliente SDTP, que envia um arquivo ao servidor usando uma janela
+ * deslizante (Go-Back-N ou Selective Repeat)
  * @author Joao Borges
+ *
+ * Fluxo do cliente (ver \ref conexao, comum ao carga_sdtp):
+ * - Envia o SYN (retransmitindo) ate receber o SYN-ACK, e responde com ACK,
+ *   devolvendo o cookie do servidor (que tambem segue nos dados)
+ * - Envia os dados pelo motor de envio (ver \ref envio), mantendo varios
+ *   segmentos em transito, ate a janela anunciada pelo servidor
+ * - Envia o FIN (retransmitindo) ate receber o ACK (dados corretos) ou o
+ *   RST (dados incorretos)
+ *
+ * Opcoes:
+ * - -m gbn|sr: modo de retransmissao (padrao gbn)
+ * - -f arquivo: arquivo a enviar (padrao ./lorem_ipsum.txt)
+ * - -l N: nivel de log (0 erro, 1 aviso, 2 info (padrao), 3 debug)
+ * - -S: nao pede a confirmacao seletiva (SACK) no SYN
+ * - -c reno|cubic: controle de congestionamento (padrao reno)
+ * - -T arquivo: registra, a cada ACK, o instante (ms), cwnd, ssthresh, a
+ *   janela do servidor e os bytes em transito
+ * - -v 1|2: versao do cabecalho pedida no SYN (padrao 2, ver \ref v2); com
+ *   o v2, o MSS segue o MTU do caminho, ate MSS2. O v1 so transfere o
+ *   lorem_ipsum.txt, e o cliente desiste se o servidor recusar o v2 para
+ *   outro arquivo
+ *
+ * - -G: nao usa a segmentacao no kernel (UDP_SEGMENT, ver \ref offload)
+ *
+ * O arquivo e mapeado em memoria (mmap), e cada segmento sai com sendmsg
+ * em dois iovecs: o cabecalho, montado a parte, e os dados, direto do
+ * mapeamento. Nem o envio nem as retransmissoes copiam os dados. Com o
+ * GSO, ate GSO_SEGMENTOS segmentos seguem em uma so chamada.
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "sdtp.h"
 
-//// OBS.: muita coisa ainda falta ser feita, mas seguem algumas
-//operacoes que podem ser uteis
+/**
+ * Estado do cliente SDTP
+ */
+struct cliente_sdtp
+{
+    int meusocket;                  ///< Socket UDP do cliente
+    struct sockaddr_in destinatario;///< Endereco do servidor
+    FILE *traco;                    ///< Registro da janela, ou NULL
+    uint64_t inicio;                ///< Inicio da transferencia (ms)
+    struct evloop_sdtp ev;          ///< Laco de eventos
+    struct evfd_sdtp evsock;        ///< Registro do socket
+    struct conexao_sdtp cx;         ///< Conexao (ver \ref conexao)
+    struct rajada_sdtp rajada;      ///< Rajada dos segmentos (GSO)
+};
 
-int main(int argc, char *argv[])
+/**
+ * Envia um datagrama da conexao pela rajada (ver rajada_envia), chamada
+ * pela conexao (ver \ref conexao)
+ *
+ * Os dados seguem do mapeamento do arquivo, sem copia.
+ */
+int envia_datagrama(struct conexao_sdtp *cx, struct iovec *iov, int niov)
 {
-    // buffers para armazenar os pacotes de recepcao (in) e envio (out)
-    char buffer_in[MAXSDTP];
-    char buffer_out[MAXSDTP];
+    struct cliente_sdtp *c = (struct cliente_sdtp *)cx->arg;
 
-    // ponteiro para os pacotes sdtp (recepcao e envio)
-    struct sdtphdr *pin, *pout;
+    return rajada_envia(&c->rajada, iov, niov);
+}
 
-    // ponteiro para o inicio dos dados do pacote sdtp
-    char *data;
+/**
+ * Registra a janela a cada ACK dos dados, com a opcao -T
+ */
+void registra_traco(struct conexao_sdtp *cx)
+{
+    struct cliente_sdtp *c = (struct cliente_sdtp *)cx->arg;
 
-    // descritor do socket do servidor
-    int meusocket;
+    fprintf(c->traco, "%lu %u %u %u %u\n",
+            (unsigned long)(agora_ms() - c->inicio),
+            cx->envio.cc.cwnd, cx->envio.cc.ssthresh,
+            cx->envio.janela, cx->envio.proximo - cx->envio.base);
+}
 
-    // recebe o tamanho da estrutura sockaddr_in
-    int sockettamanho;
+/**
+ * Recebe os pacotes do servidor, chamada pelo laco de eventos
+ */
+void recebe_respostas(struct evfd_sdtp *e, uint32_t eventos)
+{
+    struct cliente_sdtp *c = (struct cliente_sdtp *)e->arg;
 
-    // numero de bytes recebidos pelo socket
-    int numbytes;
+    conexao_recebe(&c->cx);
+}
 
-    // informacoes do servidor
-    struct sockaddr_in destinatario;
+int main(int argc, char *argv[])
+{
+    struct cliente_sdtp *c;
+
+    // dados do arquivo a enviar, mapeados em memoria
+    char *dados;
+    long tamanho;
+    struct stat st;
+    int fd;
+
+    // opcoes
+    int modo = ENVIO_GBN;
+    char *arquivo = "./lorem_ipsum.txt";
+    int nivel = NIVEL_INFO;
+    int sack = 1;
+    int gso = 1;
+    int versao = SDTP_V2;
+    char *congestao = NULL;
+    char *traco = NULL;
+    int opt;
+
+    uint64_t inicio, duracao;
+
+    while ((opt = getopt(argc, argv, "m:f:l:Sc:T:v:G")) != -1)
+    {
+        switch (opt)
+        {
+            case 'm':
+                if (strcmp(optarg, "gbn") == 0)
+                    modo = ENVIO_GBN;
+                else if (strcmp(optarg, "sr") == 0)
+                    modo = ENVIO_SR;
+                else
+                    goto uso;
+                break;
+            case 'f':
+                arquivo = optarg;
+                break;
+            case 'l':
+                nivel = atoi(optarg);
+                break;
+            case 'S':
+                sack = 0;
+                break;
+            case 'G':
+                gso = 0;
+                break;
+            case 'c':
+                congestao = optarg;
+                break;
+            case 'T':
+                traco = optarg;
+                break;
+            case 'v':
+                versao = atoi(optarg);
+                if (versao != 1 && versao != SDTP_V2)
+                    goto uso;
+                break;
+            default:
+                goto uso;
+        }
+    }
 
-    if (argc != 3) 
+    if (argc - optind != 2)
     {
-		printf("Erro: uso correto: ./cliente_sdtp ipservidor porta\n");
+uso:
+		printf("Erro: uso correto: ./cliente_sdtp [-m gbn|sr] [-f arquivo] "
+                "[-l nivel] [-S] [-c reno|cubic] [-T traco] "
+                "[-v 1|2] [-G] ipservidor porta\n");
 		return 1;
 	}
 
-    // tamanho da estrutura de endereco do socket usado
-    sockettamanho = sizeof(struct sockaddr_in);
+    // abrindo e mapeando o arquivo, lido uma unica vez, em sequencia
+    if ((fd = open(arquivo, O_RDONLY)) < 0)
+    {
+        printf("erro em abrir o arquivo\n");
+        return 1;
+    }
+
+    if (fstat(fd, &st) < 0)
+    {
+        printf("erro em ler o arquivo\n");
+        return 1;
+    }
+
+    tamanho = st.st_size;
+    dados = "";
+
+    // o servidor v1 so confere o lorem_ipsum.txt (ver \ref conexao)
+    if (versao == 1 && tamanho != LOREMSIZE)
+    {
+        printf("o v1 so transfere os %d bytes do lorem_ipsum.txt; use -v 2\n",
+                LOREMSIZE);
+        return 1;
+    }
+
+    if (tamanho > 0)
+    {
+        dados = mmap(NULL, tamanho, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (dados == MAP_FAILED)
+        {
+            printf("erro em mapear o arquivo\n");
+            return 1;
+        }
+
+        madvise(dados, tamanho, MADV_SEQUENTIAL);
+    }
+
+    close(fd);
+
+    c = calloc(1, sizeof(struct cliente_sdtp));
+
+    log_init(NULL, nivel);
 
     // criando o socket
-    meusocket = socket(AF_INET, SOCK_DGRAM, 0);
+    c->meusocket = socket(AF_INET, SOCK_DGRAM, 0);
 
-    destinatario.sin_family = AF_INET;
+    c->destinatario.sin_family = AF_INET;
 
     // ip do servidor - 127.0.0.1 se estiver rodando na sua mesma maquina
-    destinatario.sin_addr.s_addr = inet_addr(argv[1]);
+    c->destinatario.sin_addr.s_addr = inet_addr(argv[optind]);
 
     // porta do servidor
-    destinatario.sin_port = htons(atoi(argv[2]));
-    
+    c->destinatario.sin_port = htons(atoi(argv[optind + 1]));
+
     // zerando o resto da estrutura
-    memset(&(destinatario.sin_zero), '\0', sizeof(destinatario.sin_zero));
-    
+    memset(&(c->destinatario.sin_zero), '\0', sizeof(c->destinatario.sin_zero));
 
-    // apontando para o inicio do buffer
-    pin  = (struct sdtphdr *)&buffer_in;    // para recepcao
-    pout = (struct sdtphdr *)&buffer_out;   // para envio
+    // conectado, o socket so recebe do servidor, o kernel passa a
+    // conhecer o MTU do caminho (ver \ref conexao), e os segmentos saem sem
+    // endereco em msg_out
+    if (connect(c->meusocket, (struct sockaddr *)&c->destinatario,
+                sizeof(c->destinatario)) < 0)
+    {
+        perror("connect");
+        return 1;
+    }
 
-    // apontando para o inicio dos dados do pacote de envio
-    data = (char *)pout + sizeof(struct sdtphdr);
+    if (evloop_init(&c->ev) < 0
+            ||
+        evloop_add_fd(&c->ev, &c->evsock, c->meusocket, EPOLLIN,
+            recebe_respostas, c) < 0)
+    {
+        perror("evloop");
+        return 1;
+    }
 
-    // preenchendo o cabecalho do pacote
-    pout->seqnum   = 0;
-    pout->acknum   = 0;
-    pout->datalen  = 0;
-    pout->flags    = 0;
-    pout->window   = 0;
-    pout->checksum = 0;
+    conexao_init(&c->cx, &c->ev, c->meusocket, modo, dados, tamanho, versao,
+            sack, envia_datagrama, c);
 
-    // tamanho informado pelo cliente dos dados a serem enviados
-    int size;
+    if (congestao != NULL && envio_congestao(&c->cx.envio, congestao) < 0)
+    {
+        printf("controle de congestionamento desconhecido: %s\n", congestao);
+        return 1;
+    }
 
-    // 0 - inicio / envia o syn e aguarda pelo syn-ack
-    // 1 - recebeu syn-ack / envia o ack
-    // 2 - apto a enviar pacotes / 
-    // 3 - envia fin quando terminar dados , aguardando ack
-    int state = 0;
+    if (traco != NULL && (c->traco = fopen(traco, "w")) == NULL)
+    {
+        perror("fopen");
+        return 1;
+    }
 
-    // janela informada pelo servidor
-    int window; 
+    if (c->traco != NULL)
+        c->cx.ack = registra_traco;
 
-    // abrindo o arquivo
-    FILE *loremfile = fopen("./lorem_ipsum.txt", "r");
+    rajada_init(&c->rajada, c->meusocket, gso);
 
+    inicio = c->inicio = agora_ms();
 
-    if (loremfile == NULL)
-    {
-        printf("erro em abrir o arquivo\n");
-        return 0;
-    }
-    
-    // valor de bytes enviados e que se espera confirmacao
-    int ackbytes = 0;
+    // inicia o 3-way handshake
+    conexao_inicia(&c->cx);
 
-    while(1)
+    while (c->cx.estado != CONEXAO_FIM)
     {
-        // aqui devem vir os testes de estado
-        
-        if (state == 0)
-        {
-            // montar pacote SYN
-            pout->seqnum   = 0;
-            pout->acknum   = 0;
-            pout->datalen  = 0;
-            pout->flags    = TH_SYN;
-            pout->window   = 0;
-            pout->checksum = 0;
-            pout->checksum = checksum(
-                    (void *)pout, sizeof(struct sdtphdr));
-            size = 0;
-        }
-        else if (state == 1)
+        if (evloop_executa(&c->ev, -1) < 0)
         {
-            // montar pacote ACK
-            pout->seqnum   = 0;
-            pout->acknum   = 0;
-            pout->datalen  = 0;
-            pout->flags    = TH_ACK;
-            pout->window   = 0;
-            pout->checksum = 0;
-            pout->checksum = checksum(
-                    (void *)pout, sizeof(struct sdtphdr));
-            size = 0;
-        }
-        else if (state == 2)
-        {   
-            // enviar os dados
-            printf("enviar os dados\n");
-    
-            // zerando os dados
-            memset(data, 0x0, MSS);
-
-            // lendo os dados
-            size = fread(data, 1, window, loremfile);
-    
-            // preenchendo o novo pacote
-            pout->seqnum   = ackbytes; // seqnum assume o ack antigo
-            pout->acknum   = 0;        // zerando o ack
-            pout->datalen  = size;     // define novo tamanho dos dados
-            pout->flags    = 0x0;      // zerando as flags
-            pout->window   = 0;        // zerando a janela
-            pout->checksum = 0;        // zerando o checksum
-            // calculando o checksum
-            pout->checksum = checksum(
-                    (void *)pout, size+sizeof(struct sdtphdr));
-    
-            printf("meu checksum: %d (%d bytes)\n",pout->checksum, 
-                    size+sizeof(struct sdtphdr));
-
-            ackbytes += size;
-
-            // envio do arquivo finalizou, agora deve-se enviar o FIN
-            if (size == 0)
-            {
-                printf("finalizou o envio do arquivo! enviar FIN\n");
-                state = 3;
-                continue;
-            }
-        }
-        else if (state == 3)
-        {
-            printf("PACOTE FIN\n");
-            
-            // montar pacote FIN
-            pout->seqnum   = 0;
-            pout->acknum   = 0;
-            pout->datalen  = 0;
-            pout->flags    = TH_FIN;
-            pout->window   = 0;
-            pout->checksum = 0;
-            pout->checksum = checksum(
-                    (void *)pout, sizeof(struct sdtphdr));
-            size = 0;
-        }
-        
-        // imprimindo pacote
-        printf("DEBUG - PACOTE A ENVIAR");
-        printpacket(pout);
-        
-        // testando o envio do pacote para o servidor
-        numbytes = sendto(meusocket, pout, size+sizeof(struct sdtphdr), 0,
-                 (struct sockaddr *)&destinatario, sockettamanho);
-
-        printf("Cliente: enviou %d bytes para %s:%s\n", 
-                numbytes, argv[1], argv[2]);
-
-        // exemplo de utilizacao da funcao de timeout no recvfrom
-        // definindo um timeout de 10 segundos
-        numbytes = recvtimeout(meusocket, buffer_in, MAXSDTP, 10000,
-                (struct sockaddr *)&destinatario, &sockettamanho);
-
-        // verificacao do retorno da funcao
-        if (numbytes == -1)
-        {
-            // error occurred
-            perror("recvtimeout");
-
-            // finaliza por causa do erro
+            LOG(NIVEL_ERRO, "evloop_executa: %s", strerror(errno));
+            c->cx.resultado = 1;
             break;
         }
-        else if (numbytes == -2)
-        {
-            // timeout occurred
-        }
-        else 
-        {
-            // got some data in buf
-            printf("Cliente: recebeu %d bytes da mensagem \"%s\"\n", 
-                numbytes, buffer_in);
-
-            printf("DEBUG - PACOTE RECEBIDO");
-            printpacket(pin);
-
-            // deve se verificar o checksum do pacote recebido
-            if (pin->checksum!= checksum(
-                    (void *)pin, numbytes-sizeof(struct sdtphdr)))
-            {
-                printf("Cliente: checksum invalido\n");
-                continue;
-            }
-
-            // verificando se o pacote recebido é FIN
-            if (pin->flags & TH_FIN)
-            {
-                printf("Cliente: recebeu FIN\n");
-                break;
-            }
-
-            // verificando se o pacote recebido é ACK
-            if (pin->flags & TH_ACK)
-            {
-                printf("Cliente: recebeu ACK\n");
-                state = 1;
-                continue;
-            }
-
-            // verificando se o pacote recebido é SYN
-            if (pin->flags & TH_SYN)
-            {
-                printf("Cliente: recebeu SYN\n");
-                state = 0;
-                continue;
-            }
-
-            // deve se verificar o tipo do pacote recebido, se eh de
-            // sincronizacao, ou ja sao dados
-        }
 
+        // os segmentos da iteracao seguem juntos
+        rajada_descarrega(&c->rajada);
     }
 
-
-	close(meusocket);
-
-    return 0;
+    duracao = agora_ms() - inicio;
+
+    LOG(NIVEL_INFO, "Cliente: %ld bytes (%s, v%d, mss %u) em %lu ms, "
+            "%.1f KB/s; "
+            "%lu segmentos, %lu retransmissoes, %lu acks duplicados, "
+            "%lu por sack%s",
+            tamanho, modo == ENVIO_GBN ? "gbn" : "sr", c->cx.versao,
+            c->cx.envio.mss, (unsigned long)duracao,
+            duracao ? (double)tamanho / duracao : 0.0,
+            c->cx.envio.segmentos, c->cx.envio.retransmissoes,
+            c->cx.envio.dupacks, c->cx.envio.sackeados,
+            c->cx.sack ? "" : " (sem sack)");
+
+    LOG(NIVEL_INFO, "Cliente: srtt %.3f ms rttvar %.3f ms rto %lu ms; "
+            "%s cwnd %u ssthresh %u, %lu retransmissoes rapidas, "
+            "%lu expiracoes",
+            c->cx.envio.rtt.srtt, c->cx.envio.rtt.rttvar,
+            (unsigned long)rtt_rto(&c->cx.envio.rtt),
+            c->cx.envio.cc.impl->nome, c->cx.envio.cc.cwnd,
+            c->cx.envio.cc.ssthresh, c->cx.envio.cc.rapidas,
+            c->cx.envio.cc.expiracoes);
+
+    LOG(NIVEL_INFO, "Cliente: %lu chamadas de envio, %.2f segmentos por "
+            "chamada (%s)", c->rajada.chamadas,
+            c->rajada.chamadas ? (double)c->rajada.segmentos
+                                 / c->rajada.chamadas : 0.0,
+            c->rajada.gso ? "gso" : "sem gso");
+
+    if (c->traco != NULL)
+        fclose(c->traco);
+
+    conexao_destroy(&c->cx);
+    evloop_destroy(&c->ev);
+	close(c->meusocket);
+
+    if (tamanho > 0)
+        munmap(dados, tamanho);
+
+    log_finaliza();
+
+    return c->cx.resultado;
 }
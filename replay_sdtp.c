@@ -0,0 +1,996 @@
+/**
+ * \file replay_sdtp.c
+ * \brief Replay de capturas (pcap e pcapng) no servidor, sem sockets,
+ * conferindo as respostas e medindo a vazao do tratamento
+ * \author Joao Borges
+ *
+ * Inclui o servidor_sdtp.c sem o seu main (SERVIDOR_SEM_MAIN), como o
+ * bench_sdtp.c. Os datagramas UDP dos clientes para a porta do servidor
+ * (-p) sao entregues, na ordem da captura, ao trata_pacote de um worker
+ * sem socket, que os passa ao get_socket_sdtp e ao handle_socket_sdtp como
+ * no recebe_lote. Os segmentos agregados pelo cliente (GSO) sao separados
+ * pelo tamanho do primeiro, como o kernel os entregaria com UDP_GRO.
+ *
+ * Os prazos das conexoes seguem o relogio da captura (evloop_avanca), e
+ * nao o real. Os erros simulados ficam desligados, assim como os SYN
+ * cookies (todo SYN cria estado): a chave da captura nao e conhecida, e os
+ * cookies devolvidos pelos clientes nao seriam aceitos.
+ *
+ * Na primeira passagem, cada resposta gerada e conferida com as respostas
+ * capturadas do servidor para o mesmo cliente, na ordem:
+ * - iguais: mesmas versao, flags, numeros de sequencia e de confirmacao,
+ *   janela e blocos SACK. No SYN-ACK os numeros (o cookie) nao sao
+ *   conferidos, e com -W a janela nao e conferida
+ * - perdidas: geradas sem par na captura (perdas na saida do servidor
+ *   original), reconhecidas quando uma resposta posterior e a capturada
+ * - diferentes: a capturada nao corresponde a nenhuma das proximas
+ *   REPLAY_ALCANCE respostas geradas
+ * - inesperadas: capturadas sem nenhuma resposta gerada pendente
+ *
+ * Respostas capturadas com checksum invalido sao ignoradas. Para uma
+ * conferencia exata, a captura deve vir de um servidor sem erros simulados
+ * (opcao -E do servidor) e conter todo o seu trafego, ja que a janela
+ * anunciada depende da memoria ocupada por todas as conexoes.
+ *
+ * Em seguida, a captura e reproduzida -n vezes, sem conferencia, medindo
+ * os segmentos tratados por segundo: um benchmark deterministico do
+ * servidor, sem o custo e a variacao dos sockets. Ao fim de cada
+ * passagem, o relogio avanca alem de todos os prazos, removendo as
+ * conexoes restantes.
+ *
+ * Formatos: pcap (microssegundos ou nanossegundos, nas duas ordens de
+ * bytes) e pcapng (blocos EPB, SPB e PB), com enlaces Ethernet (com VLAN),
+ * loopback BSD, Linux cooked (SLL e SLL2) e IPv4 puro. Fragmentos IP nao
+ * sao remontados, e sim ignorados.
+ *
+ * Opcoes:
+ * - -p porta: porta do servidor na captura (padrao PORTA)
+ * - -n N: passagens medidas (padrao 1, 0 para apenas conferir)
+ * - -M N: memoria global para os dados das conexoes (MB, padrao
+ *   ORCAMENTO), a mesma do servidor capturado
+ * - -W: nao confere a janela anunciada
+ * - -v N: detalha as N primeiras diferencas (padrao REPLAY_DIFERENCAS)
+ * - -l N: nivel de log do servidor (padrao 0, erro)
+ *
+ * Termina com 1 quando ha respostas diferentes ou inesperadas.
+ */
+#define SERVIDOR_SEM_MAIN
+#include "servidor_sdtp.c"
+
+#include <limits.h>
+#include <arpa/inet.h>
+#include <byteswap.h>
+#include <sys/mman.h>
+
+/// \defgroup replay Parametros do replay
+/// \{
+#define REPLAY_ALCANCE    64  ///< Respostas geradas em que cada capturada
+                              ///< e procurada
+#define REPLAY_DIFERENCAS 10  ///< Diferencas detalhadas (padrao)
+#define REPLAY_PASSAGENS  1   ///< Passagens medidas (padrao)
+#define REPLAY_MAXPASSAGENS 1001 ///< Maximo de passagens medidas
+#define REPLAY_FILA       16  ///< Capacidade inicial de cada fila
+/// \}
+
+/// \defgroup pcap Formatos de captura
+/// \{
+#define PCAP_US         0xa1b2c3d4u ///< pcap, em microssegundos
+#define PCAP_NS         0xa1b23c4du ///< pcap, em nanossegundos
+#define PCAPNG_SHB      0x0a0d0d0au ///< pcapng: inicio de secao
+#define PCAPNG_IDB      1           ///< pcapng: descricao de interface
+#define PCAPNG_PB       2           ///< pcapng: pacote (obsoleto)
+#define PCAPNG_SPB      3           ///< pcapng: pacote simples
+#define PCAPNG_EPB      6           ///< pcapng: pacote estendido
+#define PCAPNG_ORDEM    0x1a2b3c4du ///< pcapng: ordem dos bytes da secao
+#define PCAPNG_TSRESOL  9           ///< pcapng: opcao da resolucao do tempo
+#define PCAPNG_IFMAX    64          ///< pcapng: interfaces por secao
+/// \}
+
+/// \defgroup enlaces Enlaces (LINKTYPE) reconhecidos
+/// \{
+#define ENLACE_NULL     0           ///< Loopback BSD (familia na ordem local)
+#define ENLACE_ETHERNET 1           ///< Ethernet
+#define ENLACE_RAW      101         ///< IP puro
+#define ENLACE_LOOP     108         ///< Loopback BSD (familia na ordem de rede)
+#define ENLACE_SLL      113         ///< Linux cooked
+#define ENLACE_IPV4     228         ///< IPv4 puro
+#define ENLACE_SLL2     276         ///< Linux cooked v2
+/// \}
+
+/**
+ * Datagrama UDP da captura, entre um cliente e o servidor
+ */
+struct datagrama_replay
+{
+    const char *dados;        ///< Payload UDP, na captura mapeada
+    uint32_t len;             ///< Bytes do payload
+    uint32_t fila;            ///< Indice do cliente (e da sua fila)
+    uint64_t instante;        ///< Instante, desde o primeiro datagrama (ms)
+    struct sockaddr_in cliente; ///< Endereco do cliente
+    int do_servidor;          ///< Resposta do servidor ao cliente
+};
+
+/**
+ * Resposta gerada, aguardando a capturada correspondente
+ */
+struct resposta_replay
+{
+    int len;                  ///< Bytes da resposta
+    char dados[RESPOSTA_MAX]; ///< Resposta codificada
+};
+
+/**
+ * Fila circular das respostas geradas para um cliente
+ */
+struct fila_replay
+{
+    struct resposta_replay *r; ///< Respostas
+    uint32_t cap;             ///< Capacidade
+    uint32_t ini;             ///< Posicao da mais antiga
+    uint32_t n;               ///< Respostas na fila
+};
+
+/**
+ * Captura carregada: datagramas, clientes e contagens da leitura
+ */
+struct captura_replay
+{
+    char *mapa;               ///< Arquivo mapeado
+    size_t tamanho;           ///< Tamanho do arquivo
+    struct datagrama_replay *d; ///< Datagramas, na ordem da captura
+    uint32_t n;               ///< Quantidade de datagramas
+    uint32_t cap;             ///< Capacidade do vetor de datagramas
+    uint32_t do_servidor;     ///< Datagramas do servidor
+    uint64_t inicio;          ///< Instante do primeiro datagrama (ms)
+    uint64_t ultimo;          ///< Instante do ultimo quadro (ms)
+    uint64_t *chaves;         ///< Tuplas dos clientes (+1, 0 e livre)
+    uint32_t *indices;        ///< Indice de cada tupla
+    uint32_t capmapa;         ///< Capacidade do mapa (potencia de 2)
+    uint32_t clientes;        ///< Clientes distintos
+    struct fila_replay *filas; ///< Fila de respostas de cada cliente
+    unsigned long quadros;    ///< Quadros lidos
+    unsigned long ignorados;  ///< Quadros que nao sao SDTP
+    unsigned long fragmentos; ///< Fragmentos IP ignorados
+};
+
+/**
+ * Contagens de uma passagem
+ */
+struct resultado_replay
+{
+    unsigned long segmentos;  ///< Segmentos entregues ao servidor
+    unsigned long respostas;  ///< Respostas geradas
+    unsigned long iguais;     ///< Respostas iguais as capturadas
+    unsigned long perdidas;   ///< Geradas sem par na captura
+    unsigned long diferentes; ///< Capturadas diferentes das geradas
+    unsigned long inesperadas; ///< Capturadas sem resposta gerada
+    unsigned long corrompidas; ///< Capturadas com checksum invalido
+};
+
+int porta_servidor = PORTA;
+int confere_janela = 1;
+int max_diferencas = REPLAY_DIFERENCAS;
+
+/**
+ * Worker do replay, sem socket
+ */
+struct worker_sdtp worker;
+
+/**
+ * Buffer do segmento entregue ao servidor, onde a resposta e formatada
+ */
+char segmento[65536];
+
+/**
+ * Le um inteiro da captura, na ordem de bytes do arquivo
+ */
+static inline uint16_t le16(const uint8_t *q, int troca)
+{
+    uint16_t x;
+
+    memcpy(&x, q, sizeof(x));
+
+    return troca ? bswap_16(x) : x;
+}
+
+static inline uint32_t le32(const uint8_t *q, int troca)
+{
+    uint32_t x;
+
+    memcpy(&x, q, sizeof(x));
+
+    return troca ? bswap_32(x) : x;
+}
+
+/**
+ * Le um inteiro de um cabecalho de rede
+ */
+static inline uint16_t rede16(const uint8_t *q)
+{
+    return (uint16_t)(q[0] << 8 | q[1]);
+}
+
+/**
+ * Retorna o indice do cliente da tupla, criando-o na primeira vez
+ */
+uint32_t indice_cliente(struct captura_replay *c, uint32_t ip,
+        uint16_t porta)
+{
+    uint64_t chave = chave_sdtp(ip, porta) + 1;
+    uint32_t i;
+
+    // mapa com enderecamento aberto, dobrado a metade da ocupacao
+    if ((c->clientes + 1) * 2 > c->capmapa)
+    {
+        uint32_t cap = c->capmapa ? c->capmapa * 2 : 64;
+        uint64_t *chaves = calloc(cap, sizeof(uint64_t));
+        uint32_t *indices = malloc(cap * sizeof(uint32_t));
+
+        for (i = 0; i < c->capmapa; i++)
+        {
+            uint32_t j;
+
+            if (c->chaves[i] == 0)
+                continue;
+
+            j = hash_sdtp(c->chaves[i]) & (cap - 1);
+            while (chaves[j] != 0)
+                j = (j + 1) & (cap - 1);
+
+            chaves[j]  = c->chaves[i];
+            indices[j] = c->indices[i];
+        }
+
+        free(c->chaves);
+        free(c->indices);
+        c->chaves  = chaves;
+        c->indices = indices;
+        c->capmapa = cap;
+    }
+
+    i = hash_sdtp(chave) & (c->capmapa - 1);
+    while (c->chaves[i] != 0 && c->chaves[i] != chave)
+        i = (i + 1) & (c->capmapa - 1);
+
+    if (c->chaves[i] == 0)
+    {
+        c->chaves[i]  = chave;
+        c->indices[i] = c->clientes++;
+    }
+
+    return c->indices[i];
+}
+
+/**
+ * Extrai o datagrama UDP de um quadro capturado, guardando-o se for de um
+ * cliente para o servidor ou do servidor para um cliente
+ *
+ * \param c A captura
+ * \param q O quadro, a partir do cabecalho do enlace
+ * \param caplen Bytes capturados do quadro
+ * \param enlace Tipo do enlace @see enlaces
+ * \param instante Instante do quadro (ms)
+ */
+void extrai_datagrama(struct captura_replay *c, const uint8_t *q,
+        uint32_t caplen, int enlace, uint64_t instante)
+{
+    struct datagrama_replay *d;
+    uint32_t off = 0, ihl, total, udplen;
+    uint16_t tipo = 0, origem, destino;
+    uint32_t ip_origem, ip_destino;
+
+    c->quadros++;
+    c->ultimo = instante;
+
+    switch (enlace)
+    {
+        case ENLACE_ETHERNET:
+            off = 14;
+            tipo = caplen >= off ? rede16(q + 12) : 0;
+
+            // etiquetas VLAN (802.1Q e 802.1ad)
+            while ((tipo == 0x8100 || tipo == 0x88a8) && caplen >= off + 4)
+            {
+                tipo = rede16(q + off + 2);
+                off += 4;
+            }
+            break;
+        case ENLACE_NULL:
+        case ENLACE_LOOP:
+            off = 4;
+            tipo = caplen >= off && (q[0] == AF_INET || q[3] == AF_INET)
+                 ? 0x0800 : 0;
+            break;
+        case ENLACE_RAW:
+        case ENLACE_IPV4:
+            tipo = 0x0800;
+            break;
+        case ENLACE_SLL:
+            off = 16;
+            tipo = caplen >= off ? rede16(q + 14) : 0;
+            break;
+        case ENLACE_SLL2:
+            off = 20;
+            tipo = caplen >= off ? rede16(q) : 0;
+            break;
+    }
+
+    if (tipo != 0x0800 || caplen < off + 20 || (q[off] >> 4) != 4
+            ||
+        q[off + 9] != IPPROTO_UDP)
+    {
+        c->ignorados++;
+        return;
+    }
+
+    // deslocamento ou mais fragmentos
+    if (rede16(q + off + 6) & 0x3fff)
+    {
+        c->fragmentos++;
+        return;
+    }
+
+    ihl   = (q[off] & 0xf) * 4;
+    total = rede16(q + off + 2);
+
+    if (ihl < 20 || total < ihl + 8 || caplen < off + total)
+    {
+        c->ignorados++;
+        return;
+    }
+
+    memcpy(&ip_origem, q + off + 12, sizeof(uint32_t));
+    memcpy(&ip_destino, q + off + 16, sizeof(uint32_t));
+
+    q     += off + ihl;
+    origem  = rede16(q);
+    destino = rede16(q + 2);
+    udplen  = rede16(q + 4);
+
+    if (udplen < 8 || udplen > total - ihl
+            ||
+        (destino != porta_servidor && origem != porta_servidor))
+    {
+        c->ignorados++;
+        return;
+    }
+
+    if (c->n == c->cap)
+    {
+        c->cap = c->cap ? c->cap * 2 : 4096;
+        c->d = realloc(c->d, c->cap * sizeof(struct datagrama_replay));
+    }
+
+    if (c->n == 0)
+        c->inicio = instante;
+
+    d = &c->d[c->n++];
+    d->dados       = (const char *)q + 8;
+    d->len         = udplen - 8;
+    d->instante    = instante > c->inicio ? instante - c->inicio : 0;
+    d->do_servidor = origem == porta_servidor;
+
+    d->cliente.sin_family      = AF_INET;
+    d->cliente.sin_addr.s_addr = d->do_servidor ? ip_destino : ip_origem;
+    d->cliente.sin_port        = htons(d->do_servidor ? destino : origem);
+
+    d->fila = indice_cliente(c, d->cliente.sin_addr.s_addr,
+            ntohs(d->cliente.sin_port));
+
+    c->do_servidor += d->do_servidor;
+}
+
+/**
+ * Le os quadros de uma captura pcap
+ *
+ * \param c A captura
+ * \param troca Arquivo na ordem de bytes inversa da local
+ * \param ns Instantes em nanossegundos, e nao em microssegundos
+ */
+void le_pcap(struct captura_replay *c, int troca, int ns)
+{
+    const uint8_t *q = (const uint8_t *)c->mapa;
+    int enlace = le32(q + 20, troca) & 0xffff;
+    size_t off = 24;
+
+    while (off + 16 <= c->tamanho)
+    {
+        uint32_t seg    = le32(q + off, troca);
+        uint32_t fracao = le32(q + off + 4, troca);
+        uint32_t caplen = le32(q + off + 8, troca);
+
+        if (caplen > c->tamanho - off - 16)
+        {
+            fprintf(stderr, "replay: captura truncada no quadro %lu\n",
+                    c->quadros + 1);
+            break;
+        }
+
+        extrai_datagrama(c, q + off + 16, caplen, enlace,
+                (uint64_t)seg * 1000 + fracao / (ns ? 1000000 : 1000));
+
+        off += 16 + caplen;
+    }
+}
+
+/**
+ * Le a resolucao dos instantes nas opcoes de uma interface pcapng
+ *
+ * \return Unidades do instante por segundo (padrao, microssegundos)
+ */
+uint64_t resolucao_pcapng(const uint8_t *q, uint32_t len, int troca)
+{
+    uint32_t off = 0;
+
+    while (off + 4 <= len)
+    {
+        uint16_t codigo  = le16(q + off, troca);
+        uint16_t tamanho = le16(q + off + 2, troca);
+
+        if (codigo == 0 || off + 4 + tamanho > len)
+            break;
+
+        if (codigo == PCAPNG_TSRESOL && tamanho >= 1)
+        {
+            uint8_t r = q[off + 4];
+            uint64_t unidades = 1;
+
+            // bit mais alto: potencia de 2, e nao de 10
+            if (r & 0x80)
+                return (uint64_t)1 << (r & 0x3f);
+
+            while (r--)
+                unidades *= 10;
+
+            return unidades;
+        }
+
+        off += 4 + ((tamanho + 3) & ~3u);
+    }
+
+    return 1000000;
+}
+
+/**
+ * Le os quadros de uma captura pcapng
+ *
+ * \return 0 em caso de sucesso, ou -1 se um bloco for invalido
+ */
+int le_pcapng(struct captura_replay *c)
+{
+    const uint8_t *q = (const uint8_t *)c->mapa;
+    int enlaces[PCAPNG_IFMAX];
+    uint64_t unidades[PCAPNG_IFMAX];
+    int troca = 0, nif = 0;
+    size_t off = 0;
+
+    while (off + 12 <= c->tamanho)
+    {
+        uint32_t tipo = le32(q + off, troca);
+        const uint8_t *corpo = q + off + 8;
+        uint32_t len, corpolen, ifid, caplen;
+        uint64_t ts;
+
+        // cada secao define a sua ordem de bytes e as suas interfaces
+        if (tipo == PCAPNG_SHB)
+        {
+            uint32_t ordem = le32(corpo, 0);
+
+            if (ordem != PCAPNG_ORDEM && ordem != bswap_32(PCAPNG_ORDEM))
+                return -1;
+
+            troca = ordem != PCAPNG_ORDEM;
+            nif = 0;
+        }
+
+        len = le32(q + off + 4, troca);
+
+        if (len < 12 || len % 4 || len > c->tamanho - off)
+            return -1;
+
+        corpolen = len - 12;
+
+        switch (tipo)
+        {
+            case PCAPNG_IDB:
+                if (nif < PCAPNG_IFMAX && corpolen >= 8)
+                {
+                    enlaces[nif]  = le16(corpo, troca);
+                    unidades[nif] = resolucao_pcapng(corpo + 8, corpolen - 8,
+                            troca);
+                    nif++;
+                }
+                break;
+            case PCAPNG_EPB:
+            case PCAPNG_PB:
+                if (corpolen < 20)
+                    break;
+
+                ifid = tipo == PCAPNG_EPB ? le32(corpo, troca)
+                                          : le16(corpo, troca);
+                ts = (uint64_t)le32(corpo + 4, troca) << 32
+                   | le32(corpo + 8, troca);
+                caplen = le32(corpo + 12, troca);
+
+                if ((int)ifid < nif && caplen <= corpolen - 20)
+                {
+                    extrai_datagrama(c, corpo + 20, caplen, enlaces[ifid],
+                            unidades[ifid] >= 1000
+                            ? ts / (unidades[ifid] / 1000)
+                            : ts * 1000 / unidades[ifid]);
+                }
+                break;
+            case PCAPNG_SPB:
+                // sem instante: mantem o do quadro anterior
+                if (nif > 0 && corpolen >= 4)
+                {
+                    caplen = le32(corpo, troca);
+                    if (caplen > corpolen - 4)
+                        caplen = corpolen - 4;
+
+                    extrai_datagrama(c, corpo + 4, caplen, enlaces[0],
+                            c->ultimo);
+                }
+                break;
+        }
+
+        off += len;
+    }
+
+    return 0;
+}
+
+/**
+ * Carrega uma captura, identificando o seu formato
+ *
+ * \return 0 em caso de sucesso, ou -1 em caso de erro
+ */
+int carrega_captura(struct captura_replay *c, const char *arquivo)
+{
+    struct stat st;
+    uint32_t magico;
+    int fd;
+
+    memset(c, 0x0, sizeof(struct captura_replay));
+
+    if ((fd = open(arquivo, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    {
+        perror(arquivo);
+        return -1;
+    }
+
+    c->tamanho = st.st_size;
+
+    if (c->tamanho < 24)
+    {
+        fprintf(stderr, "replay: %s: captura vazia\n", arquivo);
+        close(fd);
+        return -1;
+    }
+
+    c->mapa = mmap(NULL, c->tamanho, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (c->mapa == MAP_FAILED)
+    {
+        perror("mmap");
+        return -1;
+    }
+
+    memcpy(&magico, c->mapa, sizeof(magico));
+
+    if (magico == PCAP_US || magico == PCAP_NS)
+    {
+        le_pcap(c, 0, magico == PCAP_NS);
+    }
+    else if (magico == bswap_32(PCAP_US) || magico == bswap_32(PCAP_NS))
+    {
+        le_pcap(c, 1, magico == bswap_32(PCAP_NS));
+    }
+    else if (magico == PCAPNG_SHB)
+    {
+        if (le_pcapng(c) < 0)
+        {
+            fprintf(stderr, "replay: %s: bloco pcapng invalido\n", arquivo);
+            return -1;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "replay: %s: formato desconhecido\n", arquivo);
+        return -1;
+    }
+
+    c->filas = calloc(c->clientes ? c->clientes : 1,
+            sizeof(struct fila_replay));
+
+    return 0;
+}
+
+/**
+ * Acrescenta uma resposta gerada a fila do cliente
+ */
+void enfileira(struct fila_replay *f, const char *buf, int len)
+{
+    struct resposta_replay *r;
+
+    if (f->n == f->cap)
+    {
+        uint32_t cap = f->cap ? f->cap * 2 : REPLAY_FILA;
+        struct resposta_replay *novo = malloc(cap
+                * sizeof(struct resposta_replay));
+        uint32_t i;
+
+        for (i = 0; i < f->n; i++)
+            novo[i] = f->r[(f->ini + i) % f->cap];
+
+        free(f->r);
+        f->r   = novo;
+        f->cap = cap;
+        f->ini = 0;
+    }
+
+    r = &f->r[(f->ini + f->n++) % f->cap];
+    r->len = len;
+    memcpy(r->dados, buf, len);
+}
+
+/**
+ * Compara uma resposta capturada com uma gerada
+ *
+ * \return 0 se forem iguais
+ */
+int compara_resposta(struct pacote_sdtp *a, struct pacote_sdtp *b)
+{
+    // os numeros do SYN-ACK sao o cookie, sorteado a cada execucao
+    int synack = (a->flags & TH_SYN) != 0;
+
+    return a->versao != b->versao
+        || a->flags != b->flags
+        || (!synack && (a->seqnum != b->seqnum || a->acknum != b->acknum))
+        || (confere_janela && a->window != b->window)
+        || a->datalen != b->datalen
+        || memcmp(a->dados, b->dados, a->datalen) != 0;
+}
+
+/**
+ * Imprime uma resposta, para o detalhamento das diferencas
+ */
+void imprime_resposta(const char *rotulo, struct pacote_sdtp *p)
+{
+    if (p == NULL)
+    {
+        printf("    %-9s nenhuma\n", rotulo);
+        return;
+    }
+
+    printf("    %-9s v%d flags 0x%02x seq %u ack %u janela %u dados %u\n",
+            rotulo, p->versao, p->flags, p->seqnum, p->acknum, p->window,
+            p->datalen);
+}
+
+/**
+ * Detalha uma diferenca, ate max_diferencas
+ */
+void detalha_diferenca(struct resultado_replay *res, uint32_t i,
+        struct datagrama_replay *d, struct pacote_sdtp *capturada,
+        struct pacote_sdtp *gerada)
+{
+    char ip[INET_ADDRSTRLEN];
+
+    if (res->diferentes + res->inesperadas > (unsigned long)max_diferencas)
+        return;
+
+    inet_ntop(AF_INET, &d->cliente.sin_addr, ip, sizeof(ip));
+    printf("  datagrama %u (%s:%d, %.3f s):\n", i + 1, ip,
+            ntohs(d->cliente.sin_port), d->instante / 1000.0);
+    imprime_resposta("capturada", capturada);
+    imprime_resposta("gerada", gerada);
+}
+
+/**
+ * Confere uma resposta capturada com as geradas pendentes do cliente
+ *
+ * \param c A captura
+ * \param i Indice do datagrama capturado
+ * \param res Contagens da passagem
+ */
+void confere_resposta(struct captura_replay *c, uint32_t i,
+        struct resultado_replay *res)
+{
+    struct datagrama_replay *d = &c->d[i];
+    struct fila_replay *f = &c->filas[d->fila];
+    struct pacote_sdtp capturada, gerada;
+    uint32_t k, alcance = f->n < REPLAY_ALCANCE ? f->n : REPLAY_ALCANCE;
+
+    if (sdtp_decodifica((void *)d->dados, d->len, &capturada) < 0
+            ||
+        checksum((void *)d->dados, sdtp_cabecalho(capturada.versao)
+            + capturada.datalen) != 0)
+    {
+        res->corrompidas++;
+        return;
+    }
+
+    if (f->n == 0)
+    {
+        res->inesperadas++;
+        detalha_diferenca(res, i, d, &capturada, NULL);
+        return;
+    }
+
+    for (k = 0; k < alcance; k++)
+    {
+        struct resposta_replay *r = &f->r[(f->ini + k) % f->cap];
+
+        sdtp_decodifica(r->dados, r->len, &gerada);
+
+        if (compara_resposta(&capturada, &gerada) == 0)
+            break;
+    }
+
+    // as geradas antes da capturada foram perdidas na saida original
+    if (k < alcance)
+    {
+        res->iguais++;
+        res->perdidas += k;
+        k++;
+    }
+    else
+    {
+        res->diferentes++;
+        sdtp_decodifica(f->r[f->ini].dados, f->r[f->ini].len, &gerada);
+        detalha_diferenca(res, i, d, &capturada, &gerada);
+        k = 1;
+    }
+
+    f->ini = (f->ini + k) % f->cap;
+    f->n  -= k;
+}
+
+/**
+ * Reproduz a captura uma vez, do primeiro ao ultimo datagrama, e remove
+ * as conexoes restantes
+ *
+ * \param c A captura
+ * \param res Contagens da passagem, ou NULL para nao conferir as respostas
+ *
+ * \return O tempo do tratamento dos datagramas (us)
+ */
+uint64_t reproduz(struct captura_replay *c, struct resultado_replay *res)
+{
+    struct worker_sdtp *w = &worker;
+    uint64_t base = w->ev.agora, t;
+    unsigned long segmentos = 0;
+    uint32_t i;
+
+    t = agora_us();
+
+    for (i = 0; i < c->n; i++)
+    {
+        struct datagrama_replay *d = &c->d[i];
+        struct pacote_sdtp p;
+        int tamseg = d->len, off, n, len;
+
+        // os prazos seguem o relogio da captura
+        evloop_avanca(&w->ev, base + d->instante);
+
+        if (d->do_servidor)
+        {
+            if (res != NULL)
+                confere_resposta(c, i, res);
+
+            continue;
+        }
+
+        // segmentos agregados (GSO) tem o tamanho do primeiro, menos o
+        // ultimo
+        if (sdtp_decodifica((void *)d->dados, d->len, &p) == 0)
+        {
+            int primeiro = sdtp_cabecalho(p.versao) + p.datalen;
+
+            if (primeiro < tamseg
+                    &&
+                sdtp_decodifica((void *)(d->dados + primeiro),
+                    d->len - primeiro, &p) == 0)
+            {
+                tamseg = primeiro;
+            }
+        }
+
+        for (off = 0; off < (int)d->len; off += tamseg)
+        {
+            n = (int)d->len - off < tamseg ? (int)d->len - off : tamseg;
+
+            memcpy(segmento, d->dados + off, n);
+            len = trata_pacote(w, segmento, n, &d->cliente);
+            segmentos++;
+
+            if (len > 0 && res != NULL)
+            {
+                enfileira(&c->filas[d->fila], segmento, len);
+                res->respostas++;
+            }
+        }
+    }
+
+    t = agora_us() - t;
+
+    // alem de todos os prazos, nenhuma conexao resta
+    evloop_avanca(&w->ev, w->ev.agora + PRAZO_HANDSHAKE + PRAZO_OCIOSO
+            + PRAZO_LINGER);
+
+    if (LE(w->est.conexoes) != 0)
+    {
+        LOG(NIVEL_AVISO, "replay: %lu conexoes restantes",
+                LE(w->est.conexoes));
+    }
+
+    if (res != NULL)
+    {
+        res->segmentos = segmentos;
+
+        for (i = 0; i < c->clientes; i++)
+        {
+            res->perdidas += c->filas[i].n;
+            c->filas[i].n = 0;
+        }
+    }
+
+    return t;
+}
+
+int compara_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[])
+{
+    struct captura_replay c;
+    struct resultado_replay res;
+    struct estatisticas_sdtp *est = &worker.est;
+    uint64_t tempos[REPLAY_MAXPASSAGENS];
+    int passagens = REPLAY_PASSAGENS;
+    int nivel = NIVEL_ERRO;
+    unsigned long segmentos;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "p:n:M:Wv:l:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p':
+                porta_servidor = atoi(optarg);
+                break;
+            case 'n':
+                passagens = atoi(optarg);
+                break;
+            case 'M':
+                orcamento = (size_t)atol(optarg) << 20;
+                break;
+            case 'W':
+                confere_janela = 0;
+                break;
+            case 'v':
+                max_diferencas = atoi(optarg);
+                break;
+            case 'l':
+                nivel = atoi(optarg);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        printf("Erro: uso correto: ./replay_sdtp [-p porta] [-n passagens] "
+                "[-M memoria_mb] [-W] [-v diferencas] [-l nivel] "
+                "captura\n");
+        return 1;
+    }
+
+    if (passagens < 0 || passagens > REPLAY_MAXPASSAGENS)
+    {
+        printf("Erro: as passagens devem estar entre 0 e %d\n",
+                REPLAY_MAXPASSAGENS);
+        return 1;
+    }
+
+    if (nivel < NIVEL_ERRO || nivel > NIVEL_DEBUG)
+    {
+        printf("Erro: o nivel de log deve estar entre %d e %d\n",
+                NIVEL_ERRO, NIVEL_DEBUG);
+        return 1;
+    }
+
+    log_init(NULL, nivel);
+
+    if (carrega_captura(&c, argv[optind]) < 0)
+    {
+        log_finaliza();
+        return 1;
+    }
+
+    // no v1, o FIN e conferido com o checksum do lorem_ipsum.txt, como no
+    // servidor
+    FILE *loremfile = fopen("./lorem_ipsum.txt", "r");
+    char loremdata[LOREMSIZE];
+
+    if (loremfile != NULL
+            &&
+        fread(loremdata, 1, LOREMSIZE, loremfile) == LOREMSIZE)
+    {
+        datasum = checksum((void *)loremdata, LOREMSIZE);
+    }
+    else
+    {
+        fprintf(stderr, "replay: sem o ./lorem_ipsum.txt, os FINs v1 "
+                "serao respondidos com RST\n");
+    }
+
+    if (loremfile != NULL)
+        fclose(loremfile);
+
+    // worker sem socket, como o preparado pelo main do servidor, mas
+    // deterministico: sem erros simulados e sem SYN cookies
+    simulacao.ativa = 0;
+    limiar_cookies  = INT_MAX;
+    semeia_gerador(&worker, 1, 0);
+    pool_init(&worker.pool_sockets, sizeof(struct socket_sdtp),
+            SOCKETS_SLAB);
+    pool_init(&worker.pool_blocos, BLOCO, BLOCOS_SLAB);
+
+    if (init_tabela(&worker.tabela) < 0 || evloop_init(&worker.ev) < 0)
+    {
+        perror("evloop");
+        return 1;
+    }
+
+    printf("Replay: %s: %u datagramas (%u dos clientes, %u do servidor), "
+            "%u clientes, %.3f s; %lu quadros ignorados, %lu fragmentos\n",
+            argv[optind], c.n, c.n - c.do_servidor, c.do_servidor,
+            c.clientes, c.n ? c.d[c.n - 1].instante / 1000.0 : 0.0,
+            c.ignorados, c.fragmentos);
+
+    memset(&res, 0x0, sizeof(res));
+    reproduz(&c, &res);
+
+    printf("  conferencia: %lu segmentos, %lu respostas geradas; "
+            "%lu iguais, %lu perdidas, %lu diferentes, %lu inesperadas "
+            "(%lu capturadas corrompidas)\n",
+            res.segmentos, res.respostas, res.iguais, res.perdidas,
+            res.diferentes, res.inesperadas, res.corrompidas);
+    printf("  servidor: %lu handshakes, %lu concluidas, %lu rsts, "
+            "%lu duplicados, %lu fora da janela, %lu checksums invalidos\n",
+            LE(est->handshakes), LE(est->concluidas), LE(est->rsts),
+            LE(est->duplicados), LE(est->fora_janela),
+            LE(est->checksum_invalidos));
+
+    segmentos = res.segmentos;
+
+    for (i = 0; i < passagens; i++)
+        tempos[i] = reproduz(&c, NULL);
+
+    if (passagens > 0 && segmentos > 0)
+    {
+        uint64_t mediana;
+
+        qsort(tempos, passagens, sizeof(uint64_t), compara_u64);
+        mediana = tempos[passagens / 2] ? tempos[passagens / 2] : 1;
+
+        printf("  %d passagens: %.0f segmentos/s, %.1f ns/segmento "
+                "(mediana; minimo %.1f)\n", passagens,
+                segmentos * 1e6 / mediana, mediana * 1e3 / segmentos,
+                tempos[0] * 1e3 / segmentos);
+    }
+
+    evloop_destroy(&worker.ev);
+    log_finaliza();
+
+    return res.diferentes > 0 || res.inesperadas > 0;
+}
@@ -4,8 +4,20 @@
  * @author Joao Borges
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 
 #include "sdtp.h"
 
@@ -31,20 +43,15 @@
 int recvtimeout(int s, char *buf, int len, int timeout, 
         struct sockaddr *dest, int *destlen)
 {
-    fd_set fds;
+    struct pollfd pfd;
     int n;
-    struct timeval tv;
 
-    // set up the file descriptor set
-    FD_ZERO(&fds);
-    FD_SET(s, &fds);
-
-    // set up the struct timeval for the timeout
-    tv.tv_sec = (int)timeout/1000;
-    tv.tv_usec = (int)(timeout%1000)*1000;
+    // poll nao depende do valor do descritor (sem limite FD_SETSIZE)
+    pfd.fd = s;
+    pfd.events = POLLIN;
 
     // wait until timeout or data received
-    n = select(s+1, &fds, NULL, NULL, &tv);
+    n = poll(&pfd, 1, timeout);
     if (n == 0) return -2; // timeout!
     if (n == -1) return -1; // error
 
@@ -53,50 +60,2604 @@ int recvtimeout(int s, char *buf, int len, int timeout,
 }
 
 /**
- * Calcula o checksum de um determinado pacote, seguindo a RFC 1071
+ * Retorna o instante atual de um relogio monotonico, em milisegundos
+ */
+uint64_t agora_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Retorna o instante atual de um relogio monotonico, em microsegundos
+ */
+uint64_t agora_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Inicializa o estimador com ESTIMATEDRTT e DEVRTT
+ */
+void rtt_init(struct rtt_sdtp *r)
+{
+    r->srtt     = ESTIMATEDRTT;
+    r->rttvar   = DEVRTT;
+    r->recuo    = 0;
+    r->amostras = 0;
+}
+
+/**
+ * Atualiza o estimador com uma amostra de RTT, desfazendo o recuo
  *
- * @param hdr Ponteiro para o inicio dos dados a somar
- * @param count A quantidade de bytes a contabilizar nesta soma
+ * @param r O estimador
+ * @param ms O RTT medido (ms) de um segmento nao retransmitido
+ */
+void rtt_amostra(struct rtt_sdtp *r, double ms)
+{
+    if (r->amostras++ == 0)
+    {
+        r->srtt   = ms;
+        r->rttvar = ms / 2;
+    }
+    else
+    {
+        double desvio = ms > r->srtt ? ms - r->srtt : r->srtt - ms;
+
+        // o desvio usa o RTT estimado anterior a esta amostra
+        r->rttvar = (1 - BETA) * r->rttvar + BETA * desvio;
+        r->srtt   = (1 - ALPHA) * r->srtt + ALPHA * ms;
+    }
+
+    r->recuo = 0;
+}
+
+/**
+ * Dobra o RTO apos uma expiracao, ate RTOMAX
+ */
+void rtt_recua(struct rtt_sdtp *r)
+{
+    if (r->recuo < RTT_RECUO_MAX && (rtt_rto(r) << 1) <= RTOMAX)
+        r->recuo++;
+}
+
+/**
+ * Retorna o RTO atual (ms), ja com o recuo e os limites aplicados
+ */
+uint64_t rtt_rto(struct rtt_sdtp *r)
+{
+    uint64_t rto = (uint64_t)(r->srtt + 4 * r->rttvar + 0.5);
+
+    if (rto < RTOMIN)
+        rto = RTOMIN;
+
+    rto <<= r->recuo;
+
+    return rto < RTOMAX ? rto : RTOMAX;
+}
+
+/**
+ * Inicializa o laco de eventos
  *
- * @return O valor do checksum contabilizado
+ * @return 0 em caso de sucesso, -1 em caso de erro
  */
-uint16_t checksum(void *hdr, int count)
+int evloop_init(struct evloop_sdtp *ev)
 {
-    long sum = 0;
-    uint16_t *addr = (uint16_t *)hdr;
+    int n, i;
 
-    while(count > 1)
+    memset(ev, 0x0, sizeof(struct evloop_sdtp));
+
+    if ((ev->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        return -1;
+
+    // cada posicao da roda e uma lista circular com cabeca
+    for (n = 0; n < RODA_NIVEIS; n++)
     {
-        sum += *(addr++);
-        count -= 2;
+        for (i = 0; i < RODA_POSICOES; i++)
+        {
+            ev->roda[n][i].prox = &ev->roda[n][i];
+            ev->roda[n][i].ant  = &ev->roda[n][i];
+        }
     }
 
-    while (sum>>16)
+    ev->agora = agora_ms();
+
+    return 0;
+}
+
+/**
+ * Libera os recursos do laco de eventos
+ */
+void evloop_destroy(struct evloop_sdtp *ev)
+{
+    close(ev->epfd);
+    ev->epfd = -1;
+}
+
+/**
+ * Registra um descritor no laco de eventos
+ *
+ * @param ev O laco de eventos
+ * @param e Registro do descritor (deve existir enquanto registrado)
+ * @param fd Descritor a monitorar
+ * @param eventos Eventos desejados (EPOLLIN, EPOLLOUT, ...)
+ * @param cb Funcao chamada quando o descritor ficar pronto
+ * @param arg Argumento livre do chamador
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int evloop_add_fd(struct evloop_sdtp *ev, struct evfd_sdtp *e, int fd,
+        uint32_t eventos, evfd_cb cb, void *arg)
+{
+    struct epoll_event evt;
+
+    e->fd  = fd;
+    e->cb  = cb;
+    e->arg = arg;
+
+    evt.events   = eventos;
+    evt.data.ptr = e;
+
+    return epoll_ctl(ev->epfd, EPOLL_CTL_ADD, fd, &evt);
+}
+
+/**
+ * Remove o registro de um descritor do laco de eventos
+ */
+int evloop_del_fd(struct evloop_sdtp *ev, struct evfd_sdtp *e)
+{
+    return epoll_ctl(ev->epfd, EPOLL_CTL_DEL, e->fd, NULL);
+}
+
+/**
+ * Inicializa um temporizador, ainda desarmado
+ */
+void timer_init(struct timer_sdtp *t, timer_cb cb, void *arg)
+{
+    t->prox   = NULL;
+    t->ant    = NULL;
+    t->expira = 0;
+    t->cb     = cb;
+    t->arg    = arg;
+}
+
+/**
+ * Retira um temporizador da lista em que estiver
+ */
+static void timer_retira(struct timer_sdtp *t)
+{
+    t->ant->prox = t->prox;
+    t->prox->ant = t->ant;
+    t->prox = NULL;
+    t->ant  = NULL;
+}
+
+/**
+ * Insere um temporizador no fim de uma lista
+ */
+static void timer_insere(struct timer_sdtp *lista, struct timer_sdtp *t)
+{
+    t->prox = lista;
+    t->ant  = lista->ant;
+    lista->ant->prox = t;
+    lista->ant = t;
+}
+
+/**
+ * Coloca um temporizador na posicao da roda correspondente ao seu prazo,
+ * no nivel mais baixo capaz de representa-lo
+ *
+ * A distancia e contada a partir do proximo instante a processar
+ * (ev->agora + 1); prazos ja vencidos vao para esse instante.
+ */
+static void timer_posiciona(struct evloop_sdtp *ev, struct timer_sdtp *t)
+{
+    uint64_t base = ev->agora + 1;
+    uint64_t expira = t->expira > base ? t->expira : base;
+    uint64_t dist = expira - base;
+    int n;
+
+    for (n = 0; n < RODA_NIVEIS - 1; n++)
     {
-        sum = (sum & 0xffff) + (sum>>16);
+        if (dist < (uint64_t)1 << (RODA_BITS * (n + 1)))
+            break;
     }
 
-    if (count > 0)
-        sum += *(uint8_t *)addr;
-        
-    return (uint16_t)~sum;
+    // alem do ultimo nivel, aguarda na ultima posicao alcancavel
+    if (dist >> (RODA_BITS * RODA_NIVEIS))
+        expira = base + ((uint64_t)1 << (RODA_BITS * RODA_NIVEIS)) - 1;
+
+    timer_insere(&ev->roda[n][(expira >> (RODA_BITS * n))
+            & (RODA_POSICOES - 1)], t);
 }
 
 /**
- * Funcao de ajuda que imprime o conteudo de um pacote STDP na tela
+ * Arma (ou rearma) um temporizador para expirar apos ms milisegundos
+ */
+void timer_arma(struct evloop_sdtp *ev, struct timer_sdtp *t, uint64_t ms)
+{
+    timer_desarma(ev, t);
+
+    // o prazo conta a partir do ultimo instante processado pela roda,
+    // ja que os temporizadores so disparam quando a roda avanca
+    t->expira = ev->agora + (ms ? ms : 1);
+
+    timer_posiciona(ev, t);
+    ev->ntimers++;
+}
+
+/**
+ * Desarma um temporizador, caso esteja armado
+ */
+void timer_desarma(struct evloop_sdtp *ev, struct timer_sdtp *t)
+{
+    if (timer_armado(t))
+    {
+        timer_retira(t);
+        ev->ntimers--;
+    }
+}
+
+/**
+ * Calcula quantos milisegundos faltam ate a proxima posicao ocupada da
+ * roda: a expiracao exata, no nivel 0, ou a cascata que trara prazos de
+ * um nivel superior para baixo
  *
- * @param p Ponteiro para o pacote sdtp
+ * @return A espera em ms, ou -1 se nao houver temporizadores
  */
-void printpacket(struct sdtphdr *p)
+int evloop_proximo(struct evloop_sdtp *ev)
 {
-    printf("\nImprimindo Pacote (%x)\n",p);
-    printf("\tseqnum:   %d\n",p->seqnum);
-    printf("\tacknum:   %d\n",p->acknum);
-    printf("\tdatalen:  %d\n",p->datalen);
-    printf("\tflags:    0x%x\n",p->flags);
-    printf("\twindow:   %d\n",p->window);
-    printf("\tchecksum: 0x%x\n",p->checksum);
-    if (p->datalen)
-        printf("\tdata:     %s\n\n",(char *)p+sizeof(struct sdtphdr));
+    uint64_t base = ev->agora + 1;
+    uint64_t proximo = UINT64_MAX;
+    int n, d;
+
+    if (ev->ntimers == 0)
+        return -1;
+
+    for (n = 0; n < RODA_NIVEIS; n++)
+    {
+        int bits = RODA_BITS * n;
+
+        // uma posicao do nivel n desce quando os niveis abaixo completam
+        // a volta; a posicao atual so se ainda nao tiver descido
+        d = n == 0 || (base & (((uint64_t)1 << bits) - 1)) == 0 ? 0 : 1;
+
+        for (; d <= RODA_POSICOES; d++)
+        {
+            uint64_t instante = ((base >> bits) + d) << bits;
+            struct timer_sdtp *lista = &ev->roda[n][((base >> bits) + d)
+                & (RODA_POSICOES - 1)];
+
+            if (instante >= proximo)
+                break;
+
+            if (lista->prox != lista)
+            {
+                proximo = instante;
+                break;
+            }
+        }
+    }
+
+    return proximo - ev->agora < INT32_MAX ? (int)(proximo - ev->agora)
+                                           : INT32_MAX;
+}
+
+/**
+ * Calcula a espera do laco de eventos pelo proximo temporizador, no
+ * relogio real
+ *
+ * @return A espera em ms, 0 se a roda estiver atrasada, ou -1 se nao
+ * houver temporizadores
+ */
+static int evloop_espera(struct evloop_sdtp *ev)
+{
+    // a roda esta atrasada, processa imediatamente
+    if (ev->ntimers != 0 && agora_ms() > ev->agora)
+        return 0;
+
+    return evloop_proximo(ev);
+}
+
+/**
+ * Devolve a roda os temporizadores de uma posicao de um nivel superior,
+ * agora ao alcance dos niveis abaixo
+ *
+ * @return O indice da posicao, que, sendo 0, indica que o nivel acima
+ * tambem completou a volta
+ */
+static int evloop_cascata(struct evloop_sdtp *ev, int n)
+{
+    int i = ((ev->agora + 1) >> (RODA_BITS * n)) & (RODA_POSICOES - 1);
+    struct timer_sdtp *lista = &ev->roda[n][i];
+
+    while (lista->prox != lista)
+    {
+        struct timer_sdtp *t = lista->prox;
+
+        timer_retira(t);
+        timer_posiciona(ev, t);
+    }
+
+    return i;
+}
+
+/**
+ * Avanca a roda ate o instante agora, disparando os temporizadores
+ * expirados
+ *
+ * @return A quantidade de temporizadores disparados
+ */
+int evloop_avanca(struct evloop_sdtp *ev, uint64_t agora)
+{
+    struct timer_sdtp expirados;
+    int n = 0;
+
+    if (ev->ntimers == 0 || agora <= ev->agora)
+    {
+        if (agora > ev->agora)
+            ev->agora = agora;
+
+        return 0;
+    }
+
+    expirados.prox = &expirados;
+    expirados.ant  = &expirados;
+
+    while (ev->agora < agora)
+    {
+        struct timer_sdtp *lista;
+        int i = (ev->agora + 1) & (RODA_POSICOES - 1);
+        int nivel;
+
+        // ao completar a volta de um nivel, desce a proxima posicao do
+        // nivel acima, e assim por diante
+        for (nivel = 1; i == 0 && nivel < RODA_NIVEIS; nivel++)
+        {
+            if (evloop_cascata(ev, nivel) != 0)
+                break;
+        }
+
+        ev->agora++;
+        lista = &ev->roda[0][i];
+
+        while (lista->prox != lista)
+        {
+            struct timer_sdtp *t = lista->prox;
+
+            timer_retira(t);
+            timer_insere(&expirados, t);
+        }
+    }
+
+    // dispara fora da roda, ja que as funcoes podem rearmar ou desarmar
+    // qualquer temporizador, inclusive os ainda nao disparados
+    while (expirados.prox != &expirados)
+    {
+        struct timer_sdtp *t = expirados.prox;
+
+        timer_retira(t);
+        ev->ntimers--;
+        n++;
+
+        t->cb(t);
+    }
+
+    return n;
+}
+
+/**
+ * Executa uma iteracao do laco de eventos: aguarda ate timeout
+ * milisegundos (ou ate o proximo temporizador), dispara os temporizadores
+ * expirados e trata os descritores prontos
+ *
+ * A roda avanca antes dos descritores, para que os prazos armados por
+ * eles contem do instante atual, e nao do fim da espera anterior.
+ *
+ * @param ev O laco de eventos
+ * @param timeout Maximo de espera (ms), -1 para aguardar indefinidamente
+ *
+ * @return A quantidade de descritores e temporizadores tratados, ou -1 em
+ * caso de erro
+ */
+int evloop_executa(struct evloop_sdtp *ev, int timeout)
+{
+    int espera = evloop_espera(ev);
+    int n, i, disparados;
+
+    if (espera < 0 || (timeout >= 0 && timeout < espera))
+        espera = timeout;
+
+    n = epoll_wait(ev->epfd, ev->eventos, EVLOOP_EVENTOS, espera);
+
+    if (n < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+
+        n = 0;
+    }
+
+    disparados = evloop_avanca(ev, agora_ms());
+
+    for (i = 0; i < n; i++)
+    {
+        struct evfd_sdtp *e = (struct evfd_sdtp *)ev->eventos[i].data.ptr;
+
+        e->cb(e, ev->eventos[i].events);
+    }
+
+    return n + disparados;
+}
+
+/**
+ * Retorna o segmento da posicao i (a partir do mais antigo) da janela
+ */
+static inline struct segmento_sdtp *envio_seg(struct envio_sdtp *e,
+        uint32_t i)
+{
+    return &e->seg[(e->ini + i) % ENVIO_SEGMENTOS];
+}
+
+/**
+ * (Re)transmite um segmento, registrando o instante do envio
+ */
+static void envio_transmite(struct envio_sdtp *e, struct segmento_sdtp *seg)
+{
+    seg->enviado = agora_us();
+
+    if (seg->transmissoes++)
+        e->retransmissoes++;
+
+    e->segmentos++;
+
+    e->transmite(e, seg);
+
+    if (e->modo == ENVIO_SR)
+        timer_arma(e->ev, &seg->timer, rtt_rto(&e->rtt));
+}
+
+/**
+ * Raiz cubica pelo metodo de Newton, evitando depender da libm
+ */
+static double raiz_cubica(double x)
+{
+    double r = x > 1 ? x / 3 : 1;
+    int i;
+
+    if (x <= 0)
+        return 0;
+
+    for (i = 0; i < 64; i++)
+    {
+        double prox = (2 * r + x / (r * r)) / 3;
+
+        if (prox >= r && i > 0)
+            break;
+
+        r = prox;
+    }
+
+    return r;
+}
+
+/**
+ * Reno: aumenta cwnd em um MSS a cada janela inteira confirmada
+ */
+static void reno_aumenta(struct congestao_sdtp *c, uint32_t confirmados,
+        double srtt)
+{
+    c->acumulado += confirmados;
+
+    if (c->acumulado >= c->cwnd)
+    {
+        c->acumulado -= c->cwnd;
+        c->cwnd += c->mss;
+    }
+}
+
+/**
+ * Reno: ssthresh passa a metade dos bytes em transito
+ */
+static uint32_t reno_reduz(struct congestao_sdtp *c, uint32_t transito)
+{
+    uint32_t metade = transito / 2;
+
+    return metade > 2 * c->mss ? metade : 2 * c->mss;
+}
+
+/**
+ * CUBIC: cwnd segue W(t) = C (t - K)^3 + wmax desde o inicio da epoca,
+ * sem ficar abaixo da estimativa do Reno (regiao amigavel ao TCP)
+ */
+static void cubic_aumenta(struct congestao_sdtp *c, uint32_t confirmados,
+        double srtt)
+{
+    double cwnd = (double)c->cwnd / c->mss;
+    double rtt = srtt > 0 ? srtt / 1000 : 0.001;
+    double t, alvo, reno;
+    uint64_t agora = agora_ms();
+    uint32_t acks;
+
+    // a epoca comeca no primeiro aumento apos uma perda
+    if (c->epoca == 0)
+    {
+        c->epoca = agora;
+
+        if (cwnd < c->wmax)
+        {
+            c->k = raiz_cubica((c->wmax - cwnd) / CUBIC_C);
+            c->origem = c->wmax;
+        }
+        else
+        {
+            c->k = 0;
+            c->origem = cwnd;
+        }
+    }
+
+    t = (agora - c->epoca) / 1000.0 + rtt;
+    alvo = CUBIC_C * (t - c->k) * (t - c->k) * (t - c->k) + c->origem;
+
+    reno = c->wmax * CUBIC_BETA
+         + 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * (t / rtt);
+
+    if (reno > alvo)
+        alvo = reno;
+
+    // bytes a confirmar para cada MSS de aumento
+    if (alvo > cwnd)
+        acks = (uint32_t)(cwnd / (alvo - cwnd) * c->mss);
+    else
+        acks = 100 * c->cwnd;
+
+    if (acks < c->mss / 2 + 1)
+        acks = c->mss / 2 + 1;
+
+    c->acumulado += confirmados;
+
+    while (c->acumulado >= acks)
+    {
+        c->acumulado -= acks;
+        c->cwnd += c->mss;
+    }
 }
 
+/**
+ * CUBIC: registra wmax (com convergencia rapida) e reduz pelo fator beta
+ */
+static uint32_t cubic_reduz(struct congestao_sdtp *c, uint32_t transito)
+{
+    double cwnd = (double)c->cwnd / c->mss;
+    uint32_t ssthresh = (uint32_t)(c->cwnd * CUBIC_BETA);
+
+    // perdas seguidas antes de recuperar wmax liberam banda mais depressa
+    if (cwnd < c->wmax)
+        c->wmax = cwnd * (1 + CUBIC_BETA) / 2;
+    else
+        c->wmax = cwnd;
+
+    c->epoca = 0;
+
+    return ssthresh > 2 * c->mss ? ssthresh : 2 * c->mss;
+}
+
+/**
+ * Implementacoes do controle de congestionamento, a primeira sendo a
+ * padrao, terminadas por uma entrada com nome NULL
+ */
+const struct congestao_impl congestao_impls[] =
+{
+    { "reno",  reno_aumenta,  reno_reduz  },
+    { "cubic", cubic_aumenta, cubic_reduz },
+    { NULL,    NULL,          NULL        }
+};
+
+/**
+ * Inicia um episodio de perda: calcula o novo ssthresh e encerra a epoca
+ * do CUBIC
+ */
+static void congestao_perda(struct envio_sdtp *e)
+{
+    struct congestao_sdtp *c = &e->cc;
+
+    c->ssthresh  = c->impl->reduz(c, e->proximo - e->base);
+    c->acumulado = 0;
+    c->seguidos  = 0;
+}
+
+/**
+ * Trata um ACK duplicado: retransmissao rapida no CONGESTAO_DUPACKS-esimo,
+ * e crescimento da janela durante a recuperacao rapida
+ */
+static void congestao_dupack(struct envio_sdtp *e)
+{
+    struct congestao_sdtp *c = &e->cc;
+    struct segmento_sdtp *seg = envio_seg(e, 0);
+
+    if (c->recuperacao)
+    {
+        c->cwnd += c->mss;
+        return;
+    }
+
+    // perdas do mesmo episodio (antes de recupera) nao reduzem de novo
+    if (++c->seguidos < CONGESTAO_DUPACKS || e->base < c->recupera)
+        return;
+
+    congestao_perda(e);
+
+    c->cwnd        = c->ssthresh + CONGESTAO_DUPACKS * c->mss;
+    c->recuperacao = 1;
+    c->recupera    = e->proximo;
+    c->rapidas++;
+
+    if (!seg->sackeado)
+        envio_transmite(e, seg);
+}
+
+/**
+ * Trata um ACK que confirma novos dados, ja liberados da janela
+ *
+ * @param e O motor de envio
+ * @param confirmados Bytes confirmados por este ACK
+ */
+static void congestao_ack(struct envio_sdtp *e, uint32_t confirmados)
+{
+    struct congestao_sdtp *c = &e->cc;
+
+    c->seguidos = 0;
+
+    if (c->recuperacao)
+    {
+        if (e->base >= c->recupera)
+        {
+            // todos os dados do episodio confirmados: fim da recuperacao
+            c->recuperacao = 0;
+            c->cwnd = c->ssthresh;
+        }
+        else
+        {
+            // ACK parcial: a proxima lacuna tambem foi perdida; desinfla
+            // cwnd pelo confirmado e a retransmite
+            c->cwnd -= confirmados < c->cwnd - c->mss
+                ? confirmados : c->cwnd - c->mss;
+            c->cwnd += c->mss;
+
+            if (e->nseg && !envio_seg(e, 0)->sackeado)
+                envio_transmite(e, envio_seg(e, 0));
+        }
+    }
+    else if (c->cwnd < c->ssthresh)
+    {
+        c->cwnd += confirmados < c->mss ? confirmados : c->mss;
+    }
+    else
+    {
+        c->impl->aumenta(c, confirmados, e->rtt.srtt);
+    }
+}
+
+/**
+ * Trata a expiracao do temporizador: perda grave, cwnd volta a um MSS
+ */
+static void congestao_expira(struct envio_sdtp *e)
+{
+    struct congestao_sdtp *c = &e->cc;
+
+    // no recuo seguido do mesmo segmento, o ssthresh nao e reduzido de novo
+    if (e->rtt.recuo <= 1)
+        congestao_perda(e);
+
+    c->cwnd        = c->mss;
+    c->recuperacao = 0;
+    c->recupera    = e->proximo;
+    c->expiracoes++;
+}
+
+/**
+ * Trata uma expiracao do segmento mais antigo: recuo do RTO e perda grave
+ * para o controle de congestionamento, ou, apos ENVIO_EXPIRACOES seguidas
+ * sem progresso, o abandono do envio
+ *
+ * @return 0 para retransmitir, -1 se o envio foi abandonado (e nao deve
+ * mais ser acessado)
+ */
+static int envio_expira(struct envio_sdtp *e)
+{
+    if (++e->expiradas > ENVIO_EXPIRACOES && e->desiste != NULL)
+    {
+        envio_destroy(e);
+        e->desiste(e);
+        return -1;
+    }
+
+    rtt_recua(&e->rtt);
+    congestao_expira(e);
+
+    return 0;
+}
+
+/**
+ * Expiracao do temporizador Go-Back-N: retransmite todos os segmentos em
+ * transito, a partir do mais antigo, exceto os ja confirmados por SACK
+ */
+static void envio_timeout_gbn(struct timer_sdtp *t)
+{
+    struct envio_sdtp *e = (struct envio_sdtp *)t->arg;
+    uint32_t i;
+
+    if (envio_expira(e) < 0)
+        return;
+
+    for (i = 0; i < e->nseg; i++)
+    {
+        if (!envio_seg(e, i)->sackeado)
+            envio_transmite(e, envio_seg(e, i));
+    }
+
+    if (e->nseg)
+        timer_arma(e->ev, &e->timer, rtt_rto(&e->rtt));
+}
+
+/**
+ * Expiracao do temporizador de um segmento (Selective Repeat):
+ * retransmite apenas este segmento
+ */
+static void envio_timeout_sr(struct timer_sdtp *t)
+{
+    struct segmento_sdtp *seg = (struct segmento_sdtp *)
+        ((char *)t - offsetof(struct segmento_sdtp, timer));
+    struct envio_sdtp *e = (struct envio_sdtp *)t->arg;
+
+    // segmentos enviados juntos expiram juntos; o recuo ocorre uma unica
+    // vez, pelo mais antigo
+    if (seg == envio_seg(e, 0) && envio_expira(e) < 0)
+        return;
+
+    envio_transmite(e, seg);
+}
+
+/**
+ * Inicializa o motor de envio
+ *
+ * @param e O motor de envio
+ * @param ev Laco de eventos usado pelos temporizadores
+ * @param modo ENVIO_GBN ou ENVIO_SR
+ * @param dados Dados a enviar (devem existir ate o fim do envio)
+ * @param tamanho Tamanho dos dados
+ * @param mss Maximo de dados por segmento
+ * @param transmite Funcao que monta e envia um segmento
+ * @param arg Argumento livre do chamador
+ */
+void envio_init(struct envio_sdtp *e, struct evloop_sdtp *ev, int modo,
+        const char *dados, uint32_t tamanho, uint32_t mss,
+        envio_cb transmite, void *arg)
+{
+    int i;
+
+    memset(e, 0x0, sizeof(struct envio_sdtp));
+
+    e->modo      = modo;
+    e->dados     = dados;
+    e->tamanho   = tamanho;
+    e->mss       = mss;
+    e->ev        = ev;
+    e->transmite = transmite;
+    e->arg       = arg;
+
+    rtt_init(&e->rtt);
+
+    e->cc.impl     = &congestao_impls[0];
+    e->cc.mss      = mss;
+    e->cc.cwnd     = CONGESTAO_INICIAL * mss;
+    e->cc.ssthresh = UINT32_MAX;
+
+    timer_init(&e->timer, envio_timeout_gbn, e);
+
+    for (i = 0; i < ENVIO_SEGMENTOS; i++)
+        timer_init(&e->seg[i].timer, envio_timeout_sr, e);
+}
+
+/**
+ * Seleciona o controle de congestionamento do motor de envio, antes do
+ * inicio do envio
+ *
+ * @param e O motor de envio
+ * @param nome Nome da implementacao (ver congestao_impls)
+ *
+ * @return 0 em caso de sucesso, -1 se a implementacao nao existir
+ */
+int envio_congestao(struct envio_sdtp *e, const char *nome)
+{
+    const struct congestao_impl *impl;
+
+    for (impl = congestao_impls; impl->nome != NULL; impl++)
+    {
+        if (strcmp(impl->nome, nome) == 0)
+        {
+            e->cc.impl = impl;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Ajusta o maximo de dados por segmento, e a janela de congestionamento
+ * inicial, antes do inicio do envio (por exemplo, apos a negociacao do
+ * cabecalho v2)
+ */
+void envio_mss(struct envio_sdtp *e, uint32_t mss)
+{
+    e->mss     = mss;
+    e->cc.mss  = mss;
+    e->cc.cwnd = CONGESTAO_INICIAL * mss;
+}
+
+/**
+ * Desarma os temporizadores do motor de envio
+ */
+void envio_destroy(struct envio_sdtp *e)
+{
+    uint32_t i;
+
+    timer_desarma(e->ev, &e->timer);
+
+    for (i = 0; i < e->nseg; i++)
+        timer_desarma(e->ev, &envio_seg(e, i)->timer);
+
+    e->nseg = 0;
+}
+
+/**
+ * Envia os novos segmentos que couberem na janela
+ *
+ * @return A quantidade de segmentos enviados
+ */
+int envio_envia(struct envio_sdtp *e)
+{
+    // janela efetiva: a menor entre a do receptor e a de congestionamento
+    uint32_t janela = e->janela < e->cc.cwnd ? e->janela : e->cc.cwnd;
+    int n = 0;
+
+    while (e->proximo < e->tamanho && e->nseg < ENVIO_SEGMENTOS)
+    {
+        uint32_t transito = e->proximo - e->base;
+        uint32_t len = e->tamanho - e->proximo;
+        struct segmento_sdtp *seg;
+
+        // com a janela do receptor fechada e nada em transito, envia um
+        // unico byte para sondar a sua reabertura
+        if (janela <= transito)
+        {
+            if (transito > 0 || janela > 0)
+                break;
+
+            len = 1;
+        }
+        else if (len > janela - transito)
+        {
+            len = janela - transito;
+        }
+
+        if (len > e->mss)
+            len = e->mss;
+
+        seg = envio_seg(e, e->nseg++);
+        seg->seq = e->proximo;
+        seg->len = len;
+        seg->transmissoes = 0;
+        seg->sackeado = 0;
+
+        e->proximo += len;
+
+        envio_transmite(e, seg);
+        n++;
+
+        if (e->modo == ENVIO_GBN && !timer_armado(&e->timer))
+            timer_arma(e->ev, &e->timer, rtt_rto(&e->rtt));
+    }
+
+    return n;
+}
+
+/**
+ * Trata uma confirmacao cumulativa, liberando os segmentos confirmados e
+ * enviando os novos segmentos que passarem a caber na janela
+ *
+ * @param e O motor de envio
+ * @param ack Proximo byte esperado pelo receptor
+ * @param janela Janela anunciada pelo receptor
+ *
+ * @return A quantidade de bytes confirmados por esta confirmacao
+ */
+uint32_t envio_ack(struct envio_sdtp *e, uint32_t ack, uint32_t janela)
+{
+    uint32_t confirmados = 0;
+    uint64_t enviado = 0;
+    int ambiguo = 0;
+
+    e->acks++;
+
+    // confirmacao fora da janela (antiga ou invalida)
+    if (ack < e->base || ack > e->proximo)
+        return 0;
+
+    e->janela = janela;
+
+    if (ack == e->base)
+    {
+        if (e->nseg)
+        {
+            e->dupacks++;
+            congestao_dupack(e);
+        }
+    }
+    else
+    {
+        confirmados = ack - e->base;
+        e->base = ack;
+        e->expiradas = 0;
+
+        // libera os segmentos inteiramente confirmados
+        while (e->nseg)
+        {
+            struct segmento_sdtp *seg = envio_seg(e, 0);
+
+            if (seg->seq + seg->len > ack)
+            {
+                // confirmacao no meio do segmento
+                if (seg->seq < ack)
+                {
+                    seg->len -= ack - seg->seq;
+                    seg->seq  = ack;
+                }
+                break;
+            }
+
+            // regra de Karn: uma confirmacao que cobre uma retransmissao
+            // e ambigua; os segmentos ja confirmados por SACK foram
+            // medidos naquele momento
+            if (seg->transmissoes > 1)
+                ambiguo = 1;
+            else if (!seg->sackeado)
+                enviado = seg->enviado;
+
+            timer_desarma(e->ev, &seg->timer);
+            e->ini = (e->ini + 1) % ENVIO_SEGMENTOS;
+            e->nseg--;
+        }
+
+        // amostra do segmento mais recente confirmado
+        if (enviado && !ambiguo)
+            rtt_amostra(&e->rtt, (agora_us() - enviado) / 1000.0);
+
+        congestao_ack(e, confirmados);
+
+        // o temporizador passa a medir o segmento mais antigo restante
+        if (e->modo == ENVIO_GBN)
+        {
+            if (e->nseg)
+                timer_arma(e->ev, &e->timer, rtt_rto(&e->rtt));
+            else
+                timer_desarma(e->ev, &e->timer);
+        }
+    }
+
+    envio_envia(e);
+
+    return confirmados;
+}
+
+/**
+ * Trata um bloco SACK, marcando os segmentos em transito inteiramente
+ * contidos nele, que deixam de ser retransmitidos
+ *
+ * @param e O motor de envio
+ * @param ini Primeiro byte do bloco
+ * @param fim Byte seguinte ao ultimo do bloco
+ *
+ * @return A quantidade de segmentos marcados por este bloco
+ */
+int envio_sack(struct envio_sdtp *e, uint32_t ini, uint32_t fim)
+{
+    uint64_t enviado = 0;
+    uint32_t i;
+    int n = 0;
+
+    // bloco invalido, ou fora dos dados em transito
+    if (ini >= fim || ini < e->base || fim > e->proximo)
+        return 0;
+
+    for (i = 0; i < e->nseg; i++)
+    {
+        struct segmento_sdtp *seg = envio_seg(e, i);
+
+        if (seg->seq >= fim)
+            break;
+
+        if (!seg->sackeado && seg->seq >= ini && seg->seq + seg->len <= fim)
+        {
+            // o temporizador do Selective Repeat nao e mais necessario; o
+            // do Go-Back-N continua medindo o segmento mais antigo
+            seg->sackeado = 1;
+            timer_desarma(e->ev, &seg->timer);
+            e->sackeados++;
+            e->expiradas = 0;
+            n++;
+
+            if (seg->transmissoes == 1 && seg->enviado > enviado)
+                enviado = seg->enviado;
+        }
+    }
+
+    // amostra do RTT do segmento mais recente marcado (regra de Karn)
+    if (enviado)
+        rtt_amostra(&e->rtt, (agora_us() - enviado) / 1000.0);
+
+    return n;
+}
+
+/**
+ * Converte um numero de confirmacao de 16 bits para o deslocamento de 32
+ * bits mais proximo da base da janela
+ */
+uint32_t envio_desembrulha(struct envio_sdtp *e, uint16_t ack)
+{
+    return e->base + (int16_t)(uint16_t)(ack - (uint16_t)e->base);
+}
+
+/**
+ * Calcula o checksum de um determinado pacote, seguindo a RFC 1071
+ *
+ * @param hdr Ponteiro para o inicio dos dados a somar
+ * @param count A quantidade de bytes a contabilizar nesta soma
+ *
+ * @return O valor do checksum contabilizado
+ */
+uint16_t checksum(void *hdr, int count)
+{
+    return (uint16_t)~checksum_parcial(hdr, count, 0);
+}
+
+/**
+ * Reduz uma soma de 64 bits a 16 bits, somando os transportes
+ */
+static inline uint32_t checksum_reduz(uint64_t acc)
+{
+    while (acc>>16)
+    {
+        acc = (acc & 0xffff) + (acc>>16);
+    }
+
+    return (uint32_t)acc;
+}
+
+/**
+ * Soma os bytes restantes de um trecho (menos de um vetor), um par de
+ * bytes por vez
+ */
+static inline uint64_t checksum_cauda(const uint8_t *addr, int count,
+        uint64_t acc)
+{
+    uint16_t word;
+
+    while(count > 1)
+    {
+        memcpy(&word, addr, 2);
+        acc += word;
+        addr += 2;
+        count -= 2;
+    }
+
+    // o byte que sobra e somado como se fosse seguido de um byte zero
+    if (count > 0)
+    {
+        word = 0;
+        memcpy(&word, addr, 1);
+        acc += word;
+    }
+
+    return acc;
+}
+
+/**
+ * Implementacao de referencia (escalar) da soma do checksum
+ */
+static uint32_t checksum_escalar(const void *buf, int count, uint32_t sum)
+{
+    return checksum_reduz(checksum_cauda((const uint8_t *)buf, count, sum));
+}
+
+/**
+ * A implementacao escalar esta sempre disponivel
+ */
+static int checksum_sempre()
+{
+    return 1;
+}
+
+/**
+ * Palavras de 16 bits somadas em cada posicao de 32 bits dos vetores antes
+ * de descarrega-las na soma de 64 bits, sem risco de estouro
+ */
+#define CHECKSUM_BLOCO  32768
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+/**
+ * Soma do checksum com SSE2: cada vetor de 16 bytes e expandido em
+ * palavras de 32 bits e acumulado, com leituras nao alinhadas
+ */
+__attribute__((target("sse2")))
+static uint32_t checksum_sse2(const void *buf, int count, uint32_t sum)
+{
+    const uint8_t *addr = (const uint8_t *)buf;
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t acc = sum;
+
+    while (count >= 16)
+    {
+        // cada posicao recebe 2 palavras por vetor
+        int n = count / 16 < CHECKSUM_BLOCO / 2 ? count / 16
+                                                : CHECKSUM_BLOCO / 2;
+        __m128i a = zero;
+        uint32_t lanes[4];
+
+        count -= n * 16;
+
+        while (n--)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)addr);
+
+            a = _mm_add_epi32(a, _mm_unpacklo_epi16(v, zero));
+            a = _mm_add_epi32(a, _mm_unpackhi_epi16(v, zero));
+            addr += 16;
+        }
+
+        _mm_storeu_si128((__m128i *)lanes, a);
+        acc += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return checksum_reduz(checksum_cauda(addr, count, acc));
+}
+
+/**
+ * Soma do checksum com AVX2, como a SSE2, com vetores de 32 bytes
+ */
+__attribute__((target("avx2")))
+static uint32_t checksum_avx2(const void *buf, int count, uint32_t sum)
+{
+    const uint8_t *addr = (const uint8_t *)buf;
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t acc = sum;
+
+    while (count >= 32)
+    {
+        // cada posicao recebe 2 palavras por vetor
+        int n = count / 32 < CHECKSUM_BLOCO / 2 ? count / 32
+                                                : CHECKSUM_BLOCO / 2;
+        __m256i a = zero;
+        uint32_t lanes[8];
+
+        count -= n * 32;
+
+        while (n--)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)addr);
+
+            a = _mm256_add_epi32(a, _mm256_unpacklo_epi16(v, zero));
+            a = _mm256_add_epi32(a, _mm256_unpackhi_epi16(v, zero));
+            addr += 32;
+        }
+
+        _mm256_storeu_si256((__m256i *)lanes, a);
+        acc += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3]
+             + (uint64_t)lanes[4] + lanes[5] + lanes[6] + lanes[7];
+    }
+
+    return checksum_reduz(checksum_cauda(addr, count, acc));
+}
+
+static int checksum_tem_sse2()
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static int checksum_tem_avx2()
+{
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#if defined(__aarch64__) || (defined(__ARM_NEON) && defined(__arm__))
+#include <arm_neon.h>
+
+/**
+ * Soma do checksum com NEON: as palavras de cada vetor de 16 bytes sao
+ * somadas aos pares em posicoes de 32 bits
+ */
+static uint32_t checksum_neon(const void *buf, int count, uint32_t sum)
+{
+    const uint8_t *addr = (const uint8_t *)buf;
+    uint64_t acc = sum;
+
+    while (count >= 16)
+    {
+        // cada posicao recebe 2 palavras por vetor
+        int n = count / 16 < CHECKSUM_BLOCO / 2 ? count / 16
+                                                : CHECKSUM_BLOCO / 2;
+        uint32x4_t a = vdupq_n_u32(0);
+        uint32_t lanes[4];
+
+        count -= n * 16;
+
+        while (n--)
+        {
+            a = vpadalq_u16(a, vreinterpretq_u16_u8(vld1q_u8(addr)));
+            addr += 16;
+        }
+
+        vst1q_u32(lanes, a);
+        acc += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    return checksum_reduz(checksum_cauda(addr, count, acc));
+}
+#endif
+
+/**
+ * Implementacoes da soma do checksum, da preferida para a de referencia
+ * (escalar), terminadas por uma entrada com nome NULL
+ */
+const struct checksum_impl checksum_impls[] =
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    { "avx2",    checksum_avx2,    checksum_tem_avx2 },
+    { "sse2",    checksum_sse2,    checksum_tem_sse2 },
+#endif
+#if defined(__aarch64__) || (defined(__ARM_NEON) && defined(__arm__))
+    { "neon",    checksum_neon,    checksum_sempre },
+#endif
+    { "escalar", checksum_escalar, checksum_sempre },
+    { NULL,      NULL,             NULL }
+};
+
+static uint32_t checksum_resolve(const void *buf, int count, uint32_t sum);
+
+/**
+ * Implementacao em uso, escolhida na primeira chamada
+ */
+static uint32_t (*checksum_soma)(const void *, int, uint32_t) =
+    checksum_resolve;
+
+/**
+ * Seleciona a implementacao usada por checksum_parcial
+ *
+ * @param nome Nome da implementacao, ou NULL para a melhor disponivel
+ *
+ * @return O nome da implementacao selecionada, ou NULL se ela nao existir
+ * ou nao for suportada pelo processador
+ */
+const char *checksum_seleciona(const char *nome)
+{
+    const struct checksum_impl *i;
+
+    for (i = checksum_impls; i->nome != NULL; i++)
+    {
+        if ((nome == NULL || strcmp(nome, i->nome) == 0) && i->disponivel())
+        {
+            checksum_soma = i->soma;
+            return i->nome;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Escolhe a melhor implementacao na primeira chamada, e a executa
+ */
+static uint32_t checksum_resolve(const void *buf, int count, uint32_t sum)
+{
+    checksum_seleciona(NULL);
+
+    return checksum_soma(buf, count, sum);
+}
+
+/**
+ * Acumula a soma em complemento de um (RFC 1071) de um trecho de dados,
+ * sem inverter o resultado
+ *
+ * @param buf Ponteiro para o inicio dos dados a somar
+ * @param count A quantidade de bytes a contabilizar nesta soma
+ * @param sum Soma acumulada dos trechos anteriores (0 no primeiro)
+ *
+ * @return A soma acumulada, reduzida a 16 bits
+ */
+uint32_t checksum_parcial(const void *buf, int count, uint32_t sum)
+{
+    return checksum_soma(buf, count, sum);
+}
+
+/**
+ * Junta a soma parcial de um trecho a soma acumulada dos trechos que o
+ * precedem
+ *
+ * @param soma Soma acumulada
+ * @param parcial Soma do trecho (checksum_parcial com sum = 0)
+ * @param offset Deslocamento do inicio do trecho nos dados
+ *
+ * @return A soma acumulada, reduzida a 16 bits
+ */
+uint32_t checksum_combina(uint32_t soma, uint32_t parcial, uint32_t offset)
+{
+    if (offset & 1)
+        parcial = ((parcial & 0xff) << 8) | (parcial >> 8);
+
+    return checksum_reduz((uint64_t)soma + parcial);
+}
+
+/**
+ * Inicializa um pool de objetos de tamanho fixo
+ *
+ * @param pool Ponteiro para o pool
+ * @param tamanho Tamanho de cada objeto
+ * @param por_slab Quantidade de objetos alocados de cada vez
+ */
+void pool_init(struct pool_sdtp *pool, size_t tamanho, int por_slab)
+{
+    memset(pool, 0x0, sizeof(struct pool_sdtp));
+
+    // cada objeto livre guarda o ponteiro para o proximo livre
+    if (tamanho < sizeof(void *))
+        tamanho = sizeof(void *);
+
+    pool->tamanho  = (tamanho + 15) & ~(size_t)15;
+    pool->por_slab = por_slab > 0 ? por_slab : 1;
+}
+
+/**
+ * Obtem um objeto do pool (com conteudo indefinido)
+ *
+ * @return Ponteiro para o objeto, ou NULL se faltar memoria
+ */
+void *pool_get(struct pool_sdtp *pool)
+{
+    void *obj;
+
+    if (pool->livres == NULL)
+    {
+        // o inicio do slab encadeia a lista de slabs, os objetos vem
+        // em seguida, alinhados em 16 bytes
+        char *slab = (char *) malloc(16 + pool->tamanho * pool->por_slab);
+        int i;
+
+        if (slab == NULL)
+            return NULL;
+
+        *(void **)slab = pool->slabs;
+        pool->slabs = slab;
+
+        for (i = pool->por_slab - 1; i >= 0; i--)
+        {
+            obj = slab + 16 + i * pool->tamanho;
+            *(void **)obj = pool->livres;
+            pool->livres = obj;
+        }
+
+        pool->total += pool->por_slab;
+    }
+
+    obj = pool->livres;
+    pool->livres = *(void **)obj;
+    pool->em_uso++;
+
+    return obj;
+}
+
+/**
+ * Devolve um objeto obtido por pool_get ao pool
+ */
+void pool_put(struct pool_sdtp *pool, void *obj)
+{
+    *(void **)obj = pool->livres;
+    pool->livres = obj;
+    pool->em_uso--;
+}
+
+/**
+ * Libera todos os slabs do pool, invalidando os objetos entregues
+ */
+void pool_destroy(struct pool_sdtp *pool)
+{
+    while (pool->slabs != NULL)
+    {
+        void *slab = pool->slabs;
+        pool->slabs = *(void **)slab;
+        free(slab);
+    }
+
+    pool->livres = NULL;
+    pool->em_uso = 0;
+    pool->total  = 0;
+}
+
+/**
+ * Funcao de ajuda que imprime o conteudo de um pacote STDP na tela
+ *
+ * @param p Ponteiro para o pacote sdtp
+ */
+void printpacket(struct sdtphdr *p)
+{
+    printf("\nImprimindo Pacote (%x)\n",p);
+    printf("\tseqnum:   %d\n",p->seqnum);
+    printf("\tacknum:   %d\n",p->acknum);
+    printf("\tdatalen:  %d\n",p->datalen);
+    printf("\tflags:    0x%x\n",p->flags);
+    printf("\twindow:   %d\n",p->window);
+    printf("\tchecksum: 0x%x\n",p->checksum);
+    if (p->datalen)
+        printf("\tdata:     %.*s\n\n",p->datalen,
+                (char *)p+sizeof(struct sdtphdr));
+}
+
+/**
+ * Identifica a versao do cabecalho de um pacote
+ *
+ * @param buf O pacote, com ao menos os 6 primeiros bytes
+ *
+ * @return 2 se o pacote usa o cabecalho v2, 1 caso contrario
+ */
+int sdtp_versao(const void *buf)
+{
+    uint8_t flags = ((const struct sdtphdr *)buf)->flags;
+
+    // o SYN e sempre v1, mesmo quando pede o v2
+    return (flags & (TH_V2|TH_SYN)) == TH_V2 ? SDTP_V2 : 1;
+}
+
+/**
+ * Retorna o tamanho do cabecalho da versao informada
+ */
+int sdtp_cabecalho(int versao)
+{
+    return versao == SDTP_V2 ? sizeof(struct sdtphdr2)
+                             : sizeof(struct sdtphdr);
+}
+
+/**
+ * Le o cabecalho de um pacote, que deve ter ao menos o tamanho do
+ * cabecalho da sua versao, sem verificar o tamanho dos dados
+ *
+ * @param buf O pacote
+ * @param p O pacote decodificado
+ */
+void sdtp_le(void *buf, struct pacote_sdtp *p)
+{
+    p->versao = sdtp_versao(buf);
+
+    if (p->versao == SDTP_V2)
+    {
+        struct sdtphdr2 *h = (struct sdtphdr2 *)buf;
+
+        p->seqnum  = h->seqnum;
+        p->acknum  = h->acknum;
+        p->window  = h->window;
+        p->datalen = h->datalen;
+        p->flags   = h->flags & ~TH_V2;
+    }
+    else
+    {
+        struct sdtphdr *h = (struct sdtphdr *)buf;
+
+        p->seqnum  = h->seqnum;
+        p->acknum  = h->acknum;
+        p->window  = h->window;
+        p->datalen = h->datalen;
+        p->flags   = h->flags;
+    }
+
+    p->dados = (char *)buf + sdtp_cabecalho(p->versao);
+}
+
+/**
+ * Decodifica um pacote recebido, verificando o seu tamanho (mas nao o
+ * checksum)
+ *
+ * @param buf O pacote
+ * @param len Bytes recebidos
+ * @param p O pacote decodificado
+ *
+ * @return 0 em caso de sucesso, -1 se o pacote estiver truncado
+ */
+int sdtp_decodifica(void *buf, int len, struct pacote_sdtp *p)
+{
+    if (len < (int)sizeof(struct sdtphdr)
+            ||
+        len < sdtp_cabecalho(sdtp_versao(buf)))
+    {
+        return -1;
+    }
+
+    sdtp_le(buf, p);
+
+    if (len < sdtp_cabecalho(p->versao) + p->datalen
+            ||
+        (p->versao == SDTP_V2 && ((struct sdtphdr2 *)buf)->versao != SDTP_V2))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Monta o cabecalho da versao p->versao, e calcula o checksum do
+ * cabecalho e dos p->datalen bytes de dados, que ja devem estar em
+ * buf + sdtp_cabecalho(p->versao)
+ *
+ * @param buf Destino do pacote
+ * @param p O pacote a codificar
+ *
+ * @return O tamanho total do pacote
+ */
+int sdtp_codifica(void *buf, struct pacote_sdtp *p)
+{
+    int len = sdtp_cabecalho(p->versao);
+
+    return sdtp_codifica_cabecalho(buf, p, (char *)buf + len) + p->datalen;
+}
+
+/**
+ * Monta apenas o cabecalho da versao p->versao, calculando o checksum
+ * sobre o cabecalho e os p->datalen bytes de dados, que podem estar em
+ * outro buffer (envio com sendmsg e dois iovecs, sem copia dos dados)
+ *
+ * @param hdr Destino do cabecalho
+ * @param p O pacote a codificar
+ * @param dados Dados do pacote
+ *
+ * @return O tamanho do cabecalho
+ */
+int sdtp_codifica_cabecalho(void *hdr, struct pacote_sdtp *p,
+        const void *dados)
+{
+    int len = sdtp_cabecalho(p->versao);
+
+    // os cabecalhos tem tamanho par, e a soma continua nos dados
+    uint32_t soma = checksum_parcial(dados, p->datalen, 0);
+
+    if (p->versao == SDTP_V2)
+    {
+        struct sdtphdr2 *h = (struct sdtphdr2 *)hdr;
+
+        h->seqnum    = p->seqnum;
+        h->versao    = SDTP_V2;
+        h->flags     = p->flags | TH_V2;
+        h->checksum  = 0;
+        h->acknum    = p->acknum;
+        h->window    = p->window;
+        h->datalen   = p->datalen;
+        h->reservado = 0;
+        h->checksum  = (uint16_t)~checksum_parcial(hdr, len, soma);
+    }
+    else
+    {
+        struct sdtphdr *h = (struct sdtphdr *)hdr;
+
+        h->seqnum   = p->seqnum;
+        h->acknum   = p->acknum;
+        h->datalen  = p->datalen;
+        h->flags    = p->flags;
+        h->window   = p->window;
+        h->checksum = 0;
+        h->checksum = (uint16_t)~checksum_parcial(hdr, len, soma);
+    }
+
+    return len;
+}
+
+/**
+ * Inicializa uma rajada vazia
+ *
+ * @param r A rajada
+ * @param sock Socket UDP, ja conectado ao destino
+ * @param gso Usa a segmentacao no kernel, se o kernel a conhecer
+ */
+void rajada_init(struct rajada_sdtp *r, int sock, int gso)
+{
+    int v;
+    socklen_t l = sizeof(v);
+
+    r->sock       = sock;
+    r->n          = 0;
+    r->bytes      = 0;
+    r->tamseg     = 0;
+    r->chamadas   = 0;
+    r->segmentos  = 0;
+
+    // o kernel conhece UDP_SEGMENT se aceitar consulta-lo
+    r->gso = gso && getsockopt(sock, SOL_UDP, UDP_SEGMENT, &v, &l) == 0;
+}
+
+/**
+ * Envia os segmentos acumulados na rajada
+ *
+ * Com mais de um segmento, a rajada sai em uma so chamada, e o kernel a
+ * separa em datagramas de r->tamseg bytes (UDP_SEGMENT). Se o kernel ou a
+ * interface recusarem a segmentacao, ela e desativada, e a rajada e
+ * reenviada um segmento por chamada.
+ *
+ * @param r A rajada
+ *
+ * @return 0 em caso de sucesso, -1 se o envio falhou
+ */
+int rajada_descarrega(struct rajada_sdtp *r)
+{
+    struct msghdr msg;
+    int n = r->n;
+    int ret = 0;
+
+    if (n == 0)
+        return 0;
+
+    r->n     = 0;
+    r->bytes = 0;
+
+    memset(&msg, 0x0, sizeof(msg));
+    msg.msg_iov    = r->iov;
+    msg.msg_iovlen = 2 * n;
+
+    if (n > 1)
+    {
+        struct cmsghdr *cm;
+
+        msg.msg_control    = r->controle;
+        msg.msg_controllen = sizeof(r->controle);
+
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type  = UDP_SEGMENT;
+        cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cm) = r->tamseg;
+    }
+
+    r->chamadas++;
+
+    if (sendmsg(r->sock, &msg, 0) >= 0)
+    {
+        r->segmentos += n;
+        return 0;
+    }
+
+    if (n == 1 || (errno != EIO && errno != EINVAL && errno != ENOPROTOOPT
+                && errno != EOPNOTSUPP))
+    {
+        LOG(NIVEL_ERRO, "sendmsg: %s", strerror(errno));
+        return -1;
+    }
+
+    LOG(NIVEL_AVISO, "sendmsg(UDP_SEGMENT): %s, enviando um datagrama por "
+            "segmento", strerror(errno));
+
+    r->gso = 0;
+    msg.msg_iovlen     = 2;
+    msg.msg_control    = NULL;
+    msg.msg_controllen = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        msg.msg_iov = &r->iov[2 * i];
+        r->chamadas++;
+
+        if (sendmsg(r->sock, &msg, 0) < 0)
+        {
+            LOG(NIVEL_ERRO, "sendmsg: %s", strerror(errno));
+            ret = -1;
+        }
+        else
+        {
+            r->segmentos++;
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * Envia um datagrama pela rajada
+ *
+ * Os pacotes de controle saem na hora, depois dos segmentos pendentes.
+ * Com a segmentacao no kernel (GSO), cada segmento de dados entra na
+ * rajada, que so e enviada quando encher, quando um segmento menor a
+ * encerrar, ou quando o chamador a descarregar (em geral, ao fim da
+ * iteracao do laco de eventos). Os dados nao sao copiados.
+ *
+ * @param r A rajada
+ * @param iov O datagrama: o pacote de controle, ou o cabecalho e os dados
+ * @param niov Quantidade de iovecs
+ *
+ * @return 0 em caso de sucesso, -1 se o envio falhou
+ */
+int rajada_envia(struct rajada_sdtp *r, struct iovec *iov, int niov)
+{
+    uint32_t tam;
+    int n;
+
+    if (niov == 1)
+    {
+        // os segmentos pendentes saem antes do controle
+        rajada_descarrega(r);
+
+        if (send(r->sock, iov[0].iov_base, iov[0].iov_len, 0) < 0)
+        {
+            LOG(NIVEL_ERRO, "send: %s", strerror(errno));
+            return -1;
+        }
+
+        return 0;
+    }
+
+    tam = iov[0].iov_len + iov[1].iov_len;
+    n = r->n;
+
+    // a rajada so aceita segmentos do tamanho dos anteriores, exceto o
+    // ultimo, que pode ser menor
+    if (n > 0 && (tam > r->tamseg || r->bytes + tam > GSO_BYTES))
+    {
+        rajada_descarrega(r);
+        n = 0;
+    }
+
+    // o cabecalho e copiado para a rajada; os dados seguem do chamador
+    memcpy(r->cabecalhos[n], iov[0].iov_base, iov[0].iov_len);
+    r->iov[2 * n].iov_base = r->cabecalhos[n];
+    r->iov[2 * n].iov_len  = iov[0].iov_len;
+    r->iov[2 * n + 1]      = iov[1];
+
+    if (n == 0)
+        r->tamseg = tam;
+
+    r->n      = n + 1;
+    r->bytes += tam;
+
+    LOG(NIVEL_DEBUG, "segmento len %u (rajada %d)",
+            (unsigned)iov[1].iov_len, r->n);
+
+    if (!r->gso || tam < r->tamseg || r->n == GSO_SEGMENTOS)
+        return rajada_descarrega(r);
+
+    return 0;
+}
+
+/**
+ * Envia um datagrama da conexao pela funcao do chamador, ou direto no
+ * socket conectado
+ */
+static int conexao_envia(struct conexao_sdtp *c, struct iovec *iov, int n)
+{
+    struct msghdr msg;
+
+    if (c->envia != NULL)
+        return c->envia(c, iov, n);
+
+    memset(&msg, 0x0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = n;
+
+    if (sendmsg(c->sock, &msg, 0) < 0)
+    {
+        LOG(NIVEL_ERRO, "sendmsg: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Envia um pacote sem dados (SYN, ACK ou FIN) ao servidor
+ *
+ * O SYN sempre usa o cabecalho v1, pedindo o v2 e o SACK conforme as
+ * opcoes; o FIN v2 leva o tamanho e o checksum dos dados.
+ *
+ * @param c A conexao
+ * @param flags As flags do pacote
+ */
+static void conexao_controle(struct conexao_sdtp *c, uint8_t flags)
+{
+    char buffer[MAXSDTP2];
+    struct pacote_sdtp pout;
+    struct iovec iov;
+
+    memset(&pout, 0x0, sizeof(pout));
+    pout.versao = flags & TH_SYN ? 1 : c->versao;
+    pout.flags  = flags;
+
+    if (flags & TH_SYN)
+    {
+        pout.flags |= (c->sack ? TH_SACK : 0)
+                    | (c->versao == SDTP_V2 ? TH_V2 : 0);
+    }
+    else if (flags == TH_ACK)
+    {
+        // devolve o cookie: no v1, como recebido; no v2, inteiro no ack
+        if (c->versao == SDTP_V2)
+        {
+            pout.acknum = c->cookie;
+        }
+        else
+        {
+            pout.seqnum = c->cookie & 0xffff;
+            pout.acknum = c->cookie >> 16;
+        }
+    }
+    else if (flags == TH_FIN && c->versao == SDTP_V2)
+    {
+        pout.seqnum = c->envio.tamanho;
+        pout.acknum = c->somadados;
+    }
+
+    iov.iov_base = buffer;
+    iov.iov_len  = sdtp_codifica(buffer, &pout);
+
+    LOGPACKET(NIVEL_DEBUG, buffer);
+
+    c->enviado = agora_us();
+
+    conexao_envia(c, &iov, 1);
+}
+
+/**
+ * Monta e envia um segmento de dados, chamada pelo motor de envio
+ *
+ * Apenas o cabecalho e montado; os dados seguem direto de e->dados, no
+ * iovec seguinte ao cabecalho.
+ */
+static int conexao_segmento(struct envio_sdtp *e, struct segmento_sdtp *seg)
+{
+    struct conexao_sdtp *c = (struct conexao_sdtp *)e->arg;
+    char cabecalho[sizeof(struct sdtphdr2)];
+    struct pacote_sdtp pout;
+    struct iovec iov[2];
+
+    pout.versao  = c->versao;
+    pout.seqnum  = seg->seq;    // deslocamento do segmento (16 bits no v1)
+    pout.acknum  = c->versao == SDTP_V2 ? c->cookie   // cookie do servidor
+                                        : c->cookie & 0xffff;
+    pout.datalen = seg->len;
+    pout.flags   = 0x0;
+    pout.window  = 0;
+
+    // no v1, so o ACK cria a conexao no servidor que responde com cookies:
+    // enquanto nada foi confirmado, o ACK segue com cada retransmissao do
+    // primeiro segmento, caso tenha se perdido
+    if (c->versao == 1 && seg->seq == 0 && e->base == 0
+            && seg->transmissoes > 1)
+    {
+        conexao_controle(c, TH_ACK);
+    }
+
+    iov[0].iov_base = cabecalho;
+    iov[0].iov_len  = sdtp_codifica_cabecalho(cabecalho, &pout,
+            e->dados + seg->seq);
+    iov[1].iov_base = (void *)(e->dados + seg->seq);
+    iov[1].iov_len  = seg->len;
+
+    return conexao_envia(c, iov, 2);
+}
+
+/**
+ * Retorna o MSS do cabecalho v2: o MTU do caminho ate o servidor, menos
+ * os cabecalhos IP, UDP e SDTP, limitado a MSS2
+ */
+static uint32_t conexao_mss_v2(struct conexao_sdtp *c)
+{
+    int mtu;
+    socklen_t len = sizeof(mtu);
+    int mss = MSS2;
+
+    // o socket esta conectado ao servidor, e o kernel conhece o MTU
+    if (getsockopt(c->sock, IPPROTO_IP, IP_MTU, &mtu, &len) == 0)
+        mss = mtu - 20 - 8 - (int)sizeof(struct sdtphdr2);
+
+    if (mss > MSS2)
+        mss = MSS2;
+
+    return mss > MSS ? mss : MSS;
+}
+
+/**
+ * Encerra a transferencia e avisa o chamador, que pode reiniciar a
+ * conexao; depois disso, c nao deve ser acessada
+ */
+static void conexao_encerra(struct conexao_sdtp *c, int resultado)
+{
+    c->estado = CONEXAO_FIM;
+    c->resultado = resultado;
+
+    conexao_destroy(c);
+
+    if (c->fim != NULL)
+        c->fim(c);
+}
+
+/**
+ * Abandono do envio dos dados, apos ENVIO_EXPIRACOES expiracoes seguidas
+ * sem progresso, chamada pelo motor de envio
+ */
+static void conexao_desiste(struct envio_sdtp *e)
+{
+    struct conexao_sdtp *c = (struct conexao_sdtp *)e->arg;
+
+    LOG(NIVEL_ERRO, "Cliente: servidor nao confirma os dados (%u de %u "
+            "bytes), desistindo", e->base, e->tamanho);
+    conexao_encerra(c, 1);
+}
+
+/**
+ * Passa ao envio do FIN
+ */
+static void conexao_fin(struct conexao_sdtp *c)
+{
+    LOG(NIVEL_DEBUG, "Cliente: finalizou o envio dos dados, enviando FIN");
+
+    envio_destroy(&c->envio);
+
+    c->estado = CONEXAO_FIN;
+    c->tentativas = 1;
+
+    conexao_controle(c, TH_FIN);
+    timer_arma(c->ev, &c->timer, rtt_rto(&c->envio.rtt));
+}
+
+/**
+ * Expiracao do temporizador dos pacotes de controle: retransmite o SYN ou
+ * o FIN, com recuo exponencial, desistindo apos c->max_tentativas envios
+ */
+static void conexao_timeout(struct timer_sdtp *t)
+{
+    struct conexao_sdtp *c = (struct conexao_sdtp *)t->arg;
+
+    if (c->tentativas++ >= c->max_tentativas)
+    {
+        LOG(NIVEL_AVISO, "Cliente: servidor nao responde ao %s, desistindo",
+                c->estado == CONEXAO_SYN ? "SYN" : "FIN");
+        conexao_encerra(c, 1);
+        return;
+    }
+
+    rtt_recua(&c->envio.rtt);
+
+    conexao_controle(c, c->estado == CONEXAO_SYN ? TH_SYN : TH_FIN);
+    timer_arma(c->ev, t, rtt_rto(&c->envio.rtt));
+}
+
+/**
+ * Inicializa uma conexao, ainda sem enviar o SYN
+ *
+ * @param c A conexao
+ * @param ev Laco de eventos dos temporizadores
+ * @param sock Socket UDP, ja conectado ao servidor
+ * @param modo ENVIO_GBN ou ENVIO_SR
+ * @param dados Dados a enviar (devem existir ate o fim da conexao)
+ * @param tamanho Tamanho dos dados
+ * @param versao Versao do cabecalho pedida no SYN (1 ou SDTP_V2)
+ * @param sack Pede a confirmacao seletiva no SYN
+ * @param envia Funcao que envia os datagramas
+ * @param arg Argumento livre do chamador
+ */
+void conexao_init(struct conexao_sdtp *c, struct evloop_sdtp *ev, int sock,
+        int modo, const char *dados, uint32_t tamanho, int versao, int sack,
+        conexao_envia_cb envia, void *arg)
+{
+    memset(c, 0x0, offsetof(struct conexao_sdtp, envio));
+
+    c->sock           = sock;
+    c->ev             = ev;
+    c->versao         = versao;
+    c->sack           = sack;
+    c->max_tentativas = CONEXAO_TENTATIVAS;
+    c->somadados      = checksum((void *)dados, tamanho);
+    c->envia          = envia;
+    c->ack            = NULL;
+    c->fim            = NULL;
+    c->arg            = arg;
+
+    timer_init(&c->timer, conexao_timeout, c);
+
+    envio_init(&c->envio, ev, modo, dados, tamanho, MSS, conexao_segmento, c);
+    c->envio.desiste = conexao_desiste;
+}
+
+/**
+ * Inicia o 3-way handshake, enviando o primeiro SYN
+ */
+void conexao_inicia(struct conexao_sdtp *c)
+{
+    c->estado = CONEXAO_SYN;
+    c->tentativas = 1;
+    c->inicio = agora_us();
+
+    conexao_controle(c, TH_SYN);
+    timer_arma(c->ev, &c->timer, rtt_rto(&c->envio.rtt));
+}
+
+/**
+ * Trata um pacote recebido do servidor, conforme o estado da conexao
+ *
+ * Se a transferencia terminar, c->fim e chamada por ultimo, e a conexao
+ * nao e mais acessada.
+ */
+void conexao_trata(struct conexao_sdtp *c, struct pacote_sdtp *pin)
+{
+    uint32_t ack;
+    int i;
+
+    // fora do 3-way handshake, a versao deve ser a negociada
+    if (c->estado != CONEXAO_SYN && pin->versao != c->versao)
+        return;
+
+    switch (c->estado)
+    {
+        case CONEXAO_SYN:
+            // o servidor no modo de gravacao recusa o SYN v1
+            if (pin->flags == TH_RST)
+            {
+                LOG(NIVEL_ERRO, "Cliente: servidor recusou a conexao v%d",
+                        c->versao);
+                conexao_encerra(c, 1);
+                return;
+            }
+
+            if ((pin->flags & ~(TH_SACK|TH_V2)) != (TH_SYN|TH_ACK))
+                break;
+
+            c->handshake = agora_us() - c->inicio;
+
+            // a confirmacao seletiva e o v2 so valem se o servidor os
+            // aceitou
+            c->sack = c->sack && (pin->flags & TH_SACK);
+
+            if (c->versao == SDTP_V2 && (pin->flags & TH_V2))
+                envio_mss(&c->envio, conexao_mss_v2(c));
+            else
+                c->versao = 1;
+
+            // o FIN v1 nao leva tamanho nem checksum: o servidor confere
+            // os dados com o lorem_ipsum.txt, e fecha a janela pouco
+            // depois dele (BUFMAX), de modo que outros dados nunca
+            // terminariam
+            if (c->versao == 1 && c->envio.tamanho != LOREMSIZE)
+            {
+                LOG(NIVEL_ERRO, "Cliente: servidor so aceita o v1, que "
+                        "transfere apenas os %d bytes do lorem_ipsum.txt "
+                        "(dados com %u bytes)", LOREMSIZE,
+                        c->envio.tamanho);
+                conexao_encerra(c, 1);
+                return;
+            }
+
+            LOG(NIVEL_DEBUG, "Cliente: recebeu SYN-ACK, janela %u%s, v%d, "
+                    "mss %u", pin->window, c->sack ? ", com SACK" : "",
+                    c->versao, c->envio.mss);
+
+            // o SYN-ACK fornece a primeira amostra do RTT, se o SYN nao
+            // foi retransmitido (regra de Karn)
+            if (c->tentativas == 1)
+                rtt_amostra(&c->envio.rtt,
+                        (agora_us() - c->enviado) / 1000.0);
+
+            // o servidor pode nao ter criado a conexao ainda: o cookie
+            // volta no ACK e nos dados
+            c->cookie = pin->seqnum | (uint32_t)pin->acknum << 16;
+
+            // completa o 3-way handshake e inicia o envio dos dados
+            timer_desarma(c->ev, &c->timer);
+            conexao_controle(c, TH_ACK);
+
+            c->estado = CONEXAO_DADOS;
+            c->envio.janela = pin->window;
+
+            if (envio_concluido(&c->envio))
+                conexao_fin(c);
+            else
+                envio_envia(&c->envio);
+            break;
+
+        case CONEXAO_DADOS:
+            if (pin->flags != TH_ACK && pin->flags != (TH_ACK|TH_SACK))
+                break;
+
+            LOG(NIVEL_DEBUG, "Cliente: recebeu ACK %u, janela %u",
+                    pin->acknum, pin->window);
+
+            // marca os segmentos ja recebidos, antes de a confirmacao
+            // cumulativa mover a base usada na conversao dos blocos; no
+            // v1, os numeros de 16 bits sao convertidos pela base
+            if (c->sack && (pin->flags & TH_SACK) && c->versao == SDTP_V2)
+            {
+                struct sackhdr2 *b = (struct sackhdr2 *)pin->dados;
+
+                for (i = 0; i < pin->datalen / (int)sizeof(struct sackhdr2);
+                        i++)
+                {
+                    envio_sack(&c->envio, b[i].ini, b[i].fim);
+                }
+            }
+            else if (c->sack && (pin->flags & TH_SACK))
+            {
+                struct sackhdr *b = (struct sackhdr *)pin->dados;
+
+                for (i = 0; i < pin->datalen / (int)sizeof(struct sackhdr);
+                        i++)
+                {
+                    envio_sack(&c->envio,
+                            envio_desembrulha(&c->envio, b[i].ini),
+                            envio_desembrulha(&c->envio, b[i].fim));
+                }
+            }
+
+            ack = c->versao == SDTP_V2 ? pin->acknum
+                : envio_desembrulha(&c->envio, pin->acknum);
+
+            envio_ack(&c->envio, ack, pin->window);
+
+            if (c->ack != NULL)
+                c->ack(c);
+
+            if (envio_concluido(&c->envio))
+                conexao_fin(c);
+            break;
+
+        case CONEXAO_FIN:
+            if (pin->flags != TH_ACK && pin->flags != TH_RST)
+                break;
+
+            if (pin->flags == TH_RST)
+                LOG(NIVEL_AVISO, "Cliente: recebeu RST, dados incorretos");
+            else
+                LOG(NIVEL_INFO, "Cliente: recebeu ACK, dados corretos");
+
+            conexao_encerra(c, pin->flags == TH_RST);
+            break;
+    }
+}
+
+/**
+ * Recebe e trata os pacotes pendentes no socket da conexao, sem bloquear,
+ * descartando os truncados ou com checksum invalido
+ *
+ * @return A quantidade de datagramas recebidos
+ */
+int conexao_recebe(struct conexao_sdtp *c)
+{
+    // buffer para armazenar o pacote de recepcao
+    char buffer_in[MAXSDTP2];
+    struct pacote_sdtp pin;
+    int numbytes;
+    int n = 0;
+
+    while (c->estado != CONEXAO_FIM
+            &&
+           (numbytes = recv(c->sock, buffer_in, MAXSDTP2,
+                MSG_DONTWAIT)) >= 0)
+    {
+        n++;
+
+        // deve se verificar o tamanho e o checksum do pacote recebido
+        if (sdtp_decodifica(buffer_in, numbytes, &pin) < 0
+                ||
+            checksum((void *)buffer_in,
+                sdtp_cabecalho(pin.versao) + pin.datalen))
+        {
+            LOG(NIVEL_DEBUG, "Cliente: pacote truncado ou checksum invalido");
+            continue;
+        }
+
+        LOGPACKET(NIVEL_DEBUG, buffer_in);
+
+        conexao_trata(c, &pin);
+    }
+
+    return n;
+}
+
+/**
+ * Desarma os temporizadores da conexao
+ */
+void conexao_destroy(struct conexao_sdtp *c)
+{
+    timer_desarma(c->ev, &c->timer);
+    envio_destroy(&c->envio);
+}
+
+
+/**
+ * Registro do log, ja formatado
+ */
+struct registro_log
+{
+    uint16_t len;                       ///< Tamanho do texto
+    char texto[LOG_REGISTRO - 2];       ///< Texto, sem terminador
+};
+
+/**
+ * Anel de registros de uma thread (um produtor, um consumidor)
+ */
+struct anel_log
+{
+    _Atomic uint32_t escrita;           ///< Proxima posicao a escrever
+    char separa[60];                    ///< Evita compartilhar a linha de
+                                        ///< cache entre os indices
+    _Atomic uint32_t leitura;           ///< Proxima posicao a ler
+    _Atomic uint64_t descartados;       ///< Registros perdidos (anel cheio)
+    struct anel_log *prox;              ///< Proximo anel registrado
+    struct registro_log reg[LOG_ANEL];  ///< Registros
+};
+
+/**
+ * Nivel de log em tempo de execucao
+ */
+int log_nivel = NIVEL_INFO;
+
+/**
+ * Nomes dos niveis de log
+ */
+static const char *log_nomes[] = { "ERRO", "AVISO", "INFO", "DEBUG" };
+
+/**
+ * Estado global do log: lista de aneis e thread de escrita
+ */
+static struct
+{
+    pthread_mutex_t trava;      ///< Protege a lista de aneis
+    struct anel_log *aneis;     ///< Aneis registrados
+    FILE *saida;                ///< Destino dos registros
+    const char *arquivo;        ///< Caminho do arquivo (ou NULL)
+    size_t escritos;            ///< Bytes escritos no arquivo atual
+    pthread_t thread;           ///< Thread de escrita
+    _Atomic int ativo;          ///< Thread de escrita em execucao
+} log_global = { PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * Anel da thread atual, criado no seu primeiro registro
+ */
+static __thread struct anel_log *anel_local;
+
+/**
+ * Obtem o anel da thread atual, criando-o se necessario
+ */
+static struct anel_log *log_anel()
+{
+    if (anel_local == NULL)
+    {
+        struct anel_log *a = (struct anel_log *) calloc(1,
+                sizeof(struct anel_log));
+
+        if (a == NULL)
+            return NULL;
+
+        pthread_mutex_lock(&log_global.trava);
+        a->prox = log_global.aneis;
+        log_global.aneis = a;
+        pthread_mutex_unlock(&log_global.trava);
+
+        anel_local = a;
+    }
+
+    return anel_local;
+}
+
+/**
+ * Reserva a proxima posicao livre do anel da thread atual
+ *
+ * @return A posicao, ou NULL com o anel cheio
+ */
+static struct registro_log *log_reserva(struct anel_log **anel)
+{
+    struct anel_log *a = log_anel();
+    uint32_t e;
+
+    if (a == NULL)
+        return NULL;
+
+    e = atomic_load_explicit(&a->escrita, memory_order_relaxed);
+
+    if (e - atomic_load_explicit(&a->leitura, memory_order_acquire)
+            >= LOG_ANEL)
+    {
+        atomic_fetch_add_explicit(&a->descartados, 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    *anel = a;
+
+    return &a->reg[e & (LOG_ANEL - 1)];
+}
+
+/**
+ * Publica o registro reservado, tornando-o visivel a thread de escrita
+ */
+static void log_publica(struct anel_log *a)
+{
+    atomic_store_explicit(&a->escrita,
+            atomic_load_explicit(&a->escrita, memory_order_relaxed) + 1,
+            memory_order_release);
+}
+
+/**
+ * Escreve o cabecalho (horario e nivel) de um registro
+ *
+ * @return A quantidade de caracteres escritos
+ */
+static int log_cabecalho(char *texto, int nivel)
+{
+    struct timespec ts;
+    struct tm tm;
+    int n;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+
+    n = strftime(texto, 32, "%H:%M:%S", &tm);
+    n += snprintf(texto + n, 32, ".%06ld %-5s ", ts.tv_nsec / 1000,
+            log_nomes[nivel]);
+
+    return n;
+}
+
+/**
+ * Ajusta o tamanho do registro ao espaco disponivel, terminando-o com
+ * uma quebra de linha
+ */
+static void log_fecha(struct registro_log *r, int n)
+{
+    if (n < 0)
+        n = 0;
+
+    if (n > (int)sizeof(r->texto) - 1)
+        n = sizeof(r->texto) - 1;
+
+    r->texto[n++] = '\n';
+    r->len = n;
+}
+
+/**
+ * Formata uma mensagem no anel da thread atual
+ *
+ * Deve ser chamada atraves da macro LOG, que testa o nivel antes.
+ */
+void log_registra(int nivel, const char *fmt, ...)
+{
+    struct anel_log *a;
+    struct registro_log *r = log_reserva(&a);
+    va_list args;
+    int n;
+
+    if (r == NULL)
+        return;
+
+    n = log_cabecalho(r->texto, nivel);
+
+    va_start(args, fmt);
+    n += vsnprintf(r->texto + n, sizeof(r->texto) - n, fmt, args);
+    va_end(args);
+
+    log_fecha(r, n);
+    log_publica(a);
+}
+
+/**
+ * Formata o conteudo de um pacote STDP (v1 ou v2) no anel da thread atual
+ *
+ * Deve ser chamada atraves da macro LOGPACKET, que testa o nivel antes.
+ */
+void log_pacote(int nivel, void *buf)
+{
+    struct anel_log *a;
+    struct registro_log *r = log_reserva(&a);
+    struct pacote_sdtp p;
+    int n;
+
+    if (r == NULL)
+        return;
+
+    sdtp_le(buf, &p);
+
+    n = log_cabecalho(r->texto, nivel);
+    n += snprintf(r->texto + n, sizeof(r->texto) - n,
+            "pacote v%d seqnum %u acknum %u datalen %d flags 0x%x "
+            "window %u checksum 0x%x ",
+            p.versao, p.seqnum, p.acknum, p.datalen, p.flags, p.window,
+            p.versao == SDTP_V2 ? ((struct sdtphdr2 *)buf)->checksum
+                                : ((struct sdtphdr *)buf)->checksum);
+
+    // um ACK com SACK leva blocos, e nao dados
+    if ((p.flags & (TH_ACK|TH_SACK|TH_SYN)) == (TH_ACK|TH_SACK))
+    {
+        struct sackhdr *b = (struct sackhdr *)p.dados;
+        struct sackhdr2 *b2 = (struct sackhdr2 *)p.dados;
+        int tam = p.versao == SDTP_V2 ? sizeof(struct sackhdr2)
+                                      : sizeof(struct sackhdr);
+        int i;
+
+        n += snprintf(r->texto + n, sizeof(r->texto) - n, "sack");
+
+        for (i = 0; i < p.datalen / tam && n < (int)sizeof(r->texto); i++)
+        {
+            n += snprintf(r->texto + n, sizeof(r->texto) - n, " [%u, %u)",
+                    p.versao == SDTP_V2 ? b2[i].ini : b[i].ini,
+                    p.versao == SDTP_V2 ? b2[i].fim : b[i].fim);
+        }
+    }
+    else
+    {
+        n += snprintf(r->texto + n, sizeof(r->texto) - n, "data \"%.*s\"",
+                p.datalen > 64 ? 64 : p.datalen, p.dados);
+    }
+
+    log_fecha(r, n);
+    log_publica(a);
+}
+
+/**
+ * Rotaciona o arquivo de log: arquivo.(N-1) e descartado, arquivo.i passa
+ * a arquivo.(i+1), e o arquivo atual passa a arquivo.1
+ */
+static void log_rotaciona()
+{
+    char de[4096], para[4096];
+    int i;
+
+    fclose(log_global.saida);
+
+    for (i = LOG_ARQUIVOS - 1; i > 0; i--)
+    {
+        if (i == 1)
+            snprintf(de, sizeof(de), "%s", log_global.arquivo);
+        else
+            snprintf(de, sizeof(de), "%s.%d", log_global.arquivo, i - 1);
+
+        snprintf(para, sizeof(para), "%s.%d", log_global.arquivo, i);
+        rename(de, para);
+    }
+
+    log_global.saida = fopen(log_global.arquivo, "w");
+    log_global.escritos = 0;
+
+    if (log_global.saida == NULL)
+        log_global.saida = stderr;
+}
+
+/**
+ * Esvazia todos os aneis registrados na saida do log
+ *
+ * @return A quantidade de registros escritos
+ */
+static int log_esvazia()
+{
+    struct anel_log *a;
+    int total = 0;
+
+    pthread_mutex_lock(&log_global.trava);
+    a = log_global.aneis;
+    pthread_mutex_unlock(&log_global.trava);
+
+    // novos aneis entram no inicio da lista, entao a lista obtida acima
+    // continua valida sem a trava
+    for (; a != NULL; a = a->prox)
+    {
+        uint32_t l = atomic_load_explicit(&a->leitura, memory_order_relaxed);
+        uint32_t e = atomic_load_explicit(&a->escrita, memory_order_acquire);
+        uint64_t d = atomic_exchange_explicit(&a->descartados, 0,
+                memory_order_relaxed);
+
+        if (d)
+        {
+            log_global.escritos += fprintf(log_global.saida,
+                    "AVISO log: %lu registros descartados (anel cheio)\n",
+                    (unsigned long)d);
+        }
+
+        for (; l != e; l++)
+        {
+            struct registro_log *r = &a->reg[l & (LOG_ANEL - 1)];
+
+            fwrite(r->texto, 1, r->len, log_global.saida);
+            log_global.escritos += r->len;
+            total++;
+
+            if (log_global.arquivo != NULL
+                    &&
+                log_global.escritos >= LOG_ROTACAO)
+            {
+                log_rotaciona();
+            }
+        }
+
+        atomic_store_explicit(&a->leitura, l, memory_order_release);
+    }
+
+    if (total)
+        fflush(log_global.saida);
+
+    return total;
+}
+
+/**
+ * Thread de escrita do log, que dorme enquanto nao ha registros
+ */
+static void *log_escreve(void *arg)
+{
+    struct timespec espera = { 0, 10 * 1000000 };
+
+    (void)arg;
+
+    while (atomic_load(&log_global.ativo))
+    {
+        if (log_esvazia() == 0)
+            nanosleep(&espera, NULL);
+    }
+
+    log_esvazia();
+
+    return NULL;
+}
+
+/**
+ * Inicia o log assincrono e sua thread de escrita
+ *
+ * @param arquivo Caminho do arquivo de log, ou NULL para a saida padrao
+ * @param nivel Nivel de log em tempo de execucao
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int log_init(const char *arquivo, int nivel)
+{
+    log_nivel = nivel;
+    log_global.arquivo = arquivo;
+    log_global.escritos = 0;
+
+    if (arquivo != NULL)
+    {
+        if ((log_global.saida = fopen(arquivo, "a")) == NULL)
+            return -1;
+
+        fseek(log_global.saida, 0, SEEK_END);
+        log_global.escritos = ftell(log_global.saida);
+    }
+    else
+    {
+        log_global.saida = stdout;
+    }
+
+    atomic_store(&log_global.ativo, 1);
+
+    if (pthread_create(&log_global.thread, NULL, log_escreve, NULL) != 0)
+    {
+        atomic_store(&log_global.ativo, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Escreve os registros pendentes e encerra a thread de escrita
+ */
+void log_finaliza()
+{
+    if (atomic_exchange(&log_global.ativo, 0))
+        pthread_join(log_global.thread, NULL);
+}
@@ -4,6 +4,10 @@
  * @author Joao Borges
  */
 #include <stdint.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 /// \defgroup flags Flags segundo a RFC do TCP
 /// @{
@@ -13,6 +17,8 @@
 #define TH_PUSH 0x08 ///< Push (NAO USADA)
 #define TH_ACK  0x10 ///< Acknowledgment
 #define TH_URG  0x20 ///< Urgent (NAO USADA)
+#define TH_SACK 0x40 ///< Confirmacao seletiva (ver \ref sack)
+#define TH_V2   0x80 ///< Cabecalho v2 (ver \ref v2)
 /// @}
 
 /**
@@ -28,6 +34,152 @@ struct sdtphdr
     uint16_t checksum;  ///< Soma de verificacao
 };
 
+/**
+ * \defgroup sack Confirmacao seletiva (SACK)
+ *
+ * Extensao opcional, negociada no 3-way handshake: o cliente envia o SYN
+ * com TH_SACK e o servidor a aceita respondendo o SYN-ACK tambem com
+ * TH_SACK. A partir dai, um ACK com TH_SACK leva como dados ate
+ * SACK_BLOCOS blocos, em ordem crescente, com os intervalos ja recebidos
+ * alem do acknum, e o remetente retransmite apenas as lacunas.
+ */
+/// @{
+#define SACK_BLOCOS 4   ///< Maximo de blocos por ACK
+/// @}
+
+/**
+ * Bloco SACK: intervalo [ini, fim) de dados recebidos fora de ordem, com
+ * numeros de sequencia de 16 bits como os do cabecalho
+ */
+struct sackhdr
+{
+    uint16_t ini;       ///< Primeiro byte do bloco
+    uint16_t fim;       ///< Byte seguinte ao ultimo do bloco
+};
+
+/**
+ * Bloco SACK do cabecalho v2, com numeros de sequencia de 32 bits
+ */
+struct sackhdr2
+{
+    uint32_t ini;       ///< Primeiro byte do bloco
+    uint32_t fim;       ///< Byte seguinte ao ultimo do bloco
+};
+
+/**
+ * \defgroup v2 Cabecalho SDTP v2
+ *
+ * Cabecalho para transferencias grandes, com numeros de sequencia de 32
+ * bits e ate MSS2 bytes de dados. E negociado no 3-way handshake, como o
+ * SACK: o cliente envia o SYN (v1) com TH_V2 e, se o SYN-ACK (v1) tambem
+ * trouxer TH_V2, ambos passam a usar o v2 em todos os pacotes seguintes.
+ * Clientes v1 continuam usando o cabecalho original.
+ *
+ * O campo flags ocupa a mesma posicao nos dois cabecalhos, e todo pacote
+ * v2 leva TH_V2 sem TH_SYN, o que identifica a versao de cada pacote sem
+ * depender do estado da conexao (ver sdtp_versao).
+ *
+ * No FIN v2, seqnum leva o tamanho total dos dados e acknum o seu
+ * checksum, de modo que o servidor aceita transferencias de qualquer
+ * tamanho, e nao apenas o arquivo de LOREMSIZE bytes.
+ */
+/// @{
+#define MSS2        8952            ///< Maximo de dados v2 (quadro de 9000
+                                    ///< bytes, menos IP, UDP e cabecalho)
+#define MAXSDTP2    (20 + MSS2)     ///< Cabecalho v2 + MSS2
+#define SDTP_V2     2               ///< Valor do campo versao no v2
+/// @}
+
+/**
+ * Cabecalho SDTP v2 (20 bytes)
+ */
+struct sdtphdr2
+{
+    uint32_t seqnum;    ///< Numero de sequencia (deslocamento nos dados)
+    uint8_t  versao;    ///< Versao do cabecalho (SDTP_V2)
+    uint8_t  flags;     ///< Campo de flags, sempre com TH_V2
+    uint16_t checksum;  ///< Soma de verificacao
+    uint32_t acknum;    ///< Numero de confirmacao
+    uint32_t window;    ///< Tamanho da janela
+    uint16_t datalen;   ///< Tamanho dos dados no segmento
+    uint16_t reservado; ///< Reservado (zero)
+};
+
+/**
+ * Pacote SDTP decodificado, independente da versao do cabecalho
+ */
+struct pacote_sdtp
+{
+    int      versao;    ///< 1 ou 2
+    uint32_t seqnum;    ///< Numero de sequencia
+    uint32_t acknum;    ///< Numero de confirmacao
+    uint32_t window;    ///< Tamanho da janela
+    uint16_t datalen;   ///< Tamanho dos dados
+    uint8_t  flags;     ///< Campo de flags (sem TH_V2 nos pacotes v2)
+    char    *dados;     ///< Dados, logo apos o cabecalho
+};
+
+/**
+ * Identifica a versao do cabecalho de um pacote
+ *
+ * @param buf O pacote, com ao menos os 6 primeiros bytes
+ *
+ * @return 2 se o pacote usa o cabecalho v2, 1 caso contrario
+ */
+int sdtp_versao(const void *buf);
+
+/**
+ * Retorna o tamanho do cabecalho da versao informada
+ */
+int sdtp_cabecalho(int versao);
+
+/**
+ * Le o cabecalho de um pacote, que deve ter ao menos o tamanho do
+ * cabecalho da sua versao, sem verificar o tamanho dos dados
+ *
+ * @param buf O pacote
+ * @param p O pacote decodificado
+ */
+void sdtp_le(void *buf, struct pacote_sdtp *p);
+
+/**
+ * Decodifica um pacote recebido, verificando o seu tamanho (mas nao o
+ * checksum)
+ *
+ * @param buf O pacote
+ * @param len Bytes recebidos
+ * @param p O pacote decodificado
+ *
+ * @return 0 em caso de sucesso, -1 se o pacote estiver truncado
+ */
+int sdtp_decodifica(void *buf, int len, struct pacote_sdtp *p);
+
+/**
+ * Monta o cabecalho da versao p->versao, e calcula o checksum do
+ * cabecalho e dos p->datalen bytes de dados, que ja devem estar em
+ * buf + sdtp_cabecalho(p->versao)
+ *
+ * @param buf Destino do pacote
+ * @param p O pacote a codificar
+ *
+ * @return O tamanho total do pacote
+ */
+int sdtp_codifica(void *buf, struct pacote_sdtp *p);
+
+/**
+ * Monta apenas o cabecalho da versao p->versao, calculando o checksum
+ * sobre o cabecalho e os p->datalen bytes de dados, que podem estar em
+ * outro buffer (envio com sendmsg e dois iovecs, sem copia dos dados)
+ *
+ * @param hdr Destino do cabecalho
+ * @param p O pacote a codificar
+ * @param dados Dados do pacote
+ *
+ * @return O tamanho do cabecalho
+ */
+int sdtp_codifica_cabecalho(void *hdr, struct pacote_sdtp *p,
+        const void *dados);
+
 /**
  * \defgroup constants Constantes usadas pelo protocolo
  */
@@ -40,8 +192,95 @@ struct sdtphdr
 #define BETA         0.25     ///< Valor inicial do \f$\beta\f$
 #define ESTIMATEDRTT 250      ///< RTT estimado inicial (ms)
 #define DEVRTT       0        ///< Desvio do RTT estimado inicial (ms)
+#define RTOMIN       20       ///< Menor tempo de retransmissao (ms)
+#define RTOMAX       10000    ///< Maior tempo de retransmissao (ms)
 /// @}
 
+/**
+ * \defgroup offload Segmentacao (GSO) e agregacao (GRO) do UDP no kernel
+ *
+ * Com UDP_SEGMENT, o cliente entrega ao kernel, em uma so chamada, varios
+ * segmentos SDTP de mesmo tamanho (apenas o ultimo pode ser menor), e o
+ * kernel os separa em datagramas. Com UDP_GRO, o servidor recebe, em uma
+ * so mensagem, datagramas agregados pelo kernel, junto com o tamanho de
+ * cada um, e os separa antes do tratamento.
+ *
+ * Ambos sao detectados em tempo de execucao, com o envio e a recepcao de
+ * um datagrama por segmento como alternativa.
+ */
+/// @{
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT  103      ///< Opcao GSO (linux/udp.h)
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO      104      ///< Opcao GRO (linux/udp.h)
+#endif
+#define GSO_SEGMENTOS 64      ///< Maximo de segmentos por chamada
+#define GSO_BYTES    65507    ///< Maximo de bytes por chamada (datagrama)
+/// @}
+
+/**
+ * Rajada de segmentos de dados de um socket conectado, enviada em uma so
+ * chamada com UDP_SEGMENT (ver \ref offload)
+ *
+ * Os cabecalhos sao copiados para a rajada; os dados seguem do buffer do
+ * chamador, que deve existir ate o envio. Os contadores permitem medir os
+ * segmentos por chamada de envio.
+ */
+struct rajada_sdtp
+{
+    int sock;                   ///< Socket UDP, conectado ao destino
+    int gso;                    ///< Segmentacao no kernel ativa
+    int n;                      ///< Segmentos acumulados
+    uint32_t bytes;             ///< Bytes acumulados
+    uint16_t tamseg;            ///< Tamanho dos segmentos da rajada
+    unsigned long chamadas;     ///< Chamadas de envio dos segmentos
+    unsigned long segmentos;    ///< Segmentos enviados
+    char cabecalhos[GSO_SEGMENTOS][sizeof(struct sdtphdr2)]; ///< Cabecalhos
+                                ///< dos segmentos
+    struct iovec iov[2 * GSO_SEGMENTOS]; ///< Cabecalho e dados de cada
+                                ///< segmento
+    char controle[CMSG_SPACE(sizeof(uint16_t))]; ///< Tamanho dos segmentos
+                                ///< (UDP_SEGMENT)
+};
+
+/**
+ * Inicializa uma rajada vazia
+ *
+ * @param r A rajada
+ * @param sock Socket UDP, ja conectado ao destino
+ * @param gso Usa a segmentacao no kernel, se o kernel a conhecer
+ */
+void rajada_init(struct rajada_sdtp *r, int sock, int gso);
+
+/**
+ * Envia um datagrama pela rajada
+ *
+ * Um pacote de controle (um iovec) sai na hora, depois dos segmentos
+ * acumulados. Um segmento de dados (cabecalho e dados, dois iovecs) entra
+ * na rajada, que e enviada quando encher, quando um segmento menor a
+ * encerrar, ou em rajada_descarrega. Sem GSO, cada segmento sai na hora.
+ *
+ * @param r A rajada
+ * @param iov O datagrama
+ * @param n Quantidade de iovecs (1 ou 2)
+ *
+ * @return 0 em caso de sucesso, -1 se o envio falhou
+ */
+int rajada_envia(struct rajada_sdtp *r, struct iovec *iov, int n);
+
+/**
+ * Envia os segmentos acumulados na rajada
+ *
+ * Com mais de um segmento, a rajada sai em uma so chamada, e o kernel a
+ * separa em datagramas de r->tamseg bytes. Se o kernel ou a interface
+ * recusarem a segmentacao, ela e desativada, e a rajada e reenviada um
+ * segmento por chamada.
+ *
+ * @return 0 em caso de sucesso, -1 se o envio falhou
+ */
+int rajada_descarrega(struct rajada_sdtp *r);
+
 /**
  * Timeout para a recepcao de uma mensagem UDP, utilizando a funcao
  * recvfrom, adaptado de Beej's Guide to Network Programming
@@ -64,6 +303,586 @@ struct sdtphdr
 int recvtimeout(int s, char *buf, int len, int timeout, 
         struct sockaddr *dest, int *destlen);
 
+/**
+ * \defgroup evloop Laco de eventos (epoll) e temporizadores
+ *
+ * Permite aguardar, de uma so vez, por muitos sockets e por muitos
+ * prazos (retransmissao, ociosidade, etc.). Os descritores sao
+ * registrados uma unica vez no epoll, e os temporizadores ficam em uma
+ * roda hierarquica de RODA_NIVEIS niveis de RODA_POSICOES posicoes, com
+ * insercao e remocao O(1).
+ *
+ * O nivel 0 tem posicoes de 1 ms, e cada posicao do nivel n cobre uma
+ * volta inteira do nivel n-1. Um prazo fica no nivel mais baixo capaz de
+ * representa-lo, e desce de nivel (cascata) quando a roda do nivel abaixo
+ * completa a volta que o alcanca; cada temporizador e movido no maximo
+ * RODA_NIVEIS-1 vezes. Prazos alem do ultimo nivel (cerca de 4,6 horas)
+ * ficam na sua ultima posicao, e sao reavaliados a cada volta.
+ */
+/// @{
+#define RODA_BITS       6   ///< Bits do indice de cada nivel da roda
+#define RODA_POSICOES   (1 << RODA_BITS) ///< Posicoes de cada nivel
+#define RODA_NIVEIS     4   ///< Niveis da roda
+#define EVLOOP_EVENTOS  64  ///< Eventos de descritores tratados por espera
+/// @}
+
+struct timer_sdtp;
+struct evfd_sdtp;
+
+/**
+ * Funcao chamada quando um descritor registrado fica pronto
+ *
+ * @param e O registro do descritor
+ * @param eventos Os eventos ocorridos (EPOLLIN, EPOLLOUT, ...)
+ */
+typedef void (*evfd_cb)(struct evfd_sdtp *e, uint32_t eventos);
+
+/**
+ * Funcao chamada quando um temporizador expira
+ *
+ * O temporizador ja esta desarmado, e pode ser armado novamente dentro
+ * da propria funcao.
+ */
+typedef void (*timer_cb)(struct timer_sdtp *t);
+
+/**
+ * Registro de um descritor no laco de eventos, mantido pelo chamador
+ */
+struct evfd_sdtp
+{
+    int     fd;     ///< Descritor monitorado
+    evfd_cb cb;     ///< Funcao chamada quando o descritor fica pronto
+    void   *arg;    ///< Argumento livre do chamador
+};
+
+/**
+ * Temporizador do laco de eventos, mantido pelo chamador
+ */
+struct timer_sdtp
+{
+    struct timer_sdtp *prox;    ///< Proximo da posicao da roda
+    struct timer_sdtp *ant;     ///< Anterior da posicao da roda
+    uint64_t expira;            ///< Instante de expiracao (ms)
+    timer_cb cb;                ///< Funcao chamada na expiracao
+    void    *arg;               ///< Argumento livre do chamador
+};
+
+/**
+ * Laco de eventos
+ */
+struct evloop_sdtp
+{
+    int      epfd;                          ///< Descritor do epoll
+    uint64_t agora;                         ///< Ultimo instante processado
+    int      ntimers;                       ///< Temporizadores armados
+    struct timer_sdtp roda[RODA_NIVEIS][RODA_POSICOES]; ///< Cabecas das
+                                            ///< posicoes de cada nivel
+    struct epoll_event eventos[EVLOOP_EVENTOS]; ///< Eventos de uma espera
+};
+
+/**
+ * Retorna o instante atual de um relogio monotonico, em milisegundos
+ */
+uint64_t agora_ms();
+
+/**
+ * Retorna o instante atual de um relogio monotonico, em microsegundos
+ */
+uint64_t agora_us();
+
+/**
+ * \defgroup rtt Estimador do RTT e do tempo de retransmissao
+ *
+ * Segue Jacobson/Karels (RFC 6298), com os pesos ALPHA e BETA:
+ * - EstimatedRTT = (1 - ALPHA) * EstimatedRTT + ALPHA * SampleRTT
+ * - DevRTT = (1 - BETA) * DevRTT + BETA * |SampleRTT - EstimatedRTT|
+ * - RTO = EstimatedRTT + 4 * DevRTT, limitado a [RTOMIN, RTOMAX]
+ *
+ * Antes da primeira amostra valem ESTIMATEDRTT e DEVRTT; a primeira
+ * amostra inicia EstimatedRTT = SampleRTT e DevRTT = SampleRTT/2. Cada
+ * expiracao dobra o RTO (recuo exponencial) ate uma nova amostra valida.
+ * Pela regra de Karn, o remetente nao deve fornecer amostras de segmentos
+ * retransmitidos, cuja confirmacao e ambigua.
+ */
+/// @{
+#define RTT_RECUO_MAX   16  ///< Maximo de duplicacoes do RTO
+/// @}
+
+/**
+ * Estado do estimador de RTT de uma conexao
+ */
+struct rtt_sdtp
+{
+    double srtt;        ///< RTT estimado (ms)
+    double rttvar;      ///< Desvio do RTT estimado (ms)
+    int    recuo;       ///< Duplicacoes do RTO desde a ultima amostra
+    unsigned long amostras; ///< Amostras recebidas
+};
+
+/**
+ * Inicializa o estimador com ESTIMATEDRTT e DEVRTT
+ */
+void rtt_init(struct rtt_sdtp *r);
+
+/**
+ * Atualiza o estimador com uma amostra de RTT, desfazendo o recuo
+ *
+ * @param r O estimador
+ * @param ms O RTT medido (ms) de um segmento nao retransmitido
+ */
+void rtt_amostra(struct rtt_sdtp *r, double ms);
+
+/**
+ * Dobra o RTO apos uma expiracao, ate RTOMAX
+ */
+void rtt_recua(struct rtt_sdtp *r);
+
+/**
+ * Retorna o RTO atual (ms), ja com o recuo e os limites aplicados
+ */
+uint64_t rtt_rto(struct rtt_sdtp *r);
+
+/**
+ * Inicializa o laco de eventos
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int evloop_init(struct evloop_sdtp *ev);
+
+/**
+ * Libera os recursos do laco de eventos
+ */
+void evloop_destroy(struct evloop_sdtp *ev);
+
+/**
+ * Registra um descritor no laco de eventos
+ *
+ * @param ev O laco de eventos
+ * @param e Registro do descritor (deve existir enquanto registrado)
+ * @param fd Descritor a monitorar
+ * @param eventos Eventos desejados (EPOLLIN, EPOLLOUT, ...)
+ * @param cb Funcao chamada quando o descritor ficar pronto
+ * @param arg Argumento livre do chamador
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int evloop_add_fd(struct evloop_sdtp *ev, struct evfd_sdtp *e, int fd,
+        uint32_t eventos, evfd_cb cb, void *arg);
+
+/**
+ * Remove o registro de um descritor do laco de eventos
+ */
+int evloop_del_fd(struct evloop_sdtp *ev, struct evfd_sdtp *e);
+
+/**
+ * Inicializa um temporizador, ainda desarmado
+ */
+void timer_init(struct timer_sdtp *t, timer_cb cb, void *arg);
+
+/**
+ * Arma (ou rearma) um temporizador para expirar apos ms milisegundos
+ */
+void timer_arma(struct evloop_sdtp *ev, struct timer_sdtp *t, uint64_t ms);
+
+/**
+ * Desarma um temporizador, caso esteja armado
+ */
+void timer_desarma(struct evloop_sdtp *ev, struct timer_sdtp *t);
+
+/**
+ * Verifica se um temporizador esta armado
+ */
+#define timer_armado(t) ((t)->prox != NULL)
+
+/**
+ * Avanca a roda ate o instante agora (ms, no relogio de agora_ms),
+ * disparando os temporizadores expirados, sem aguardar pelos descritores
+ *
+ * Usado pelo evloop_executa com o relogio real, e pelo replay_sdtp com o
+ * relogio da captura. Instantes anteriores ao ultimo processado sao
+ * ignorados.
+ *
+ * @return A quantidade de temporizadores disparados
+ */
+int evloop_avanca(struct evloop_sdtp *ev, uint64_t agora);
+
+/**
+ * Calcula quantos milisegundos, apos o ultimo instante processado, faltam
+ * ate a roda precisar avancar: a proxima expiracao, ou a proxima cascata
+ * de um nivel superior, que nunca vem depois da expiracao mais proxima
+ *
+ * Avancar a roda ate esse instante (evloop_avanca) nunca salta uma
+ * expiracao; e o que o evloop_executa aguarda, e o que o teste_roda usa
+ * para saltar o seu relogio simulado.
+ *
+ * @return A espera em ms, ou -1 se nao houver temporizadores
+ */
+int evloop_proximo(struct evloop_sdtp *ev);
+
+/**
+ * Executa uma iteracao do laco de eventos: aguarda ate timeout
+ * milisegundos (ou ate o proximo temporizador), dispara os temporizadores
+ * expirados e trata os descritores prontos
+ *
+ * A roda avanca antes dos descritores, para que os prazos armados por
+ * eles contem do instante atual, e nao do fim da espera anterior.
+ *
+ * @param ev O laco de eventos
+ * @param timeout Maximo de espera (ms), -1 para aguardar indefinidamente
+ *
+ * @return A quantidade de descritores e temporizadores tratados, ou -1 em
+ * caso de erro
+ */
+int evloop_executa(struct evloop_sdtp *ev, int timeout);
+
+/**
+ * \defgroup congestao Controle de congestionamento do remetente
+ *
+ * A janela de congestionamento (cwnd) limita, junto a janela anunciada
+ * pelo receptor, os bytes em transito: min(cwnd, janela). O motor de
+ * envio trata as fases comuns (RFC 5681 e RFC 6582):
+ * - Partida lenta: enquanto cwnd < ssthresh, cwnd cresce um MSS por ACK
+ * - Prevencao de congestionamento: o crescimento fica a cargo da
+ *   implementacao selecionada (Reno: um MSS por RTT; CUBIC: RFC 8312)
+ * - Retransmissao rapida: no terceiro ACK duplicado, o segmento mais
+ *   antigo e retransmitido, sem aguardar o temporizador
+ * - Recuperacao rapida (NewReno): cwnd = ssthresh + 3 MSS, crescendo um
+ *   MSS por ACK duplicado; cada ACK parcial retransmite a proxima lacuna,
+ *   ate a confirmacao de todos os dados enviados antes da perda
+ * - Expiracao do temporizador: cwnd volta a um MSS
+ */
+/// @{
+#define CONGESTAO_INICIAL   4       ///< Janela inicial (segmentos)
+#define CONGESTAO_DUPACKS   3       ///< ACKs duplicados para a perda
+#define CUBIC_C             0.4     ///< Constante de escala do CUBIC
+#define CUBIC_BETA          0.7     ///< Fator de reducao do CUBIC
+/// @}
+
+struct congestao_impl;
+
+/**
+ * Estado do controle de congestionamento de um remetente
+ */
+struct congestao_sdtp
+{
+    const struct congestao_impl *impl; ///< Implementacao selecionada
+    uint32_t mss;               ///< Maximo de dados por segmento
+    uint32_t cwnd;              ///< Janela de congestionamento (bytes)
+    uint32_t ssthresh;          ///< Limiar da partida lenta (bytes)
+    uint32_t acumulado;         ///< Bytes confirmados desde o ultimo
+                                ///< aumento na prevencao
+    uint32_t seguidos;          ///< ACKs duplicados consecutivos
+    int recuperacao;            ///< Em recuperacao rapida
+    uint32_t recupera;          ///< Fim da recuperacao (NewReno)
+    double wmax;                ///< Janela antes da ultima perda (CUBIC,
+                                ///< segmentos)
+    double k;                   ///< Tempo ate voltar a wmax (CUBIC, s)
+    double origem;              ///< Ponto de inflexao (CUBIC, segmentos)
+    uint64_t epoca;             ///< Inicio da epoca (CUBIC, ms), ou 0
+    unsigned long rapidas;      ///< Retransmissoes rapidas
+    unsigned long expiracoes;   ///< Expiracoes do temporizador
+};
+
+/**
+ * Implementacao da fase de prevencao de congestionamento
+ */
+struct congestao_impl
+{
+    const char *nome;           ///< Nome da implementacao
+    /// Aumenta cwnd por bytes confirmados, com cwnd >= ssthresh
+    void (*aumenta)(struct congestao_sdtp *c, uint32_t confirmados,
+            double srtt);
+    /// Retorna o novo ssthresh apos uma perda, com transito bytes em voo
+    uint32_t (*reduz)(struct congestao_sdtp *c, uint32_t transito);
+};
+
+/**
+ * Implementacoes do controle de congestionamento, a primeira sendo a
+ * padrao, terminadas por uma entrada com nome NULL
+ */
+extern const struct congestao_impl congestao_impls[];
+
+/**
+ * \defgroup envio Motor de envio com janela deslizante
+ *
+ * Mantem varios segmentos em transito, ate a janela anunciada pelo
+ * receptor, guardando os ainda nao confirmados para retransmissao. Os
+ * numeros de sequencia internos sao deslocamentos de 32 bits nos dados,
+ * e o chamador os converte para o cabecalho.
+ *
+ * - Go-Back-N: um unico temporizador, do segmento mais antigo; na sua
+ *   expiracao, todos os segmentos em transito sao retransmitidos
+ * - Selective Repeat: um temporizador por segmento; na expiracao, apenas
+ *   o segmento correspondente e retransmitido
+ *
+ * Em ambos os modos, os bytes em transito sao limitados pelo controle de
+ * congestionamento (ver \ref congestao).
+ *
+ * Apos ENVIO_EXPIRACOES expiracoes seguidas sem que o receptor confirme
+ * nenhum dado novo (nem por SACK), o envio e abandonado, e o chamador e
+ * avisado (envio_sdtp.desiste), como no SYN e no FIN.
+ */
+/// @{
+#define ENVIO_GBN       0       ///< Go-Back-N
+#define ENVIO_SR        1       ///< Selective Repeat
+#define ENVIO_SEGMENTOS 1024    ///< Maximo de segmentos em transito
+#define ENVIO_EXPIRACOES 15     ///< Expiracoes seguidas sem progresso
+/// @}
+
+struct envio_sdtp;
+
+/**
+ * Segmento em transito, aguardando confirmacao
+ */
+struct segmento_sdtp
+{
+    uint32_t seq;               ///< Deslocamento do segmento nos dados
+    uint32_t len;               ///< Tamanho do segmento
+    uint64_t enviado;           ///< Instante do ultimo envio (us)
+    uint32_t transmissoes;      ///< Quantidade de envios do segmento
+    int sackeado;               ///< Recebido, segundo um bloco SACK
+    struct timer_sdtp timer;    ///< Temporizador (Selective Repeat)
+};
+
+/**
+ * Funcao do chamador que monta e envia um segmento
+ *
+ * @param e O motor de envio
+ * @param seg O segmento a enviar, cujos dados comecam em e->dados+seg->seq
+ *
+ * @return 0 em caso de sucesso, -1 se o envio falhou
+ */
+typedef int (*envio_cb)(struct envio_sdtp *e, struct segmento_sdtp *seg);
+
+/**
+ * Motor de envio de uma conexao
+ */
+struct envio_sdtp
+{
+    int modo;                   ///< ENVIO_GBN ou ENVIO_SR
+    const char *dados;          ///< Dados a enviar
+    uint32_t tamanho;           ///< Tamanho dos dados
+    uint32_t mss;               ///< Maximo de dados por segmento
+    uint32_t base;              ///< Primeiro byte nao confirmado
+    uint32_t proximo;           ///< Proximo byte ainda nao enviado
+    uint32_t janela;            ///< Janela anunciada pelo receptor
+    struct segmento_sdtp seg[ENVIO_SEGMENTOS]; ///< Segmentos em transito
+    uint32_t ini;               ///< Posicao do segmento mais antigo
+    uint32_t nseg;              ///< Quantidade de segmentos em transito
+    struct evloop_sdtp *ev;     ///< Laco de eventos dos temporizadores
+    struct timer_sdtp timer;    ///< Temporizador (Go-Back-N)
+    struct rtt_sdtp rtt;        ///< Estimador do RTT e do RTO
+    struct congestao_sdtp cc;   ///< Controle de congestionamento
+    envio_cb transmite;         ///< Envia um segmento
+    void *arg;                  ///< Argumento livre do chamador
+    void (*desiste)(struct envio_sdtp *e); ///< Chamada ao abandonar o
+                                ///< envio (ver ENVIO_EXPIRACOES), ou NULL
+    int expiradas;              ///< Expiracoes seguidas sem progresso
+    unsigned long segmentos;    ///< Segmentos enviados (com retransmissoes)
+    unsigned long retransmissoes; ///< Segmentos retransmitidos
+    unsigned long acks;         ///< Confirmacoes recebidas
+    unsigned long dupacks;      ///< Confirmacoes duplicadas recebidas
+    unsigned long sackeados;    ///< Segmentos confirmados por blocos SACK
+};
+
+/**
+ * Inicializa o motor de envio
+ *
+ * @param e O motor de envio
+ * @param ev Laco de eventos usado pelos temporizadores
+ * @param modo ENVIO_GBN ou ENVIO_SR
+ * @param dados Dados a enviar (devem existir ate o fim do envio)
+ * @param tamanho Tamanho dos dados
+ * @param mss Maximo de dados por segmento
+ * @param transmite Funcao que monta e envia um segmento
+ * @param arg Argumento livre do chamador
+ */
+void envio_init(struct envio_sdtp *e, struct evloop_sdtp *ev, int modo,
+        const char *dados, uint32_t tamanho, uint32_t mss,
+        envio_cb transmite, void *arg);
+
+/**
+ * Seleciona o controle de congestionamento do motor de envio, antes do
+ * inicio do envio
+ *
+ * @param e O motor de envio
+ * @param nome Nome da implementacao (ver congestao_impls)
+ *
+ * @return 0 em caso de sucesso, -1 se a implementacao nao existir
+ */
+int envio_congestao(struct envio_sdtp *e, const char *nome);
+
+/**
+ * Ajusta o maximo de dados por segmento, e a janela de congestionamento
+ * inicial, antes do inicio do envio (por exemplo, apos a negociacao do
+ * cabecalho v2)
+ */
+void envio_mss(struct envio_sdtp *e, uint32_t mss);
+
+/**
+ * Desarma os temporizadores do motor de envio
+ */
+void envio_destroy(struct envio_sdtp *e);
+
+/**
+ * Envia os novos segmentos que couberem na janela
+ *
+ * @return A quantidade de segmentos enviados
+ */
+int envio_envia(struct envio_sdtp *e);
+
+/**
+ * Trata uma confirmacao cumulativa, liberando os segmentos confirmados e
+ * enviando os novos segmentos que passarem a caber na janela
+ *
+ * @param e O motor de envio
+ * @param ack Proximo byte esperado pelo receptor
+ * @param janela Janela anunciada pelo receptor
+ *
+ * @return A quantidade de bytes confirmados por esta confirmacao
+ */
+uint32_t envio_ack(struct envio_sdtp *e, uint32_t ack, uint32_t janela);
+
+/**
+ * Trata um bloco SACK, marcando os segmentos em transito inteiramente
+ * contidos nele, que deixam de ser retransmitidos
+ *
+ * @param e O motor de envio
+ * @param ini Primeiro byte do bloco
+ * @param fim Byte seguinte ao ultimo do bloco
+ *
+ * @return A quantidade de segmentos marcados por este bloco
+ */
+int envio_sack(struct envio_sdtp *e, uint32_t ini, uint32_t fim);
+
+/**
+ * Converte um numero de confirmacao de 16 bits para o deslocamento de 32
+ * bits mais proximo da base da janela
+ */
+uint32_t envio_desembrulha(struct envio_sdtp *e, uint16_t ack);
+
+/**
+ * Verifica se todos os dados foram confirmados
+ */
+#define envio_concluido(e) ((e)->base == (e)->tamanho)
+
+/**
+ * \defgroup conexao Conexao do lado do cliente
+ *
+ * Maquina de estados de uma transferencia, comum ao cliente_sdtp e ao
+ * carga_sdtp:
+ * - Envia o SYN (retransmitindo) ate receber o SYN-ACK, negociando o SACK
+ *   e o cabecalho v2, e responde com ACK, devolvendo o cookie do servidor
+ *   (que tambem segue nos dados)
+ * - Envia os dados pelo motor de envio (ver \ref envio), convertendo as
+ *   confirmacoes e os blocos SACK de cada versao do cabecalho
+ * - Envia o FIN (retransmitindo) ate receber o ACK (dados corretos) ou o
+ *   RST (dados incorretos)
+ *
+ * O SYN e o FIN sao reenviados com recuo exponencial, ate um maximo de
+ * tentativas. Os datagramas saem por uma funcao do chamador, que pode
+ * agrupa-los (GSO) ou descarta-los (perdas simuladas).
+ */
+/// @{
+#define CONEXAO_SYN         0   ///< Envia o SYN e aguarda o SYN-ACK
+#define CONEXAO_DADOS       1   ///< Envia os dados
+#define CONEXAO_FIN         2   ///< Envia o FIN e aguarda o ACK ou RST
+#define CONEXAO_FIM         3   ///< Transferencia encerrada
+#define CONEXAO_TENTATIVAS  50  ///< Envios do SYN e do FIN (padrao)
+/// @}
+
+struct conexao_sdtp;
+
+/**
+ * Funcao do chamador que envia um datagrama da conexao
+ *
+ * @param c A conexao
+ * @param iov O datagrama: um iovec nos pacotes de controle (SYN, ACK e
+ * FIN), ou dois nos segmentos de dados (cabecalho e dados, estes direto de
+ * c->envio.dados)
+ * @param n Quantidade de iovecs
+ *
+ * @return 0 em caso de sucesso, -1 se o envio falhou
+ */
+typedef int (*conexao_envia_cb)(struct conexao_sdtp *c, struct iovec *iov,
+        int n);
+
+/**
+ * Funcao do chamador avisada de um evento da conexao
+ */
+typedef void (*conexao_cb)(struct conexao_sdtp *c);
+
+/**
+ * Conexao do lado do cliente
+ */
+struct conexao_sdtp
+{
+    int sock;                   ///< Socket UDP, conectado ao servidor
+    int estado;                 ///< Estado @see conexao
+    int tentativas;             ///< Envios do pacote de controle atual
+    int max_tentativas;         ///< Envios do SYN e do FIN antes de desistir
+    int versao;                 ///< Versao do cabecalho pedida/aceita
+    int sack;                   ///< Confirmacao seletiva pedida/aceita
+    int resultado;              ///< 0 (ACK no FIN) ou 1 (RST ou falha)
+    uint16_t somadados;         ///< Checksum dos dados (FIN v2)
+    uint32_t cookie;            ///< Cookie recebido no SYN-ACK
+    uint64_t inicio;            ///< Primeiro envio do SYN (us)
+    uint64_t enviado;           ///< Envio do pacote de controle (us)
+    uint64_t handshake;         ///< Do primeiro SYN ao SYN-ACK (us), ou 0
+    struct evloop_sdtp *ev;     ///< Laco de eventos
+    struct timer_sdtp timer;    ///< Retransmissao do SYN e do FIN
+    struct envio_sdtp envio;    ///< Motor de envio dos dados
+    conexao_envia_cb envia;     ///< Envia um datagrama
+    conexao_cb ack;             ///< Chamada a cada ACK dos dados, ou NULL
+    conexao_cb fim;             ///< Chamada ao fim da transferencia, ou
+                                ///< NULL; pode reiniciar a conexao
+    void *arg;                  ///< Argumento livre do chamador
+};
+
+/**
+ * Inicializa uma conexao, ainda sem enviar o SYN
+ *
+ * @param c A conexao
+ * @param ev Laco de eventos dos temporizadores
+ * @param sock Socket UDP, ja conectado ao servidor
+ * @param modo ENVIO_GBN ou ENVIO_SR
+ * @param dados Dados a enviar (devem existir ate o fim da conexao)
+ * @param tamanho Tamanho dos dados
+ * @param versao Versao do cabecalho pedida no SYN (1 ou SDTP_V2)
+ * @param sack Pede a confirmacao seletiva no SYN
+ * @param envia Funcao que envia os datagramas
+ * @param arg Argumento livre do chamador
+ */
+void conexao_init(struct conexao_sdtp *c, struct evloop_sdtp *ev, int sock,
+        int modo, const char *dados, uint32_t tamanho, int versao, int sack,
+        conexao_envia_cb envia, void *arg);
+
+/**
+ * Inicia o 3-way handshake, enviando o primeiro SYN
+ */
+void conexao_inicia(struct conexao_sdtp *c);
+
+/**
+ * Trata um pacote recebido do servidor, conforme o estado da conexao
+ *
+ * Se a transferencia terminar, c->fim e chamada por ultimo, e a conexao
+ * nao e mais acessada.
+ */
+void conexao_trata(struct conexao_sdtp *c, struct pacote_sdtp *pin);
+
+/**
+ * Recebe e trata os pacotes pendentes no socket da conexao, sem bloquear,
+ * descartando os truncados ou com checksum invalido
+ *
+ * @return A quantidade de datagramas recebidos
+ */
+int conexao_recebe(struct conexao_sdtp *c);
+
+/**
+ * Desarma os temporizadores da conexao
+ */
+void conexao_destroy(struct conexao_sdtp *c);
+
 /**
  * Calcula o checksum de um determinado pacote, seguindo a RFC 1071
  *
@@ -74,6 +893,112 @@ int recvtimeout(int s, char *buf, int len, int timeout,
  */
 uint16_t checksum(void *hdr, int count);
 
+/**
+ * Acumula a soma em complemento de um (RFC 1071) de um trecho de dados,
+ * sem inverter o resultado
+ *
+ * Permite calcular o checksum de dados nao contiguos, desde que cada
+ * trecho, exceto o ultimo, possua uma quantidade par de bytes:
+ * checksum = ~checksum_parcial(b, nb, checksum_parcial(a, na, 0))
+ *
+ * Usa a implementacao vetorial (AVX2, SSE2 ou NEON) disponivel no
+ * processador, escolhida na primeira chamada. Todas produzem o mesmo
+ * resultado, para qualquer alinhamento e tamanho dos dados.
+ *
+ * @param buf Ponteiro para o inicio dos dados a somar
+ * @param count A quantidade de bytes a contabilizar nesta soma
+ * @param sum Soma acumulada dos trechos anteriores (0 no primeiro)
+ *
+ * @return A soma acumulada, reduzida a 16 bits
+ */
+uint32_t checksum_parcial(const void *buf, int count, uint32_t sum);
+
+/**
+ * Junta a soma parcial de um trecho a soma acumulada dos trechos que o
+ * precedem
+ *
+ * Um trecho que comeca em um deslocamento impar tem seus bytes somados
+ * nas posicoes trocadas, e por isso sua soma e invertida (RFC 1071,
+ * secao 2) antes de ser acumulada. Assim, trechos de qualquer tamanho
+ * podem ser somados separadamente, em qualquer ordem.
+ *
+ * @param soma Soma acumulada
+ * @param parcial Soma do trecho (checksum_parcial com sum = 0)
+ * @param offset Deslocamento do inicio do trecho nos dados
+ *
+ * @return A soma acumulada, reduzida a 16 bits
+ */
+uint32_t checksum_combina(uint32_t soma, uint32_t parcial, uint32_t offset);
+
+/**
+ * Implementacao da soma do checksum
+ */
+struct checksum_impl
+{
+    const char *nome;   ///< Nome da implementacao
+    uint32_t (*soma)(const void *buf, int count, uint32_t sum); ///< Soma
+    int (*disponivel)(); ///< Retorna 1 se o processador a suporta
+};
+
+/**
+ * Implementacoes da soma do checksum, da preferida para a de referencia
+ * (escalar), terminadas por uma entrada com nome NULL
+ */
+extern const struct checksum_impl checksum_impls[];
+
+/**
+ * Seleciona a implementacao usada por checksum_parcial
+ *
+ * @param nome Nome da implementacao, ou NULL para a melhor disponivel
+ *
+ * @return O nome da implementacao selecionada, ou NULL se ela nao existir
+ * ou nao for suportada pelo processador
+ */
+const char *checksum_seleciona(const char *nome);
+
+/**
+ * Alocador de objetos de tamanho fixo
+ *
+ * Os objetos sao obtidos de blocos maiores (slabs), alocados conforme a
+ * necessidade, e os objetos devolvidos ficam em uma lista de livres para
+ * serem reaproveitados, sem voltar ao malloc.
+ */
+struct pool_sdtp
+{
+    size_t tamanho;     ///< Tamanho de cada objeto (alinhado)
+    int    por_slab;    ///< Quantidade de objetos em cada slab
+    void  *livres;      ///< Lista de objetos livres
+    void  *slabs;       ///< Lista de slabs alocados
+    size_t em_uso;      ///< Objetos entregues e ainda nao devolvidos
+    size_t total;       ///< Objetos existentes em todos os slabs
+};
+
+/**
+ * Inicializa um pool de objetos de tamanho fixo
+ *
+ * @param pool Ponteiro para o pool
+ * @param tamanho Tamanho de cada objeto
+ * @param por_slab Quantidade de objetos alocados de cada vez
+ */
+void pool_init(struct pool_sdtp *pool, size_t tamanho, int por_slab);
+
+/**
+ * Obtem um objeto do pool (com conteudo indefinido)
+ *
+ * @return Ponteiro para o objeto, ou NULL se faltar memoria
+ */
+void *pool_get(struct pool_sdtp *pool);
+
+/**
+ * Devolve um objeto obtido por pool_get ao pool
+ */
+void pool_put(struct pool_sdtp *pool, void *obj);
+
+/**
+ * Libera todos os slabs do pool, invalidando os objetos entregues
+ */
+void pool_destroy(struct pool_sdtp *pool);
+
 /**
  * Funcao de ajuda que imprime o conteudo de um pacote STDP na tela
  *
@@ -81,3 +1006,87 @@ uint16_t checksum(void *hdr, int count);
  */
 void printpacket(struct sdtphdr *p);
 
+/**
+ * \defgroup log Registro (log) assincrono
+ *
+ * Cada thread escreve seus registros, ja formatados, em um anel proprio
+ * (um produtor, um consumidor, sem travas), e uma thread de fundo os
+ * esvazia para a saida padrao ou para um arquivo, que e rotacionado ao
+ * atingir LOG_ROTACAO bytes. Com o anel cheio, o registro e descartado,
+ * nunca bloqueando quem o gerou.
+ *
+ * Registros acima de LOG_NIVEL_MAX nao sao compilados, e os acima de
+ * log_nivel nao avaliam argumentos, nao formatam e nao fazem chamadas ao
+ * sistema.
+ */
+/// @{
+#define NIVEL_ERRO      0           ///< Erros
+#define NIVEL_AVISO     1           ///< Situacoes anormais recuperaveis
+#define NIVEL_INFO      2           ///< Eventos de operacao (padrao)
+#define NIVEL_DEBUG     3           ///< Detalhes de cada pacote
+
+#ifndef LOG_NIVEL_MAX
+#define LOG_NIVEL_MAX   NIVEL_DEBUG ///< Maior nivel compilado
+#endif
+
+#define LOG_REGISTRO    256         ///< Tamanho maximo de um registro
+#define LOG_ANEL        1024        ///< Registros por anel (potencia de 2)
+#define LOG_ROTACAO     (64 << 20)  ///< Tamanho do arquivo para rotacao
+#define LOG_ARQUIVOS    4           ///< Arquivos rotacionados mantidos
+/// @}
+
+/**
+ * Nivel de log em tempo de execucao
+ */
+extern int log_nivel;
+
+/**
+ * Verifica se o nivel de log esta habilitado
+ */
+#define LOG_ATIVO(nivel) ((nivel) <= LOG_NIVEL_MAX && (nivel) <= log_nivel)
+
+/**
+ * Registra uma mensagem no log, no formato do printf, se o nivel estiver
+ * habilitado
+ */
+#define LOG(nivel, ...) \
+    do { if (LOG_ATIVO(nivel)) log_registra((nivel), __VA_ARGS__); } \
+    while (0)
+
+/**
+ * Registra o conteudo de um pacote STDP no log, se o nivel estiver
+ * habilitado
+ */
+#define LOGPACKET(nivel, p) \
+    do { if (LOG_ATIVO(nivel)) log_pacote((nivel), (p)); } while (0)
+
+/**
+ * Inicia o log assincrono e sua thread de escrita
+ *
+ * @param arquivo Caminho do arquivo de log, ou NULL para a saida padrao
+ * @param nivel Nivel de log em tempo de execucao
+ *
+ * @return 0 em caso de sucesso, -1 em caso de erro
+ */
+int log_init(const char *arquivo, int nivel);
+
+/**
+ * Escreve os registros pendentes e encerra a thread de escrita
+ */
+void log_finaliza();
+
+/**
+ * Formata uma mensagem no anel da thread atual
+ *
+ * Deve ser chamada atraves da macro LOG, que testa o nivel antes.
+ */
+void log_registra(int nivel, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/**
+ * Formata o conteudo de um pacote STDP (v1 ou v2) no anel da thread atual
+ *
+ * Deve ser chamada atraves da macro LOGPACKET, que testa o nivel antes.
+ */
+void log_pacote(int nivel, void *p);
+
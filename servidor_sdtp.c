@@ -3,8 +3,28 @@
  * \brief Implementacao do Servidor SDTP
  * \author Joao Borges
  *
- * \todo Implementar armazenamento do DEBUG do servidor em arquivos de LOG,
- * permitindo que ele possa rodar em \a background sem problemas
+ * As mensagens do servidor passam pelo log assincrono (ver \ref log), que
+ * pode ser gravado em arquivo (opcao -L), permitindo que ele rode em
+ * \a background. O detalhamento de cada pacote fica no nivel DEBUG (-l 3).
+ *
+ * No modo de gravacao (opcao -o), os dados de cada conexao vao direto para
+ * um arquivo no diretorio informado, e nao para blocos em memoria (ver
+ * grava_saida). Esse modo so aceita o cabecalho v2: o SYN sem TH_V2 e
+ * recusado com um RST.
+ *
+ * Cada conexao tem um prazo (ver \ref prazos), e e removida ao vence-lo:
+ * sem concluir o 3-way handshake, ociosa, ou apos a permanencia no estado
+ * CLOSED, em que FINs retransmitidos ainda sao respondidos.
+ *
+ * Acima de um limiar de conexoes semiabertas (opcao -c), o servidor passa a
+ * responder SYNs sem criar estado (ver \ref cookies).
+ *
+ * Quando o kernel oferece UDP_GRO (ver \ref offload), cada mensagem do lote
+ * pode trazer varios segmentos agregados, separados em recebe_lote.
+ *
+ * Com SERVIDOR_SEM_MAIN definido, o arquivo nao define o main, e pode ser
+ * incluido por outros programas (como o bench_sdtp.c e o replay_sdtp.c),
+ * que usam as suas funcoes diretamente, sem sockets.
  *  
  * \mainpage
  * 
@@ -46,13 +66,23 @@
  *   enviara um pacote RST para o cliente
  *
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/random.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "sdtp.h"
 
@@ -71,36 +101,353 @@
 #define SDTP_ERROR_LOST_OUT 0x02 ///< Perda de pacote no envio
 #define SDTP_ERROR_SUM_IN   0x03 ///< Checksum errado no pacote recebido
 #define SDTP_ERROR_SUM_OUT  0x04 ///< Checksum errado no pacote enviado
+#define SDTP_ERROR_BURST    0x05 ///< Perda em rajada na recepcao
+                                 ///< (Gilbert-Elliott)
+#define SDTP_ERROR_DUP      0x06 ///< Resposta duplicada
+#define SDTP_ERROR_REORDER  0x07 ///< Resposta reordenada
+#define SDTP_ERROR_DELAY    0x08 ///< Resposta adiada (atraso, variacao ou
+                                 ///< reordenacao)
+#define SDTP_ERRORS         9    ///< Quantidade de erros (com NONE)
+#define SDTP_ERROR_SORTEIO  5    ///< Erros excludentes, sorteados juntos
+                                 ///< (NONE a SUM_OUT)
+/// \}
+
+/**
+ * \defgroup simulacao Simulacao de erros da rede
+ *
+ * Os erros sao configurados na linha de comando (opcao -e, ver
+ * configura_simulacao) e sorteados pelo gerador de cada worker
+ * (xoshiro256**), semeado a partir de uma unica semente: com a mesma
+ * semente e a mesma sequencia de pacotes, um worker repete as mesmas
+ * decisoes. Ha tres mecanismos:
+ * - Erros excludentes (simerror): um sorteio por pacote recebido escolhe
+ *   entre perda na recepcao, perda no envio, checksum errado na recepcao
+ *   e checksum errado no envio, como na versao original
+ * - Perda em rajada (simerror): uma cadeia de Gilbert-Elliott por worker,
+ *   com estados bom e ruim, cada um com a sua taxa de perda
+ * - Saida (adia_resposta): duplicacao, atraso com variacao e reordenacao
+ *   das respostas, enviadas depois pelos temporizadores do worker
+ *
+ * O perfil padrao e o original: 10% de perda na recepcao, 5% no envio, 5%
+ * de checksum errado na recepcao e 10% no envio. Desligada (-e nenhum ou
+ * -E), a simulacao nao sorteia nada, e o tratamento dos pacotes apenas
+ * testa simulacao.ativa.
+ */
+/// \{
+#define SIM_REORDEM     10      ///< Atraso extra da resposta reordenada
+                                ///< (ms, padrao)
+#define SIM_ADIADAS     65536   ///< Respostas adiadas por worker; alem
+                                ///< disso, saem sem atraso
+#define SIM_SLAB        256     ///< Respostas adiadas alocadas de cada vez
+/// \}
+
+/**
+ * Define o calculo para geracao de um valor (nao nulo) para a janela,
+ * usando o gerador do worker w, no modo de teste com janela aleatoria
+ * (opcao -r)
+ */
+#define WINDOW(w) (sorteio(w) % MSS)+1
+
+/// \defgroup janela Parametros do controle de fluxo
+/// \{
+#define ORCAMENTO   64          ///< Memoria global para dados (MB, padrao)
+#define JANELAMAX   0xffff      ///< Maior janela representavel no v1
+#define JANELA_SAIDA (8u << 20) ///< Janela no modo de gravacao (bytes)
+#define SAIDAMAX    0xfffffff0u ///< Maximo de dados gravados por conexao v2
+/// \}
+
+/// \defgroup sincronia Sincronizacao dos arquivos de saida
+/// \{
+#define SINCRONIA_THREADS 4     ///< Threads que sincronizam os arquivos
+/// \}
+
+/// \defgroup tabela Parametros da tabela de conexoes
+/// \{
+#define TABELA_INICIAL      64 ///< Capacidade inicial (potencia de 2)
+#define TABELA_CARGA        50 ///< Ocupacao maxima (%) antes de redimensionar
+#define TABELA_MIGRA        16 ///< Posicoes migradas a cada operacao
+/// \}
+
+/// \defgroup buffers Parametros dos buffers de recepcao
+/// \{
+#define BUFMAX      2*LOREMSIZE ///< Maximo de dados aceitos por conexao
+#define BUFMAX2     (1u << 28)  ///< Maximo de dados aceitos por conexao v2
+#define BLOCO       4096        ///< Tamanho de cada bloco de dados
+#define BLOCOS_SLAB 64          ///< Blocos alocados de cada vez
+#define SOCKETS_SLAB 256        ///< Sockets sdtp alocados de cada vez
+#define FORA_MAX    16          ///< Intervalos adiantados por conexao
+/// \}
+
+/// \defgroup prazos Prazos das conexoes (ver expira_socket_sdtp)
+/// \{
+#define PRAZO_HANDSHAKE 5000    ///< Para concluir o 3-way handshake (ms)
+#define PRAZO_OCIOSO    30000   ///< Conexao estabelecida sem pacotes (ms)
+#define PRAZO_LINGER    10000   ///< Permanencia em CLOSED apos o ultimo
+                                ///< FIN (ms), como o TIME_WAIT do TCP
+/// \}
+
+/// \defgroup remocoes Motivos da remocao de uma conexao por prazo
+/// \{
+#define REMOCAO_HANDSHAKE   0   ///< Handshake nao concluido
+#define REMOCAO_OCIOSA      1   ///< Conexao estabelecida ociosa
+#define REMOCAO_LINGER      2   ///< Fim da permanencia em CLOSED
+#define REMOCOES            3   ///< Quantidade de motivos
+/// \}
+
+/**
+ * \defgroup cookies SYN cookies
+ *
+ * O SYN-ACK leva um cookie de 32 bits, nos campos seqnum (16 bits baixos)
+ * e acknum (16 bits altos) do cabecalho v1: um hash com chave (SipHash-2-4)
+ * do ip e da porta do cliente, da epoca (COOKIE_EPOCA) e das opcoes
+ * negociadas, que ocupam os 2 bits baixos do cookie. O cliente devolve o
+ * cookie no ACK (v1: seqnum e acknum, como recebidos; v2: acknum) e no
+ * acknum dos segmentos de dados (no v1, apenas os 16 bits baixos).
+ *
+ * Com mais de limiar_cookies conexoes semiabertas no worker, o SYN de uma
+ * tupla sem conexao e respondido sem criar estado; a conexao so e criada
+ * pelo ACK ou (no v2) pelo primeiro segmento de dados com um cookie
+ * valido, o que prova que o cliente recebe no endereco de origem. Os 16
+ * bits dos dados v1, aceitos em duas epocas, seriam adivinhados com
+ * poucos milhares de pacotes; por isso, no v1, apenas os 32 bits do ACK
+ * criam a conexao, e os dados sem conexao sao descartados. Os cookies sao
+ * aceitos sempre, mesmo apos o fim da inundacao. Clientes que nao devolvem
+ * o cookie so conseguem conectar fora da inundacao.
+ */
+/// \{
+#define COOKIE_LIMIAR   1024    ///< Semiabertas por worker (padrao)
+#define COOKIE_EPOCA    64000   ///< Duracao de cada epoca (ms); vale a
+                                ///< atual e a anterior
+#define COOKIE_SACK     0x1     ///< Opcao: confirmacao seletiva
+#define COOKIE_V2       0x2     ///< Opcao: cabecalho v2
+#define COOKIE_OPCOES   0x3     ///< Bits das opcoes no cookie
+/// \}
+
+/// \defgroup estatisticas Estatisticas dos workers
+/// \{
+#define ESTAT_PERIODO   1000    ///< Reescrita do arquivo Prometheus (ms)
+#define ESTAT_CLIENTES  16      ///< Consultas aceitas por evento
+/// \}
+
+/**
+ * Soma n a um contador das estatisticas de um worker
+ *
+ * Cada contador so e escrito pelo seu worker, e a leitura e a escrita
+ * relaxadas nao usam instrucoes atomicas de leitura e escrita (nem
+ * trava): a thread de estatisticas le um valor inteiro, ainda que
+ * ligeiramente atrasado.
+ */
+#define CONTA(c, n) atomic_store_explicit(&(c), \
+        atomic_load_explicit(&(c), memory_order_relaxed) + (n), \
+        memory_order_relaxed)
+
+/// Le um contador das estatisticas (ver CONTA)
+#define LE(c) atomic_load_explicit(&(c), memory_order_relaxed)
+
+/// Conexao ainda no 3-way handshake
+#define SEMIABERTA(estado) ((estado) == SDTP_WAIT_SYN \
+                            || (estado) == SDTP_WAIT_ACK)
+
+/// \defgroup lote Parametros da recepcao e envio em lote
+/// \{
+#define LOTE        32          ///< Pacotes por lote (padrao)
+#define LOTEMAX     1024        ///< Maximo de pacotes por lote
+#define WORKERSMAX  256         ///< Maximo de workers
+#define GRO_BUFFER  65536       ///< Buffer de cada mensagem, com UDP_GRO
+/// Maior resposta: cabecalho v2 e todos os blocos SACK
+#define RESPOSTA_MAX (sizeof(struct sdtphdr2) \
+                      + SACK_BLOCOS * sizeof(struct sackhdr2))
 /// \}
 
 /**
- * Define o calculo para geracao de um valor (nao nulo) para a janela
+ * Marca uma posicao removida da tabela (lapide), mantendo a sequencia de
+ * sondagem das chaves inseridas apos ela
+ */
+#define LAPIDE ((struct socket_sdtp *)1)
+
+/**
+ * Intervalo [ini, fim) de dados recebidos adiante de expseqnum
+ */
+struct intervalo_sdtp
+{
+    uint32_t ini;             ///< Primeiro byte do intervalo
+    uint32_t fim;             ///< Byte seguinte ao ultimo do intervalo
+};
+
+struct worker_sdtp;
+
+/**
+ * Contadores de um worker, escritos apenas por ele (ver CONTA) e lidos
+ * pela thread de estatisticas
+ *
+ * O bloco ocupa linhas de cache proprias, para que a escrita de um worker
+ * nao invalide as linhas dos demais. conexoes e semiabertas sao medidas
+ * instantaneas; os demais campos apenas crescem.
  */
-#define WINDOW() (rand() % MSS)+1
+struct estatisticas_sdtp
+{
+    _Alignas(64)
+    _Atomic unsigned long lotes;       ///< Lotes recebidos (recvmmsg)
+    _Atomic unsigned long mensagens;   ///< Mensagens recebidas
+    _Atomic unsigned long pacotes_in;  ///< Segmentos recebidos, apos o GRO
+    _Atomic unsigned long bytes_in;    ///< Bytes dos segmentos recebidos
+    _Atomic unsigned long pacotes_out; ///< Respostas enviadas
+    _Atomic unsigned long bytes_out;   ///< Bytes das respostas
+    _Atomic unsigned long envios;      ///< Chamadas de envio (sendmmsg)
+    _Atomic unsigned long truncados;   ///< Pacotes menores que o cabecalho
+                                       ///< ou que o tamanho informado
+    _Atomic unsigned long checksum_invalidos; ///< Checksum errado (real)
+    _Atomic unsigned long simulados[SDTP_ERRORS]; ///< Erros simulados, por
+                                       ///< tipo @see errors
+    _Atomic unsigned long duplicados;  ///< Segmentos ja recebidos
+    _Atomic unsigned long fora_janela; ///< Segmentos alem da janela ou do
+                                       ///< limite da conexao
+    _Atomic unsigned long dupacks;     ///< ACKs enviados sem avanco
+    _Atomic unsigned long handshakes;  ///< Conexoes estabelecidas
+    _Atomic unsigned long concluidas;  ///< FINs com dados corretos (ACK)
+    _Atomic unsigned long rsts;        ///< FINs com dados incorretos (RST)
+    _Atomic unsigned long removidas[REMOCOES]; ///< Conexoes removidas por
+                                       ///< prazo, por motivo @see remocoes
+    _Atomic unsigned long cookies_enviados;  ///< SYN-ACKs sem estado
+    _Atomic unsigned long cookies_aceitos;   ///< Conexoes criadas por cookie
+    _Atomic unsigned long cookies_invalidos; ///< Pacotes sem conexao nem
+                                             ///< cookie
+    _Atomic unsigned long conexoes;    ///< Conexoes existentes
+    _Atomic unsigned long semiabertas; ///< Conexoes em WAIT_SYN ou WAIT_ACK
+};
 
-/** 
+/**
  * Estrutura referente a um socket SDTP estabelecido
+ *
+ * Os segmentos adiantados sao gravados nos blocos em seu deslocamento e
+ * registrados em fora, vetor ordenado de intervalos disjuntos e nao
+ * adjacentes, todos apos recebidos. A soma inclui todos os bytes
+ * gravados, em ordem ou nao.
  */
 struct socket_sdtp
 {
     uint32_t ip;              ///< Ip do cliente
     uint16_t porta;           ///< Porta do cliente
-    char data[2*LOREMSIZE];   ///< Dados entregues pelo cliente
     uint8_t  state;           ///< Estado da conexao @see states
-    uint16_t expseqnum;       ///< Numero de sequencia esperado
-    uint8_t  window;          ///< Armazena o valor da janela informado
-    struct socket_sdtp *next; ///< Proximo item da lista de conexoes ativas
+    uint32_t borda;           ///< Limite direito da janela anunciada
+    uint8_t  versao;          ///< Versao do cabecalho negociada (1 ou 2)
+    uint32_t expseqnum;       ///< Numero de sequencia esperado
+    uint32_t recebidos;       ///< Bytes aceitos, em ordem
+    uint32_t soma;            ///< Soma (RFC 1071) dos bytes aceitos
+    uint32_t limite;          ///< Maximo de dados aceitos (BUFMAX ou BUFMAX2)
+    uint32_t nblocos;         ///< Tamanho do vetor de blocos
+    uint8_t  nfora;           ///< Intervalos adiantados em fora
+    uint8_t  sack;            ///< Confirmacao seletiva negociada
+    uint8_t  veredito;        ///< Resposta ao primeiro FIN (TH_ACK ou
+                              ///< TH_RST), repetida aos retransmitidos
+    int      fd;              ///< Arquivo de saida (modo de gravacao), ou -1
+    struct sincronia_sdtp *sincronia; ///< Sincronizacao pendente do
+                              ///< arquivo de saida, ou NULL
+    uint64_t marca;           ///< Instante da abertura (nome do arquivo)
+    uint64_t ultimo;          ///< Instante do ultimo pacote (ms)
+    struct worker_sdtp *worker; ///< Worker da conexao
+    struct timer_sdtp prazo;  ///< Prazo da conexao, conforme o estado
+    char   **blocos;          ///< Dados entregues pelo cliente, em blocos
+                              ///< de BLOCO bytes obtidos sob demanda
+    struct intervalo_sdtp fora[FORA_MAX]; ///< Dados recebidos fora de ordem
+};
+
+/**
+ * Pedido de sincronizacao do arquivo de saida de uma conexao, que vai do
+ * worker a uma thread de sincronizacao e volta ao worker ao terminar
+ *
+ * Apenas o worker le e altera s; a thread so usa os demais campos.
+ */
+struct sincronia_sdtp
+{
+    struct worker_sdtp *w;    ///< Worker da conexao
+    struct socket_sdtp *s;    ///< Conexao, ou NULL se ela ja foi removida
+    int fd;                   ///< Arquivo de saida
+    uint32_t tamanho;         ///< Tamanho final do arquivo
+    int resultado;            ///< 0 se o arquivo foi gravado, ou -1
+    char parcial[4096];       ///< Nome com o sufixo .parcial
+    char nome[4096];          ///< Nome final
 };
 
 /**
- * Ponteiro para o inicio da lista de conexoes (estruturas) ativas
+ * Posicao da tabela de conexoes
+ *
+ * A chave e mantida junto ao ponteiro para que a sondagem nao precise
+ * acessar o socket sdtp de cada posicao visitada.
+ */
+struct slot_sdtp
+{
+    uint64_t chave;           ///< Tupla (ip, porta) do cliente
+    struct socket_sdtp *s;    ///< Socket sdtp, NULL (livre) ou LAPIDE
+};
+
+/**
+ * Tabela hash de conexoes ativas, com enderecamento aberto e sondagem
+ * linear
+ *
+ * O redimensionamento e incremental: ao atingir o limite de ocupacao, um
+ * novo vetor e alocado e o antigo e mantido ate que todas as suas posicoes
+ * tenham sido migradas, TABELA_MIGRA posicoes a cada operacao. Enquanto
+ * isso, as buscas consultam os dois vetores.
  */
-struct socket_sdtp *head = NULL;
+struct tabela_sdtp
+{
+    struct slot_sdtp *slots;  ///< Vetor atual
+    uint32_t cap;             ///< Capacidade do vetor atual
+    uint32_t usados;          ///< Posicoes ocupadas no vetor atual
+    uint32_t lapides;         ///< Posicoes removidas no vetor atual
+    struct slot_sdtp *antiga; ///< Vetor em migracao (ou NULL)
+    uint32_t cap_antiga;      ///< Capacidade do vetor em migracao
+    uint32_t migrados;        ///< Proxima posicao a migrar do vetor antigo
+    uint32_t usados_antiga;   ///< Posicoes ainda ocupadas no vetor antigo
+    uint64_t buscas;          ///< Total de buscas realizadas
+    uint64_t sondagens;       ///< Total de posicoes visitadas nas buscas
+    uint32_t sondagem_max;    ///< Maior sondagem observada
+};
 
 /**
- * Quantidade de sockets estabelecidos
+ * Estado de um worker do servidor
+ *
+ * Cada worker possui seu proprio socket UDP (SO_REUSEPORT) ligado a PORTA,
+ * e o kernel distribui os clientes entre os sockets pela tupla de origem,
+ * de modo que um cliente e sempre atendido pelo mesmo worker. Assim, tudo
+ * o que e usado no tratamento dos pacotes pertence a um unico worker.
  */
-int numsockets = 0;
+struct worker_sdtp
+{
+    int id;                   ///< Identificador do worker
+    pthread_t thread;         ///< Thread que executa o worker
+    int meusocket;            ///< Socket UDP do worker
+    int lote;                 ///< Maximo de pacotes por lote
+    struct tabela_sdtp tabela;///< Tabela das conexoes ativas
+    struct pool_sdtp pool_sockets; ///< Pool das estruturas de controle
+    struct pool_sdtp pool_blocos;  ///< Pool dos blocos de dados
+    uint64_t gerador[4];      ///< Estado do gerador de erros e janelas
+                              ///< (xoshiro256**)
+    char global_error;        ///< Erro simulado para o pacote atual
+    int rajada;               ///< Cadeia de Gilbert-Elliott no estado ruim
+    struct pool_sdtp pool_adiadas; ///< Pool das respostas adiadas
+    int cookies;              ///< SYN cookies ativos @see cookies
+    struct estatisticas_sdtp est; ///< Contadores @see estatisticas
+    struct evloop_sdtp ev;    ///< Laco de eventos do worker
+    struct evfd_sdtp evsock;  ///< Registro do socket no laco de eventos
+    int sincronizadas[2];     ///< Pipe das sincronizacoes concluidas
+    struct evfd_sdtp evsincronia; ///< Registro do pipe no laco de eventos
+    int gro;                  ///< Recepcao agregada (UDP_GRO) ativa
+    size_t tambuf;            ///< Tamanho de cada buffer do lote
+    char *buffers;            ///< Buffers de cada posicao do lote
+    char (*controles)[CMSG_SPACE(sizeof(int))]; ///< Tamanho dos segmentos
+                                                ///< agregados (UDP_GRO)
+    struct sockaddr_in *enderecos; ///< Enderecos de cada posicao do lote
+    struct iovec *iov_in;     ///< Vetores de recepcao do lote
+    int maxrespostas;         ///< Respostas acumuladas antes do envio
+    char (*pequenos)[RESPOSTA_MAX]; ///< Copia dos segmentos agregados
+                                    ///< menores que a resposta, ou sem
+                                    ///< espaco para ela no buffer
+    struct iovec *iov_out;    ///< Vetores de envio do lote
+    struct mmsghdr *msgs_in;  ///< Mensagens recebidas no lote
+    struct mmsghdr *msgs_out; ///< Respostas a enviar no lote
+};
 
 /**
  * Armazena o checksum dos dados do arquivo lorem_ipsum.txt
@@ -111,536 +458,3264 @@ int numsockets = 0;
 uint16_t datasum = 0;
 
 /**
- * Armazena o valor do erro simulado para cada recepcao de pacote
+ * Modo de teste: anuncia janelas aleatorias (WINDOW), como na versao
+ * original, em vez do espaco livre
  */
-char global_error;
+int janela_aleatoria = 0;
 
 /**
- * Retorna o ponteiro para um socket sdtp, de acordo com a tupla 
- * (ip, porta) recebida.
- *
- * Se nao encontrar um socket sdtp para a tupla, cria um novo socket sdtp e
- * o retorna.
+ * Nome de cada motivo de remocao @see remocoes
+ */
+const char *motivos_remocao[REMOCOES] = { "handshake", "ociosa", "linger" };
+
+/**
+ * Nome de cada erro simulado @see errors
+ */
+const char *nomes_erro[SDTP_ERRORS] =
+    { "nenhum", "perda_entrada", "perda_saida", "checksum_entrada",
+      "checksum_saida", "perda_rajada", "duplicacao_saida",
+      "reordenacao_saida", "atraso_saida" };
+
+/**
+ * Arquivo das estatisticas (formato texto do Prometheus), reescrito a cada
+ * ESTAT_PERIODO, ou NULL
+ */
+char *arquivo_estat = NULL;
+
+/**
+ * Caminho do socket Unix de consulta das estatisticas, ou NULL
+ */
+char *socket_estat = NULL;
+
+/**
+ * Conexoes semiabertas, por worker, a partir das quais os SYN cookies
+ * sao usados (0 para sempre)
+ */
+int limiar_cookies = COOKIE_LIMIAR;
+
+/**
+ * Chave dos SYN cookies, sorteada no inicio do servidor
+ */
+uint8_t chave_cookie[16];
+
+/**
+ * Pede ao kernel a recepcao agregada (UDP_GRO), quando disponivel
+ */
+int usa_gro = 1;
+
+/**
+ * Diretorio dos arquivos de saida, no modo de gravacao, ou NULL
+ */
+char *dir_saida = NULL;
+
+/**
+ * Diretorio dos arquivos de saida aberto, sincronizado apos cada
+ * renomeacao, ou -1
+ */
+int fd_dir_saida = -1;
+
+/**
+ * Pipe dos pedidos de sincronizacao, dos workers para as threads de
+ * sincronizacao @see sincronia
+ */
+int sincronia[2] = { -1, -1 };
+
+/**
+ * Memoria global (bytes) para os blocos de dados de todas as conexoes
+ */
+size_t orcamento = (size_t)ORCAMENTO << 20;
+
+/**
+ * Memoria (bytes) ocupada pelos blocos de dados, somando todos os workers
+ */
+_Atomic size_t memoria_usada = 0;
+
+/**
+ * Conexoes existentes, somando todos os workers
+ */
+_Atomic int conexoes = 0;
+
+/**
+ * Configuracao da simulacao de erros @see simulacao
  *
- * \param addr Um ponteiro para os dados recebidos do cliente.
- * \return Um ponteiro para um socket sdtp.
+ * As taxas sao porcentagens; os limiares derivados delas (preenchidos por
+ * prepara_simulacao) sao comparados aos 32 bits altos de um sorteio. A
+ * configuracao e apenas lida pelos workers.
  */
-struct socket_sdtp * get_socket_sdtp(struct sockaddr_in * addr)
+struct simulacao_sdtp
 {
-    struct socket_sdtp *tmp = NULL, *last = NULL;
-    
-    tmp = head;
+    double perda_in;          ///< Perda na recepcao (%)
+    double perda_out;         ///< Perda no envio (%)
+    double soma_in;           ///< Checksum errado na recepcao (%)
+    double soma_out;          ///< Checksum errado no envio (%)
+    double ge_p;              ///< Gilbert-Elliott: do estado bom ao ruim
+                              ///< (%, por pacote)
+    double ge_r;              ///< Gilbert-Elliott: do estado ruim ao bom
+                              ///< (%, por pacote)
+    double ge_ruim;           ///< Perda no estado ruim (%)
+    double ge_bom;            ///< Perda no estado bom (%)
+    double duplica;           ///< Duplicacao das respostas (%)
+    double reordena;          ///< Reordenacao das respostas (%)
+    unsigned atraso;          ///< Atraso das respostas (ms)
+    unsigned variacao;        ///< Variacao maxima do atraso (ms)
+    unsigned reordem;         ///< Atraso extra da resposta reordenada (ms)
+    uint64_t semente;         ///< Semente dos geradores dos workers
+    int semente_fixa;         ///< Semente informada (senao, sorteada)
+    int ativa;                ///< Algum erro configurado
+    int saida;                ///< Duplicacao, atraso ou reordenacao
+    uint64_t acumulado[SDTP_ERROR_SORTEIO]; ///< Limiares acumulados dos
+                              ///< erros excludentes
+    uint64_t l_ge_p;          ///< Limiar de ge_p
+    uint64_t l_ge_r;          ///< Limiar de ge_r
+    uint64_t l_ge_ruim;       ///< Limiar de ge_ruim
+    uint64_t l_ge_bom;        ///< Limiar de ge_bom
+    uint64_t l_duplica;       ///< Limiar de duplica
+    uint64_t l_reordena;      ///< Limiar de reordena
+};
 
-    while(tmp != NULL)
-    {
-        // verificando se ja ha socket
-        if (tmp->ip == addr->sin_addr.s_addr
-                &&
-            tmp->porta == htons(addr->sin_port))
-        {
-            return tmp;
-        }
-        
-        last = tmp;
-        tmp = tmp->next;
-    }
+/**
+ * Simulacao de erros, com o perfil original; inativa ate
+ * prepara_simulacao (como no bench_sdtp e no replay_sdtp)
+ */
+struct simulacao_sdtp simulacao =
+    { .perda_in = 10, .perda_out = 5, .soma_in = 5, .soma_out = 10,
+      .ge_ruim = 100, .reordem = SIM_REORDEM };
 
-    numsockets++;
-    
-    // nao encontrou o elemento na lista, entao cria um novo
-    tmp = (struct socket_sdtp *) malloc(sizeof(struct socket_sdtp));
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
 
-    // preenchendo os campos da estrutura
-    tmp->ip        = addr->sin_addr.s_addr;
-    tmp->porta     = htons(addr->sin_port);
-    memset(tmp->data, 0x0, sizeof(tmp->data));
-    tmp->state     = SDTP_WAIT_SYN;
-    tmp->expseqnum = 0;
-    tmp->window    = 0;
-    tmp->next      = NULL;
-    
-    // ja existe elementos na lista
-    if (head != NULL)
-    {
-        last->next = tmp;
-    }
-    // nao existe elementos
-    else
+/**
+ * Semeia o gerador do worker, expandindo (splitmix64) a semente e o
+ * identificador do worker nos 256 bits do estado
+ */
+void semeia_gerador(struct worker_sdtp *w, uint64_t semente, int id)
+{
+    uint64_t x = semente ^ ((uint64_t)id * 0xd1342543de82ef95ULL);
+
+    for (int i = 0; i < 4; i++)
     {
-        head = tmp;
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        w->gerador[i] = z ^ (z >> 31);
     }
 
-    return tmp;
+    w->rajada = 0;
 }
 
 /**
- * Remove o socket SDTP ativo, liberando o seu espaco
+ * Proximo valor do gerador do worker (xoshiro256**)
+ */
+static inline uint64_t sorteio(struct worker_sdtp *w)
+{
+    uint64_t *g = w->gerador;
+    uint64_t r = ROTL(g[1] * 5, 7) * 9;
+    uint64_t t = g[1] << 17;
+
+    g[2] ^= g[0];
+    g[3] ^= g[1];
+    g[1] ^= g[2];
+    g[0] ^= g[3];
+    g[2] ^= t;
+    g[3] = ROTL(g[3], 45);
+
+    return r;
+}
+
+/**
+ * Sorteia um evento, com o limiar de prepara_simulacao
  *
- * Apos remover o socket SDTP, reorganiza a fila de conexoes ativas.
+ * \return 1 caso o evento ocorra
+ */
+static inline int sorteia_evento(struct worker_sdtp *w, uint64_t limiar)
+{
+    return limiar != 0 && (sorteio(w) >> 32) < limiar;
+}
+
+/**
+ * Monta a chave da tabela a partir da tupla (ip, porta)
+ */
+static inline uint64_t chave_sdtp(uint32_t ip, uint16_t porta)
+{
+    return ((uint64_t)ip << 16) | porta;
+}
+
+/**
+ * Espalha os bits da chave (finalizador do splitmix64), para que portas
+ * consecutivas de um mesmo ip nao formem sequencias na tabela
+ */
+static inline uint32_t hash_sdtp(uint64_t chave)
+{
+    chave ^= chave >> 30;
+    chave *= 0xbf58476d1ce4e5b9ULL;
+    chave ^= chave >> 27;
+    chave *= 0x94d049bb133111ebULL;
+    chave ^= chave >> 31;
+
+    return (uint32_t)chave;
+}
+
+/**
+ * Procura a chave em um vetor da tabela
  *
- * \param s Ponteiro para o socket que se deseja remover
+ * \param n Acumula a quantidade de posicoes visitadas
+ * \return O indice da posicao da chave, ou -1 caso nao exista
  */
-void remove_socket_sdtp(struct socket_sdtp *s)
+static long sonda_tabela(struct slot_sdtp *slots, uint32_t cap,
+        uint64_t chave, uint32_t *n)
 {
-    struct socket_sdtp *tmp = NULL, *last = NULL;
+    uint32_t mask = cap - 1;
+    uint32_t i = hash_sdtp(chave) & mask;
 
-    // primeiro elemento da lista
-    if (s == head)
+    (*n)++;
+
+    while (slots[i].s != NULL)
     {
-        head = s->next;
-        free(s);
-        numsockets--;
+        if (slots[i].s != LAPIDE && slots[i].chave == chave)
+            break;
+
+        i = (i + 1) & mask;
+        (*n)++;
     }
-    else
+
+    return slots[i].s != NULL ? (long)i : -1;
+}
+
+/**
+ * Insere no vetor atual, sem verificar a ocupacao, reaproveitando a
+ * primeira posicao livre ou removida
+ */
+static void coloca_tabela(struct tabela_sdtp *t, uint64_t chave,
+        struct socket_sdtp *s)
+{
+    uint32_t mask = t->cap - 1;
+    uint32_t i = hash_sdtp(chave) & mask;
+
+    while (t->slots[i].s != NULL && t->slots[i].s != LAPIDE)
+        i = (i + 1) & mask;
+
+    if (t->slots[i].s == LAPIDE)
+        t->lapides--;
+
+    t->slots[i].chave = chave;
+    t->slots[i].s = s;
+    t->usados++;
+}
+
+/**
+ * Migra algumas posicoes do vetor antigo para o atual, liberando o vetor
+ * antigo quando a migracao termina
+ */
+static void migra_tabela(struct tabela_sdtp *t)
+{
+    int n = TABELA_MIGRA;
+
+    while (t->antiga != NULL && n--)
     {
-        tmp = head->next;
-        last = head;
+        struct slot_sdtp *slot = &t->antiga[t->migrados++];
 
-        while(tmp != NULL)
+        if (slot->s != NULL && slot->s != LAPIDE)
         {
-            if (tmp == s)
-            {
-                last->next = tmp->next;
-                free(s);
-                numsockets--;
-                break;
-            }
-            
-            last = tmp;
-            tmp = tmp->next;
+            coloca_tabela(t, slot->chave, slot->s);
+            slot->s = LAPIDE;
+            t->usados_antiga--;
+        }
+
+        if (t->migrados == t->cap_antiga)
+        {
+            free(t->antiga);
+            t->antiga = NULL;
+            t->cap_antiga = 0;
+            t->migrados = 0;
         }
     }
 }
 
 /**
- * Imprime a lista de conexoes (sockets) ativas
+ * Inicia o redimensionamento, quando a ocupacao (incluindo lapides) passa
+ * de TABELA_CARGA
+ *
+ * Se a maior parte da ocupacao for de lapides, o novo vetor mantem a
+ * capacidade atual, servindo apenas para limpa-las. Se faltar memoria para
+ * o novo vetor, a tabela continua com o atual e o redimensionamento e
+ * tentado novamente na proxima insercao.
+ *
+ * \return 0 em caso de sucesso (ou se nao for preciso redimensionar), ou -1
+ * se faltar memoria
  */
-void print_socket_list()
+static int cresce_tabela(struct tabela_sdtp *t)
 {
-    struct socket_sdtp *tmp = head;
-    
-    printf("DEBUG - SOCKET LIST\n");
+    struct slot_sdtp *slots;
+    uint32_t cap = t->cap;
 
-    while(tmp != NULL)
+    if (t->antiga != NULL
+            ||
+        (uint64_t)(t->usados + t->lapides + 1) * 100
+            <= (uint64_t)cap * TABELA_CARGA)
     {
-        printf("%x %d\n",tmp->ip,tmp->porta);
-        tmp = tmp->next;
+        return 0;
     }
+
+    if (t->usados * 4 >= cap)
+        cap *= 2;
+
+    slots = (struct slot_sdtp *) calloc(cap, sizeof(struct slot_sdtp));
+
+    if (slots == NULL)
+        return -1;
+
+    t->antiga = t->slots;
+    t->cap_antiga = t->cap;
+    t->usados_antiga = t->usados;
+    t->migrados = 0;
+
+    t->slots = slots;
+    t->cap = cap;
+    t->usados = 0;
+    t->lapides = 0;
+
+    return 0;
 }
 
 /**
- * Gerador de um erro aleatorio, para cada pacote recebido
- *
- * O erro sera gerado conforme as probabilidades definidas para os Possiveis
- * Erros Simulados.
- *
- * Gera um erro simulado com as seguintes probabilidades (%)
- * - SDTP_ERROR_NONE (0x00):     70  
- * - SDTP_ERROR_LOST_IN (0x01):  10  
- * - SDTP_ERROR_LOST_OUT (0x02): 05  
- * - SDTP_ERROR_SUM_IN (0x03):   05  
- * - SDTP_ERROR_SUM_OUT (0x04):  10  
- *
- * Exemplo da estrategia de geracao do erro, retornando o indice do vetor de
- * probabilidades, conforme seja encontrado o valor gerado:
+ * Inicializa a tabela de conexoes
  *
- \verbatim
-    0                        70        80      85      90       99
-    [------------------------[---------[-------[-------[---------]
-                NONE           LOSTin   LOSTout  SUMin   SUMout
- \endverbatim
- *
- * \see errors
- *
- * \todo: Definir os valores das probabilidades de acordo com a realidade
- *
- * \return Um erro a ser simulado.
+ * \return 0 em caso de sucesso, ou -1 se faltar memoria
  */
-char simerror()
+int init_tabela(struct tabela_sdtp *t)
 {
-    // 0                        70        80      85      90       99
-    // [------------------------[---------[-------[-------[---------]
-    //             NONE           LOSTin   LOSTout  SUMin   SUMout
-    
-    // definindo as probabilidades, 
-    // onde prob[i] = probabilidade do evento i definido
-    int prob[5] = {70, 10, 5, 5, 10};
-    
-    // gerando um resultado aleatoriamente
-    int r = rand() % 100;
+    memset(t, 0x0, sizeof(struct tabela_sdtp));
 
-    printf("RAND GERADO: %d\n",r);
+    t->slots = (struct slot_sdtp *) calloc(TABELA_INICIAL,
+            sizeof(struct slot_sdtp));
 
-    char i = 0;
-    int sum = prob[i];
+    if (t->slots == NULL)
+        return -1;
 
-    // encontrando qual evento ocorreu, com base em suas probabilidades
-    while (r >= sum)
-    {
-        sum += prob[++i];
-    }
+    t->cap = TABELA_INICIAL;
 
-    // retorna o indice equivalente ao evento
-    return i;
+    return 0;
 }
 
 /**
- * Corrompe alguns bytes de buf, entre os bytes 0 e len passado
+ * Busca o socket sdtp da tupla (ip, porta) na tabela
  *
- * \param buf Ponteiro para a posicao inicial do buffer a ser corrompido
- * \param len Tamanho em bytes do buffer a ser corrompido
+ * \return Um ponteiro para o socket sdtp, ou NULL caso nao exista
  */
-void corrupt(char *buf, int len)
+struct socket_sdtp * busca_tabela(struct tabela_sdtp *t, uint32_t ip,
+        uint16_t porta)
 {
-    int i = 5;
+    uint64_t chave = chave_sdtp(ip, porta);
+    struct socket_sdtp *s = NULL;
+    uint32_t n = 0;
+    long i;
 
-    while(i--)
+    migra_tabela(t);
+
+    if ((i = sonda_tabela(t->slots, t->cap, chave, &n)) >= 0)
+    {
+        s = t->slots[i].s;
+    }
+    else if (t->antiga != NULL
+            &&
+        (i = sonda_tabela(t->antiga, t->cap_antiga, chave, &n)) >= 0)
     {
-        buf[rand()%len] = rand() % 256;
+        s = t->antiga[i].s;
     }
+
+    t->buscas++;
+    t->sondagens += n;
+    if (n > t->sondagem_max)
+        t->sondagem_max = n;
+
+    return s;
 }
 
 /**
- * Funcao responsavel por fazer o tratamento no pacote recebido.
+ * Insere um socket sdtp na tabela, que nao deve conter a sua tupla
  *
- * \return 1 quando for necessario reponder um pacote ao cliente, que sera
- * realizado no `main()`
- * \return 0 quando nao for necessario resposta, seja por causa de um erro
- * real ou simulado
- * 
+ * Sem memoria para redimensionar, a insercao ainda usa o vetor atual, desde
+ * que reste nele ao menos uma posicao vazia para encerrar as sondagens.
+ *
+ * \return 0 em caso de sucesso, ou -1 se a tabela estiver cheia
  */
-int handle_socket_sdtp(struct socket_sdtp *s, struct sdtphdr *p)
-{ 
-    // se for um pacote de sincronizacao esperado do 3-way handshake
-    if ( p->flags == TH_SYN )
-    {
-        if ( s->state == SDTP_WAIT_SYN )
-        {
-            // muda o estado para wait ack
-            s->state = SDTP_WAIT_ACK;
-        }
+int insere_tabela(struct tabela_sdtp *t, struct socket_sdtp *s)
+{
+    migra_tabela(t);
 
-        // responde com syn/ack
-        p->seqnum   = 0;
-        p->acknum   = 0;
-        p->flags    = TH_SYN|TH_ACK;
-        s->window   = WINDOW(); // define o valor da janela
-        p->window   = s->window;
-        p->checksum = 0;
-        p->checksum = checksum((void *)p, sizeof(struct sdtphdr));
+    if (cresce_tabela(t) < 0 && t->usados + t->lapides + 2 > t->cap)
+        return -1;
 
-        // habilita devolucao do pacote
+    coloca_tabela(t, chave_sdtp(s->ip, s->porta), s);
+
+    return 0;
+}
+
+/**
+ * Remove um socket sdtp da tabela, deixando uma lapide em sua posicao
+ *
+ * \return 1 caso o socket tenha sido encontrado e removido, 0 caso contrario
+ */
+int remove_tabela(struct tabela_sdtp *t, struct socket_sdtp *s)
+{
+    uint64_t chave = chave_sdtp(s->ip, s->porta);
+    uint32_t n = 0;
+    long i;
+
+    if ((i = sonda_tabela(t->slots, t->cap, chave, &n)) >= 0)
+    {
+        t->slots[i].s = LAPIDE;
+        t->usados--;
+        t->lapides++;
         return 1;
     }
-    // se for o ack do 3-way handshake esperado
-    else if ( p->flags == TH_ACK )
+
+    if (t->antiga != NULL
+            &&
+        (i = sonda_tabela(t->antiga, t->cap_antiga, chave, &n)) >= 0)
+    {
+        // posicoes do vetor antigo nao sao reaproveitadas
+        t->antiga[i].s = LAPIDE;
+        t->usados_antiga--;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Inicia o estado de transferencia de um socket sdtp, sem blocos de dados
+ * nem arquivo de saida, aguardando o SYN
+ */
+void inicia_socket_sdtp(struct socket_sdtp *s)
+{
+    s->state     = SDTP_WAIT_SYN;
+    s->borda     = 0;
+    s->versao    = 1;
+    s->limite    = BUFMAX;
+    s->expseqnum = 0;
+    s->recebidos = 0;
+    s->soma      = 0;
+    s->nfora     = 0;
+    s->sack      = 0;
+    s->veredito  = 0;
+    s->sincronia = NULL;
+}
+
+/**
+ * Desvincula a conexao da sua sincronizacao pendente, que termina sem
+ * responder ao cliente
+ */
+void solta_sincronia(struct socket_sdtp *s)
+{
+    if (s->sincronia != NULL)
+    {
+        s->sincronia->s = NULL;
+        s->sincronia = NULL;
+    }
+}
+
+/**
+ * Retorna o ponteiro para um socket sdtp, de acordo com a tupla
+ * (ip, porta) recebida.
+ *
+ * Se nao encontrar um socket sdtp para a tupla, cria um novo socket sdtp e
+ * o retorna.
+ *
+ * \param w O worker que recebeu o pacote.
+ * \param addr Um ponteiro para os dados recebidos do cliente.
+ * \return Um ponteiro para um socket sdtp.
+ */
+struct socket_sdtp * get_socket_sdtp(struct worker_sdtp *w,
+        struct sockaddr_in * addr)
+{
+    struct socket_sdtp *tmp = NULL;
+
+    // verificando se ja ha socket
+    tmp = busca_tabela(&w->tabela, addr->sin_addr.s_addr,
+            htons(addr->sin_port));
+
+    if (tmp != NULL)
+    {
+        return tmp;
+    }
+
+    // nao encontrou o elemento na tabela, entao cria um novo
+    tmp = (struct socket_sdtp *) pool_get(&w->pool_sockets);
+
+    if (tmp == NULL)
+    {
+        return NULL;
+    }
+
+    tmp->ip        = addr->sin_addr.s_addr;
+    tmp->porta     = htons(addr->sin_port);
+
+    if (insere_tabela(&w->tabela, tmp) < 0)
+    {
+        pool_put(&w->pool_sockets, tmp);
+        return NULL;
+    }
+
+    CONTA(w->est.conexoes, 1);
+    CONTA(w->est.semiabertas, 1);
+    atomic_fetch_add(&conexoes, 1);
+
+    // preenchendo os campos da estrutura
+    // os blocos de dados so serao obtidos quando os dados chegarem
+    tmp->nblocos   = 0;
+    tmp->blocos    = NULL;
+    tmp->fd        = -1;
+    tmp->worker    = w;
+    inicia_socket_sdtp(tmp);
+
+    // a funcao do prazo e definida ao arma-lo (ver arma_prazo)
+    timer_init(&tmp->prazo, NULL, tmp);
+
+    return tmp;
+}
+
+/**
+ * Monta o nome do arquivo de saida da conexao: ip-porta-marca, com o
+ * sufixo .parcial ate a confirmacao dos dados no FIN
+ */
+static void nome_saida(struct socket_sdtp *s, char *nome, size_t len,
+        int parcial)
+{
+    unsigned char *ip = (unsigned char *)&s->ip;
+
+    snprintf(nome, len, "%s/%u.%u.%u.%u-%u-%lu%s", dir_saida,
+            ip[0], ip[1], ip[2], ip[3], s->porta, (unsigned long)s->marca,
+            parcial ? ".parcial" : "");
+}
+
+/**
+ * Abre (criando) o arquivo de saida da conexao, no modo de gravacao
+ *
+ * \return 0 em caso de sucesso, -1 em caso de erro
+ */
+int abre_saida(struct socket_sdtp *s)
+{
+    char nome[4096];
+
+    s->marca = agora_us();
+    nome_saida(s, nome, sizeof(nome), 1);
+
+    if ((s->fd = open(nome, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0)
+    {
+        LOG(NIVEL_ERRO, "open %s: %s", nome, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Grava os dados recebidos no arquivo de saida da conexao, a partir do
+ * deslocamento informado
+ *
+ * Os segmentos vao direto do buffer de recepcao para o arquivo (pwrite),
+ * em ordem ou nao, de modo que a memoria usada por conexao nao depende do
+ * tamanho do envio.
+ *
+ * \return 0 em caso de sucesso, -1 em caso de erro
+ */
+int grava_saida(struct socket_sdtp *s, uint32_t offset, const char *buf,
+        uint32_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(s->fd, buf, len, offset);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            LOG(NIVEL_ERRO, "%x:%d pwrite: %s", s->ip, s->porta,
+                    strerror(errno));
+            return -1;
+        }
+
+        buf    += n;
+        offset += n;
+        len    -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Trunca o arquivo de saida no tamanho final, sincroniza-o com o disco
+ * (fdatasync), renomeia-o sem o sufixo .parcial e sincroniza o diretorio,
+ * para que o novo nome tambem sobreviva a uma queda
+ *
+ * Em caso de erro, o arquivo e removido. Em ambos os casos, e fechado.
+ *
+ * \param p O pedido de sincronizacao, com o resultado preenchido ao final
+ */
+void sincroniza_saida(struct sincronia_sdtp *p)
+{
+    p->resultado = 0;
+
+    if (ftruncate(p->fd, p->tamanho) < 0
+            ||
+        fdatasync(p->fd) < 0
+            ||
+        rename(p->parcial, p->nome) < 0)
+    {
+        LOG(NIVEL_ERRO, "gravando %s: %s", p->nome, strerror(errno));
+        unlink(p->parcial);
+        p->resultado = -1;
+    }
+    else if (fsync(fd_dir_saida) < 0)
+    {
+        LOG(NIVEL_ERRO, "sincronizando %s: %s", dir_saida, strerror(errno));
+        unlink(p->nome);
+        p->resultado = -1;
+    }
+    else
+    {
+        LOG(NIVEL_INFO, "gravado em %s", p->nome);
+    }
+
+    close(p->fd);
+}
+
+/**
+ * Thread de sincronizacao: atende os pedidos dos workers e devolve cada
+ * um, concluido, ao pipe do seu worker
+ */
+void *executa_sincronia(void *arg)
+{
+    struct sincronia_sdtp *p;
+    ssize_t n;
+
+    (void)arg;
+
+    for (;;)
+    {
+        n = read(sincronia[0], &p, sizeof(p));
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n != sizeof(p))
+            break;
+
+        sincroniza_saida(p);
+
+        while (write(p->w->sincronizadas[1], &p, sizeof(p)) < 0
+                && errno == EINTR)
+            ;
+    }
+
+    LOG(NIVEL_ERRO, "Servidor: sincronizacao: %s", strerror(errno));
+
+    return NULL;
+}
+
+/**
+ * Encerra o arquivo de saida no FIN
+ *
+ * Com os dados corretos, o arquivo e gravado por sincroniza_saida, e o
+ * ACK do FIN so sai depois disso. Como a sincronizacao pode levar dezenas
+ * de milissegundos, ela fica com uma thread de sincronizacao, e o worker
+ * so envia a resposta quando o pedido volta (ver conclui_sincronia); sem
+ * espaco no pipe dos pedidos, o proprio worker sincroniza. Com os dados
+ * incorretos, o arquivo e removido.
+ *
+ * \return 1 se a sincronizacao ficou pendente, 0 se o arquivo foi
+ * encerrado, ou -1 se os dados nao puderam ser gravados
+ */
+int fecha_saida(struct socket_sdtp *s, int corretos)
+{
+    struct sincronia_sdtp *p = NULL;
+    int ret = 0;
+
+    if (corretos && (p = malloc(sizeof(struct sincronia_sdtp))) == NULL)
+    {
+        LOG(NIVEL_ERRO, "%x:%d sincronizando: %s", s->ip, s->porta,
+                strerror(errno));
+        ret = -1;
+    }
+
+    if (p == NULL)
+    {
+        char parcial[4096];
+
+        nome_saida(s, parcial, sizeof(parcial), 1);
+        unlink(parcial);
+        close(s->fd);
+        s->fd = -1;
+
+        return ret;
+    }
+
+    p->w       = s->worker;
+    p->s       = s;
+    p->fd      = s->fd;
+    p->tamanho = s->recebidos;
+    nome_saida(s, p->parcial, sizeof(p->parcial), 1);
+    nome_saida(s, p->nome, sizeof(p->nome), 0);
+
+    // o arquivo passa ao pedido
+    s->fd = -1;
+
+    if (write(sincronia[1], &p, sizeof(p)) == sizeof(p))
+    {
+        s->sincronia = p;
+        return 1;
+    }
+
+    sincroniza_saida(p);
+    ret = p->resultado;
+    free(p);
+
+    return ret;
+}
+
+/**
+ * Devolve ao pool os blocos de dados da conexao
+ *
+ * \param w O worker da conexao
+ * \param s Ponteiro para o socket sdtp
+ */
+void libera_dados(struct worker_sdtp *w, struct socket_sdtp *s)
+{
+    int i;
+
+    for (i = 0; i < s->nblocos; i++)
+    {
+        if (s->blocos[i] != NULL)
+        {
+            pool_put(&w->pool_blocos, s->blocos[i]);
+            atomic_fetch_sub(&memoria_usada, BLOCO);
+        }
+    }
+
+    free(s->blocos);
+    s->blocos  = NULL;
+    s->nblocos = 0;
+    s->nfora   = 0;
+
+    // uma conexao encerrada sem FIN nao deixa arquivo incompleto
+    if (s->fd >= 0)
+        fecha_saida(s, 0);
+}
+
+/**
+ * Copia os dados recebidos para o buffer da conexao, a partir do
+ * deslocamento informado, obtendo do pool os blocos ainda nao alocados
+ *
+ * \param w O worker da conexao
+ * \param s Ponteiro para o socket sdtp
+ * \param offset Deslocamento dos dados no buffer da conexao
+ * \param buf Dados a copiar
+ * \param len Quantidade de bytes a copiar
+ *
+ * \return 0 em caso de sucesso, -1 se faltar memoria, ou se a memoria
+ * global se esgotar
+ */
+int escreve_dados(struct worker_sdtp *w, struct socket_sdtp *s, int offset,
+        const char *buf, int len)
+{
+    int ultimo = (offset + len - 1) / BLOCO;
+
+    if (len <= 0)
+        return 0;
+
+    // aumenta o vetor de blocos, dobrando seu tamanho
+    if (ultimo >= s->nblocos)
+    {
+        int n = s->nblocos ? s->nblocos : 1;
+        char **blocos;
+
+        while (n <= ultimo)
+            n *= 2;
+
+        blocos = (char **) realloc(s->blocos, n * sizeof(char *));
+
+        if (blocos == NULL)
+            return -1;
+
+        memset(blocos + s->nblocos, 0x0, (n - s->nblocos) * sizeof(char *));
+        s->blocos  = blocos;
+        s->nblocos = n;
+    }
+
+    while (len > 0)
+    {
+        int i = offset / BLOCO;
+        int desl = offset % BLOCO;
+        int n = BLOCO - desl < len ? BLOCO - desl : len;
+
+        if (s->blocos[i] == NULL)
+        {
+            // respeita a memoria global, reservando o bloco antes
+            if (atomic_fetch_add(&memoria_usada, BLOCO) + BLOCO > orcamento
+                    ||
+                (s->blocos[i] = (char *) pool_get(&w->pool_blocos)) == NULL)
+            {
+                atomic_fetch_sub(&memoria_usada, BLOCO);
+                return -1;
+            }
+        }
+
+        memcpy(s->blocos[i] + desl, buf, n);
+
+        buf    += n;
+        offset += n;
+        len    -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Calcula a janela a anunciar, atualizando o limite direito da janela da
+ * conexao
+ *
+ * A janela e o menor valor entre o espaco livre no buffer da conexao e a
+ * parte da conexao na memoria global livre (dividida igualmente entre as
+ * conexoes), somada ao restante do bloco ja obtido para expseqnum. Como o
+ * limite direito ja anunciado nao recua (RFC 1122), a memoria apertada
+ * apenas deixa de abrir a janela; os dados que ainda assim nao couberem
+ * sao descartados por escreve_dados e retransmitidos.
+ *
+ * No modo de teste (-r), a janela e aleatoria, como na versao original.
+ * No modo de gravacao (-o), os dados nao ocupam memoria, e a janela e o
+ * espaco livre limitado a JANELA_SAIDA.
+ *
+ * \param w O worker da conexao
+ * \param s Ponteiro para o socket sdtp
+ *
+ * \return A janela a anunciar
+ */
+uint32_t janela_sdtp(struct worker_sdtp *w, struct socket_sdtp *s)
+{
+    size_t usada = atomic_load(&memoria_usada);
+    int n = atomic_load(&conexoes);
+    uint32_t janela, parte;
+
+    if (janela_aleatoria)
+    {
+        s->borda = s->expseqnum + WINDOW(w);
+        return s->borda - s->expseqnum;
+    }
+
+    // espaco livre no buffer da conexao
+    janela = s->limite - 1 - s->expseqnum;
+
+    // parte da memoria global, alem do bloco atual
+    if (s->fd >= 0)
+        parte = JANELA_SAIDA;
+    else if (usada < orcamento)
+        parte = (uint32_t)((orcamento - usada) / (n > 0 ? n : 1));
+    else
+        parte = 0;
+
+    if (s->fd < 0 && s->expseqnum % BLOCO && s->expseqnum / BLOCO < s->nblocos
+            &&
+        s->blocos[s->expseqnum / BLOCO] != NULL)
+    {
+        parte += BLOCO - s->expseqnum % BLOCO;
+    }
+
+    if (janela > parte)
+        janela = parte;
+
+    if (s->versao != SDTP_V2 && janela > JANELAMAX)
+        janela = JANELAMAX;
+
+    if (s->expseqnum + janela > s->borda)
+        s->borda = s->expseqnum + janela;
+
+    return s->borda - s->expseqnum;
+}
+
+/**
+ * Armazena um segmento de dados, em ordem ou adiantado, no buffer da
+ * conexao
+ *
+ * Somente os trechos ainda nao recebidos entram na soma, de modo que
+ * retransmissoes e sobreposicoes nao a alterem. Se o segmento preencher a
+ * lacuna em recebidos, a sequencia esperada avanca de uma vez sobre todos
+ * os intervalos adiantados que se tornaram contiguos.
+ *
+ * \param w O worker da conexao
+ * \param s Ponteiro para o socket sdtp
+ * \param ini Deslocamento do segmento no buffer da conexao
+ * \param buf Dados do segmento
+ * \param len Tamanho do segmento
+ *
+ * \return 0 em caso de sucesso, -1 se faltar memoria ou posicao em fora
+ */
+int armazena_segmento(struct worker_sdtp *w, struct socket_sdtp *s,
+        uint32_t ini, const char *buf, uint32_t len)
+{
+    uint32_t fim = ini + len;
+    uint32_t c = ini > s->recebidos ? ini : s->recebidos;
+    int i, j;
+
+    // um segmento vazio nao traz dados, e adiantado criaria um intervalo
+    // vazio em fora, ocupando uma posicao e gerando um bloco SACK vazio
+    if (len == 0)
+        return 0;
+
+    // primeiro e ultimo (exclusivo) intervalos que tocam o segmento
+    for (i = 0; i < s->nfora && s->fora[i].fim < ini; i++)
+        ;
+    for (j = i; j < s->nfora && s->fora[j].ini <= fim; j++)
+        ;
+
+    // um segmento adiantado isolado ocupa uma nova posicao
+    if (ini > s->recebidos && i == j && s->nfora == FORA_MAX)
+        return -1;
+
+    // regravar trechos ja recebidos nao os altera
+    if (s->fd >= 0)
+    {
+        if (grava_saida(s, ini, buf, len) != 0)
+            return -1;
+    }
+    else if (escreve_dados(w, s, ini, buf, len) != 0)
+    {
+        return -1;
+    }
+
+    // soma apenas as lacunas entre os intervalos ja recebidos
+    for (; i <= j && c < fim; i++)
+    {
+        uint32_t lim = i < j && s->fora[i].ini < fim ? s->fora[i].ini : fim;
+
+        if (c < lim)
+        {
+            s->soma = checksum_combina(s->soma,
+                    checksum_parcial(buf + (c - ini), lim - c, 0), c);
+        }
+
+        if (i < j && s->fora[i].fim > c)
+            c = s->fora[i].fim;
+    }
+
+    if (ini <= s->recebidos)
+    {
+        // em ordem: avanca sobre os intervalos que ficaram contiguos
+        if (fim > s->recebidos)
+            s->recebidos = fim;
+
+        for (i = 0; i < s->nfora && s->fora[i].ini <= s->recebidos; i++)
+        {
+            if (s->fora[i].fim > s->recebidos)
+                s->recebidos = s->fora[i].fim;
+        }
+
+        s->nfora -= i;
+        memmove(s->fora, s->fora + i,
+                s->nfora * sizeof(struct intervalo_sdtp));
+    }
+    else
+    {
+        // adiantado: funde com os intervalos [i, j) que toca
+        for (i = 0; i < s->nfora && s->fora[i].fim < ini; i++)
+            ;
+
+        if (i == j)
+        {
+            memmove(s->fora + i + 1, s->fora + i,
+                    (s->nfora - i) * sizeof(struct intervalo_sdtp));
+            s->nfora++;
+        }
+        else
+        {
+            if (s->fora[i].ini < ini)
+                ini = s->fora[i].ini;
+            if (s->fora[j - 1].fim > fim)
+                fim = s->fora[j - 1].fim;
+
+            memmove(s->fora + i + 1, s->fora + j,
+                    (s->nfora - j) * sizeof(struct intervalo_sdtp));
+            s->nfora -= j - i - 1;
+        }
+
+        s->fora[i].ini = ini;
+        s->fora[i].fim = fim;
+
+        LOG(NIVEL_DEBUG, "%x:%d segmento adiantado [%u, %u), %d intervalos",
+                s->ip, s->porta, ini, fim, s->nfora);
+    }
+
+    s->expseqnum = s->recebidos;
+
+    return 0;
+}
+
+/**
+ * Remove o socket SDTP ativo, liberando o seu espaco
+ *
+ * A estrutura e os blocos de dados voltam aos seus pools.
+ *
+ * \param w O worker da conexao
+ * \param s Ponteiro para o socket que se deseja remover
+ */
+void remove_socket_sdtp(struct worker_sdtp *w, struct socket_sdtp *s)
+{
+    if (remove_tabela(&w->tabela, s))
+    {
+        if (SEMIABERTA(s->state))
+            CONTA(w->est.semiabertas, -1);
+
+        timer_desarma(&w->ev, &s->prazo);
+        solta_sincronia(s);
+        libera_dados(w, s);
+        pool_put(&w->pool_sockets, s);
+        CONTA(w->est.conexoes, -1);
+        atomic_fetch_sub(&conexoes, 1);
+    }
+}
+
+/**
+ * Expiracao do prazo de uma conexao, que e removida
+ *
+ * Os prazos de ociosidade e de permanencia em CLOSED contam a partir do
+ * ultimo pacote: o temporizador nao e rearmado a cada pacote, e, se
+ * houve pacotes desde que foi armado, apenas volta a roda pelo restante.
+ */
+void expira_socket_sdtp(struct timer_sdtp *t)
+{
+    struct socket_sdtp *s = (struct socket_sdtp *)t->arg;
+    struct worker_sdtp *w = s->worker;
+    uint64_t prazo = 0;
+    int motivo;
+
+    switch (s->state)
+    {
+        case SDTP_ESTABLISHED:
+            motivo = REMOCAO_OCIOSA;
+            prazo  = PRAZO_OCIOSO;
+            break;
+        case SDTP_CLOSED:
+            motivo = REMOCAO_LINGER;
+            prazo  = PRAZO_LINGER;
+            break;
+        default:
+            motivo = REMOCAO_HANDSHAKE;
+            break;
+    }
+
+    // a permanencia em CLOSED so conta apos a resposta ao FIN, que espera
+    // a sincronizacao do arquivo de saida
+    if (s->sincronia != NULL)
+    {
+        timer_arma(&w->ev, t, prazo);
+        return;
+    }
+
+    if (prazo && w->ev.agora - s->ultimo < prazo)
+    {
+        timer_arma(&w->ev, t, prazo - (w->ev.agora - s->ultimo));
+        return;
+    }
+
+    CONTA(w->est.removidas[motivo], 1);
+
+    LOG(motivo == REMOCAO_LINGER ? NIVEL_DEBUG : NIVEL_INFO,
+            "%x:%d removida por prazo (%s), %lu por este motivo",
+            s->ip, s->porta, motivos_remocao[motivo],
+            LE(w->est.removidas[motivo]));
+
+    remove_socket_sdtp(w, s);
+}
+
+/**
+ * Registra a atividade da conexao e, se o estado mudou, arma o prazo do
+ * novo estado
+ *
+ * O prazo do handshake conta desde o primeiro pacote, e nao e estendido
+ * por SYNs retransmitidos.
+ *
+ * \param w O worker da conexao
+ * \param s Ponteiro para o socket sdtp
+ * \param estado Estado da conexao antes do pacote
+ */
+void arma_prazo(struct worker_sdtp *w, struct socket_sdtp *s, int estado)
+{
+    uint64_t prazo;
+
+    s->ultimo = w->ev.agora;
+
+    if (timer_armado(&s->prazo) && s->state == estado)
+        return;
+
+    switch (s->state)
+    {
+        case SDTP_ESTABLISHED:
+            prazo = PRAZO_OCIOSO;
+            break;
+        case SDTP_CLOSED:
+            prazo = PRAZO_LINGER;
+            break;
+        default:
+            // o handshake segue com o prazo ja armado
+            if (timer_armado(&s->prazo) && estado != SDTP_CLOSED)
+                return;
+
+            prazo = PRAZO_HANDSHAKE;
+            break;
+    }
+
+    s->prazo.cb = expira_socket_sdtp;
+    timer_arma(&w->ev, &s->prazo, prazo);
+}
+
+/**
+ * Imprime a lista de conexoes (sockets) ativas do worker
+ */
+void print_socket_list(struct worker_sdtp *w)
+{
+    struct slot_sdtp *vetores[2] = { w->tabela.slots, w->tabela.antiga };
+    uint32_t caps[2] = { w->tabela.cap, w->tabela.cap_antiga };
+    uint32_t i;
+    int v;
+
+    LOG(NIVEL_DEBUG, "SOCKET LIST (worker %d)", w->id);
+
+    for (v = 0; v < 2; v++)
+    {
+        for (i = 0; vetores[v] != NULL && i < caps[v]; i++)
+        {
+            struct socket_sdtp *tmp = vetores[v][i].s;
+
+            if (tmp != NULL && tmp != LAPIDE)
+                LOG(NIVEL_DEBUG, "%x %d",tmp->ip,tmp->porta);
+        }
+    }
+}
+
+/**
+ * Imprime as estatisticas da tabela de conexoes: fator de carga,
+ * sondagem media por busca e maior sondagem observada
+ */
+void print_tabela_stats(struct worker_sdtp *w)
+{
+    struct tabela_sdtp *t = &w->tabela;
+    uint32_t cap = t->cap + t->cap_antiga;
+
+    LOG(NIVEL_DEBUG, "TABELA (worker %d): carga %.2f (%d/%d, %d lapides)"
+           " sondagem media %.2f max %d%s",
+            w->id, (double)LE(w->est.conexoes) / t->cap,
+            (int)LE(w->est.conexoes), cap, t->lapides,
+            t->buscas ? (double)t->sondagens / t->buscas : 0.0,
+            t->sondagem_max,
+            t->antiga != NULL ? " (redimensionando)" : "");
+}
+
+/**
+ * Gerador de um erro aleatorio, para cada pacote recebido
+ *
+ * Primeiro, com a perda em rajada configurada, a cadeia de
+ * Gilbert-Elliott do worker muda (ou nao) de estado, e a perda e sorteada
+ * com a taxa do estado atual. Em seguida, um unico sorteio escolhe entre
+ * os erros excludentes, conforme as suas probabilidades. No perfil
+ * original (%):
+ * - SDTP_ERROR_NONE (0x00):     70
+ * - SDTP_ERROR_LOST_IN (0x01):  10
+ * - SDTP_ERROR_LOST_OUT (0x02): 05
+ * - SDTP_ERROR_SUM_IN (0x03):   05
+ * - SDTP_ERROR_SUM_OUT (0x04):  10
+ *
+ * Exemplo da estrategia de geracao do erro, retornando o primeiro erro
+ * cujo limiar acumulado supera o valor gerado (com os 32 bits altos do
+ * sorteio, em porcentagem):
+ *
+ \verbatim
+    0         10      15      20        30                       99
+    [---------[-------[-------[---------[------------------------]
+      LOSTin   LOSTout  SUMin   SUMout              NONE
+ \endverbatim
+ *
+ * \see errors
+ * \see simulacao
+ *
+ * \param w O worker, cujo gerador sera usado
+ * \return Um erro a ser simulado.
+ */
+char simerror(struct worker_sdtp *w)
+{
+    const struct simulacao_sdtp *sim = &simulacao;
+    uint64_t r;
+    char i;
+
+    // perda em rajada: a cadeia muda de estado, e a perda segue o estado
+    if (sim->l_ge_p)
+    {
+        if (sorteia_evento(w, w->rajada ? sim->l_ge_r : sim->l_ge_p))
+            w->rajada = !w->rajada;
+
+        if (sorteia_evento(w, w->rajada ? sim->l_ge_ruim : sim->l_ge_bom))
+            return SDTP_ERROR_BURST;
+    }
+
+    if (sim->acumulado[SDTP_ERROR_SORTEIO - 1] == 0)
+        return SDTP_ERROR_NONE;
+
+    // um unico sorteio para os erros excludentes
+    r = sorteio(w) >> 32;
+
+    for (i = SDTP_ERROR_LOST_IN; i < SDTP_ERROR_SORTEIO; i++)
+    {
+        if (r < sim->acumulado[(int)i])
+            return i;
+    }
+
+    return SDTP_ERROR_NONE;
+}
+
+/**
+ * Corrompe alguns bytes de buf, entre os bytes 0 e len passado
+ *
+ * Cada byte sorteado e alterado (ou exclusivo com um valor nao nulo), e
+ * nao apenas sobrescrito, que poderia manter o seu valor.
+ *
+ * \param w O worker, cujo gerador sera usado
+ * \param buf Ponteiro para a posicao inicial do buffer a ser corrompido
+ * \param len Tamanho em bytes do buffer a ser corrompido
+ */
+void corrupt(struct worker_sdtp *w, char *buf, int len)
+{
+    int i = 5;
+
+    while(i--)
+    {
+        uint64_t r = sorteio(w);
+
+        buf[(r >> 32) % len] ^= (char)(1 + (r & 0xffffffff) % 255);
+    }
+}
+
+/**
+ * Converte uma porcentagem em limiar, na escala dos 32 bits altos de um
+ * sorteio
+ */
+static uint64_t limiar_simulacao(double porcentagem)
+{
+    return (uint64_t)(porcentagem / 100.0 * 4294967296.0);
+}
+
+/**
+ * Configura a simulacao de erros a partir de uma lista de itens separados
+ * por virgulas, aplicados em ordem, sobre uma simulacao sem erros:
+ * - legado: o perfil original
+ * - nenhum: nenhum erro (simulacao desligada)
+ * - perda_in=%, perda_out=%, soma_in=%, soma_out=%: erros excludentes
+ *   (soma de ate 100%)
+ * - ge_p=%, ge_r=%, ge_ruim=%, ge_bom=%: perda em rajada, com as
+ *   probabilidades de passagem, por pacote, do estado bom ao ruim (ge_p,
+ *   que ativa a cadeia) e do ruim ao bom (ge_r), e as taxas de perda de
+ *   cada estado (ge_ruim, padrao 100; ge_bom, padrao 0)
+ * - duplica=%, reordena=%: duplicacao e reordenacao das respostas
+ * - atraso=ms, variacao=ms: atraso das respostas, mais um valor uniforme
+ *   entre 0 e variacao
+ * - reordem=ms: atraso extra da resposta reordenada (padrao SIM_REORDEM)
+ * - semente=N: semente dos geradores (padrao, sorteada)
+ *
+ * Por exemplo, "legado,duplica=1" ou "ge_p=1,ge_r=25,semente=42".
+ *
+ * \param sim A simulacao
+ * \param lista A lista de itens
+ *
+ * \return 0 em caso de sucesso, ou -1 se algum item for invalido
+ */
+int configura_simulacao(struct simulacao_sdtp *sim, const char *lista)
+{
+    static const struct
+    {
+        const char *nome;
+        size_t campo;
+    } taxas[] =
+    {
+        { "perda_in",  offsetof(struct simulacao_sdtp, perda_in) },
+        { "perda_out", offsetof(struct simulacao_sdtp, perda_out) },
+        { "soma_in",   offsetof(struct simulacao_sdtp, soma_in) },
+        { "soma_out",  offsetof(struct simulacao_sdtp, soma_out) },
+        { "ge_p",      offsetof(struct simulacao_sdtp, ge_p) },
+        { "ge_r",      offsetof(struct simulacao_sdtp, ge_r) },
+        { "ge_ruim",   offsetof(struct simulacao_sdtp, ge_ruim) },
+        { "ge_bom",    offsetof(struct simulacao_sdtp, ge_bom) },
+        { "duplica",   offsetof(struct simulacao_sdtp, duplica) },
+        { "reordena",  offsetof(struct simulacao_sdtp, reordena) },
+    };
+    char *copia = strdup(lista), *resto = NULL, *item;
+    int erro = 0;
+
+    memset(sim, 0x0, sizeof(struct simulacao_sdtp));
+    sim->ge_ruim = 100;
+    sim->reordem = SIM_REORDEM;
+
+    for (item = strtok_r(copia, ",", &resto); item != NULL;
+         item = strtok_r(NULL, ",", &resto))
+    {
+        char *valor = strchr(item, '=');
+        char *fim = NULL;
+        size_t i;
+
+        if (strcmp(item, "legado") == 0)
+        {
+            sim->perda_in  = 10;
+            sim->perda_out = 5;
+            sim->soma_in   = 5;
+            sim->soma_out  = 10;
+            continue;
+        }
+
+        if (strcmp(item, "nenhum") == 0)
+        {
+            sim->perda_in = sim->perda_out = sim->soma_in = sim->soma_out = 0;
+            sim->ge_p = sim->duplica = sim->reordena = 0;
+            sim->atraso = sim->variacao = 0;
+            continue;
+        }
+
+        if (valor == NULL)
+        {
+            erro = 1;
+            break;
+        }
+
+        *valor++ = '\0';
+
+        for (i = 0; i < sizeof(taxas) / sizeof(taxas[0]); i++)
+        {
+            if (strcmp(item, taxas[i].nome) == 0)
+            {
+                double *taxa = (double *)((char *)sim + taxas[i].campo);
+
+                *taxa = strtod(valor, &fim);
+                erro = *fim != '\0' || *valor == '\0' || *taxa < 0
+                    || *taxa > 100;
+                break;
+            }
+        }
+
+        if (erro)
+            break;
+
+        if (i < sizeof(taxas) / sizeof(taxas[0]))
+            continue;
+
+        if (strcmp(item, "atraso") == 0)
+            sim->atraso = strtoul(valor, &fim, 10);
+        else if (strcmp(item, "variacao") == 0)
+            sim->variacao = strtoul(valor, &fim, 10);
+        else if (strcmp(item, "reordem") == 0)
+            sim->reordem = strtoul(valor, &fim, 10);
+        else if (strcmp(item, "semente") == 0)
+        {
+            sim->semente = strtoull(valor, &fim, 0);
+            sim->semente_fixa = 1;
+        }
+        else
+            fim = NULL;
+
+        if ((erro = fim == NULL || *fim != '\0' || *valor == '\0'))
+            break;
+    }
+
+    if (erro)
+        fprintf(stderr, "Erro: item invalido na simulacao: %s\n", item);
+
+    free(copia);
+
+    return erro ? -1 : 0;
+}
+
+/**
+ * Deriva os limiares da simulacao e sorteia a semente, quando nao
+ * informada; deve ser chamada antes dos workers
+ *
+ * \return 0 em caso de sucesso, ou -1 se os erros excludentes somarem mais
+ * que 100%
+ */
+int prepara_simulacao(struct simulacao_sdtp *sim)
+{
+    double taxas[SDTP_ERROR_SORTEIO] =
+        { 0, sim->perda_in, sim->perda_out, sim->soma_in, sim->soma_out };
+    double soma = 0;
+    int i;
+
+    for (i = SDTP_ERROR_LOST_IN; i < SDTP_ERROR_SORTEIO; i++)
+    {
+        soma += taxas[i];
+        sim->acumulado[i] = limiar_simulacao(soma);
+    }
+
+    if (soma > 100)
+    {
+        fprintf(stderr, "Erro: os erros excludentes da simulacao somam "
+                "%.2f%%\n", soma);
+        return -1;
+    }
+
+    sim->l_ge_p      = limiar_simulacao(sim->ge_p);
+    sim->l_ge_r      = limiar_simulacao(sim->ge_r);
+    sim->l_ge_ruim   = limiar_simulacao(sim->ge_ruim);
+    sim->l_ge_bom    = limiar_simulacao(sim->ge_bom);
+    sim->l_duplica   = limiar_simulacao(sim->duplica);
+    sim->l_reordena  = limiar_simulacao(sim->reordena);
+
+    sim->saida = sim->l_duplica || sim->l_reordena || sim->atraso
+              || sim->variacao;
+    sim->ativa = sim->acumulado[SDTP_ERROR_SORTEIO - 1] || sim->l_ge_p
+              || sim->saida;
+
+    if (!sim->semente_fixa
+            &&
+        getrandom(&sim->semente, sizeof(sim->semente), 0)
+            != sizeof(sim->semente))
+    {
+        sim->semente = agora_us();
+    }
+
+    return 0;
+}
+
+/**
+ * Descreve a simulacao, para o log do inicio do servidor
+ */
+void descreve_simulacao(const struct simulacao_sdtp *sim, char *buf,
+        size_t len)
+{
+    if (!sim->ativa)
+    {
+        snprintf(buf, len, "sem erros simulados");
+        return;
+    }
+
+    snprintf(buf, len, "perda_in %g%% perda_out %g%% soma_in %g%% "
+            "soma_out %g%%, rajada %g%%/%g%% (perda %g%%/%g%%), "
+            "duplica %g%%, reordena %g%% (+%u ms), atraso %u+%u ms, "
+            "semente %llu", sim->perda_in, sim->perda_out, sim->soma_in,
+            sim->soma_out, sim->ge_p, sim->ge_r, sim->ge_ruim, sim->ge_bom,
+            sim->duplica, sim->reordena, sim->reordem, sim->atraso,
+            sim->variacao, (unsigned long long)sim->semente);
+}
+
+/**
+ * Resposta adiada pela simulacao, enviada pelo seu temporizador
+ */
+struct adiada_sdtp
+{
+    struct timer_sdtp timer;  ///< Temporizador do envio
+    struct worker_sdtp *w;    ///< Worker que envia a resposta
+    struct sockaddr_in addr;  ///< Endereco do cliente
+    int len;                  ///< Tamanho da resposta
+    char dados[RESPOSTA_MAX]; ///< Resposta formatada
+};
+
+/**
+ * Envia uma resposta adiada, ao fim do seu atraso
+ */
+void envia_adiada(struct timer_sdtp *t)
+{
+    struct adiada_sdtp *a = (struct adiada_sdtp *)t->arg;
+    struct worker_sdtp *w = a->w;
+
+    if (sendto(w->meusocket, a->dados, a->len, 0,
+            (struct sockaddr *)&a->addr, sizeof(a->addr)) < 0)
+    {
+        LOG(NIVEL_ERRO, "sendto: %s", strerror(errno));
+    }
+
+    CONTA(w->est.pacotes_out, 1);
+    CONTA(w->est.bytes_out, a->len);
+    CONTA(w->est.envios, 1);
+
+    pool_put(&w->pool_adiadas, a);
+}
+
+/**
+ * Agenda o envio de uma copia da resposta
+ *
+ * \return 0 em caso de sucesso, ou -1 se o worker ja tiver SIM_ADIADAS
+ * respostas adiadas ou se faltar memoria
+ */
+int agenda_resposta(struct worker_sdtp *w, const char *buf, int len,
+        struct sockaddr_in *addr, unsigned ms)
+{
+    struct adiada_sdtp *a;
+
+    if (w->pool_adiadas.em_uso >= SIM_ADIADAS)
+        return -1;
+
+    a = (struct adiada_sdtp *) pool_get(&w->pool_adiadas);
+    if (a == NULL)
+        return -1;
+
+    a->w    = w;
+    a->addr = *addr;
+    a->len  = len;
+    memcpy(a->dados, buf, len);
+
+    timer_init(&a->timer, envia_adiada, a);
+    timer_arma(&w->ev, &a->timer, ms);
+
+    return 0;
+}
+
+/**
+ * Aplica a simulacao de saida a uma resposta: duplicacao (a copia segue
+ * com o mesmo atraso, e ao menos 1 ms apos a original), atraso com
+ * variacao, e reordenacao (um atraso extra, que deixa a resposta para
+ * depois das seguintes)
+ *
+ * \param w O worker
+ * \param buf A resposta formatada
+ * \param len O tamanho da resposta
+ * \param addr O endereco do cliente
+ *
+ * \return O tamanho da resposta a enviar agora, ou 0 se foi adiada
+ */
+int adia_resposta(struct worker_sdtp *w, char *buf, int len,
+        struct sockaddr_in *addr)
+{
+    const struct simulacao_sdtp *sim = &simulacao;
+    unsigned atraso = sim->atraso;
+
+    if (sim->variacao)
+        atraso += sorteio(w) % (sim->variacao + 1);
+
+    if (sorteia_evento(w, sim->l_duplica)
+            &&
+        agenda_resposta(w, buf, len, addr, atraso) == 0)
+    {
+        CONTA(w->est.simulados[SDTP_ERROR_DUP], 1);
+    }
+
+    if (sorteia_evento(w, sim->l_reordena))
+    {
+        CONTA(w->est.simulados[SDTP_ERROR_REORDER], 1);
+        atraso += sim->reordem;
+    }
+
+    // sem atraso, ou sem espaco para adiar, a resposta sai no lote
+    if (atraso == 0 || agenda_resposta(w, buf, len, addr, atraso) < 0)
+        return len;
+
+    CONTA(w->est.simulados[SDTP_ERROR_DELAY], 1);
+
+    return 0;
+}
+
+/**
+ * Aplica ao socket sdtp as opcoes pedidas (TH_SACK e TH_V2), que o
+ * servidor sempre aceita (no modo de gravacao, o v2 e obrigatorio)
+ */
+void negocia_opcoes(struct socket_sdtp *s, uint8_t flags)
+{
+    s->sack   = (flags & TH_SACK) != 0;
+    s->versao = flags & TH_V2 ? SDTP_V2 : 1;
+    s->limite = s->versao == SDTP_V2 ? BUFMAX2 : BUFMAX;
+
+    // gravando em arquivo, o v2 nao depende do buffer em memoria
+    if ( s->fd >= 0 && s->versao == SDTP_V2 )
+        s->limite = SAIDAMAX;
+}
+
+/**
+ * Atualiza a contagem de conexoes semiabertas do worker, apos o pacote
+ * levar a conexao do estado informado ao atual
+ */
+void conta_semiabertas(struct worker_sdtp *w, struct socket_sdtp *s,
+        int estado)
+{
+    if (SEMIABERTA(estado) && !SEMIABERTA(s->state))
+        CONTA(w->est.semiabertas, -1);
+    else if (!SEMIABERTA(estado) && SEMIABERTA(s->state))
+        CONTA(w->est.semiabertas, 1);
+}
+
+#define SIPROUND                                                        \
+    do                                                                  \
+    {                                                                   \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32);       \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2;                          \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0;                          \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32);       \
+    } while (0)
+
+/**
+ * SipHash-2-4 de uma mensagem, com chave de 16 bytes
+ *
+ * \param k A chave
+ * \param m A mensagem
+ * \param len O tamanho da mensagem
+ *
+ * \return O hash de 64 bits
+ */
+uint64_t siphash(const uint8_t *k, const uint8_t *m, size_t len)
+{
+    uint64_t k0, k1, mi, b = (uint64_t)len << 56;
+    uint64_t v0, v1, v2, v3;
+    size_t i;
+
+    memcpy(&k0, k, 8);
+    memcpy(&k1, k + 8, 8);
+
+    v0 = k0 ^ 0x736f6d6570736575ULL;
+    v1 = k1 ^ 0x646f72616e646f6dULL;
+    v2 = k0 ^ 0x6c7967656e657261ULL;
+    v3 = k1 ^ 0x7465646279746573ULL;
+
+    for (i = 0; i + 8 <= len; i += 8)
+    {
+        memcpy(&mi, m + i, 8);
+        v3 ^= mi;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= mi;
+    }
+
+    // os bytes restantes, com o tamanho no byte mais alto
+    for (; i < len; i++)
+        b |= (uint64_t)m[i] << (8 * (i % 8));
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/**
+ * Retorna as opcoes do cookie correspondentes as flags do SYN
+ */
+static inline uint32_t opcoes_cookie(uint8_t flags)
+{
+    return (flags & TH_SACK ? COOKIE_SACK : 0)
+         | (flags & TH_V2 ? COOKIE_V2 : 0);
+}
+
+/**
+ * Calcula o cookie da tupla (ip, porta), para as opcoes e a epoca
+ * informadas
+ */
+uint32_t gera_cookie(uint32_t ip, uint16_t porta, uint32_t opcoes,
+        uint64_t epoca)
+{
+    uint8_t msg[16];
+
+    memcpy(msg, &ip, 4);
+    memcpy(msg + 4, &porta, 2);
+    msg[6] = opcoes;
+    msg[7] = 0;
+    memcpy(msg + 8, &epoca, 8);
+
+    return ((uint32_t)siphash(chave_cookie, msg, sizeof(msg))
+            & ~COOKIE_OPCOES) | opcoes;
+}
+
+/**
+ * Verifica se os SYN cookies devem ser usados no worker, registrando as
+ * mudancas de modo
+ */
+int usa_cookies(struct worker_sdtp *w)
+{
+    int ativo = LE(w->est.semiabertas) >= (unsigned long)limiar_cookies;
+
+    if (ativo != w->cookies)
+    {
+        LOG(ativo ? NIVEL_AVISO : NIVEL_INFO, "Servidor[%d]: SYN cookies "
+                "%s (%d conexoes semiabertas)", w->id,
+                ativo ? "ativados" : "desativados",
+                (int)LE(w->est.semiabertas));
+        w->cookies = ativo;
+    }
+
+    return ativo;
+}
+
+/**
+ * Responde a um SYN sem criar estado, com o cookie no SYN-ACK
+ *
+ * A janela e calculada sobre um socket sdtp temporario, como a de uma
+ * conexao nova.
+ *
+ * \return 1, ja que o SYN-ACK sempre deve ser enviado
+ */
+int responde_cookie(struct worker_sdtp *w, struct sockaddr_in *addr,
+        struct pacote_sdtp *p)
+{
+    struct socket_sdtp tmp;
+    uint32_t janela, cookie;
+
+    tmp.fd      = -1;
+    tmp.nblocos = 0;
+    tmp.blocos  = NULL;
+    inicia_socket_sdtp(&tmp);
+    negocia_opcoes(&tmp, p->flags);
+
+    janela = janela_sdtp(w, &tmp);
+    cookie = gera_cookie(addr->sin_addr.s_addr, htons(addr->sin_port),
+            opcoes_cookie(p->flags), w->ev.agora / COOKIE_EPOCA);
+
+    CONTA(w->est.cookies_enviados, 1);
+
+    p->seqnum   = cookie & 0xffff;
+    p->acknum   = cookie >> 16;
+    p->datalen  = 0;
+    p->flags    = TH_SYN|TH_ACK|(p->flags & (TH_SACK|TH_V2));
+    p->window   = janela < JANELAMAX ? janela : JANELAMAX;
+
+    return 1;
+}
+
+/**
+ * Cria a conexao de um ACK ou segmento de dados sem conexao, se ele
+ * trouxer um cookie valido, da epoca atual ou da anterior
+ *
+ * A conexao nasce em WAIT_ACK, com as opcoes do cookie, e o proprio
+ * pacote a estabelece. No v1, os dados levam apenas 16 bits do cookie, e
+ * so o ACK cria a conexao (ver \ref cookies).
+ *
+ * \return O socket sdtp criado, ou NULL se o cookie for invalido
+ */
+struct socket_sdtp * aceita_cookie(struct worker_sdtp *w,
+        struct sockaddr_in *addr, struct pacote_sdtp *p)
+{
+    uint32_t ip = addr->sin_addr.s_addr;
+    uint16_t porta = htons(addr->sin_port);
+    uint64_t epoca = w->ev.agora / COOKIE_EPOCA;
+    uint32_t cookie, opcoes;
+    struct socket_sdtp *s;
+    int e;
+
+    if (p->flags == TH_ACK)
+    {
+        cookie = p->versao == SDTP_V2 ? p->acknum
+                                      : p->seqnum | p->acknum << 16;
+    }
+    else if (p->flags == 0x00 && p->versao == SDTP_V2)
+    {
+        cookie = p->acknum;
+    }
+    else
+    {
+        CONTA(w->est.cookies_invalidos, 1);
+        return NULL;
+    }
+
+    opcoes = cookie & COOKIE_OPCOES;
+
+    for (e = 0; e < 2 && epoca >= (uint64_t)e; e++)
+    {
+        if (gera_cookie(ip, porta, opcoes, epoca - e) == cookie)
+            break;
+    }
+
+    // a versao do pacote deve ser a negociada no cookie
+    if (e == 2 || epoca < (uint64_t)e
+            ||
+        ((opcoes & COOKIE_V2) != 0) != (p->versao == SDTP_V2))
+    {
+        LOG(NIVEL_DEBUG, "%x:%d pacote sem conexao e sem cookie valido",
+                ip, porta);
+        CONTA(w->est.cookies_invalidos, 1);
+        return NULL;
+    }
+
+    if ((s = get_socket_sdtp(w, addr)) == NULL)
+        return NULL;
+
+    // no modo de gravacao, sem arquivo de saida nao ha conexao
+    if (dir_saida != NULL && abre_saida(s) < 0)
+    {
+        remove_socket_sdtp(w, s);
+        return NULL;
+    }
+
+    negocia_opcoes(s, (opcoes & COOKIE_SACK ? TH_SACK : 0)
+                    | (opcoes & COOKIE_V2 ? TH_V2 : 0));
+
+    s->state = SDTP_WAIT_ACK;
+
+    // a borda volta a janela anunciada no SYN-ACK (aproximadamente)
+    janela_sdtp(w, s);
+
+    CONTA(w->est.cookies_aceitos, 1);
+
+    LOG(NIVEL_DEBUG, "%x:%d conexao criada por cookie", ip, porta);
+
+    return s;
+}
+
+/**
+ * Funcao responsavel por fazer o tratamento no pacote recebido.
+ *
+ * A resposta e preenchida no proprio pacote decodificado, na mesma versao
+ * de cabecalho, e codificada por trata_pacote.
+ *
+ * \return 1 quando for necessario reponder um pacote ao cliente, que sera
+ * realizado no `main()`
+ * \return 0 quando nao for necessario resposta, seja por causa de um erro
+ * real ou simulado
+ * 
+ */
+int handle_socket_sdtp(struct worker_sdtp *w, struct socket_sdtp *s,
+        struct pacote_sdtp *p)
+{ 
+    // fora do 3-way handshake, a versao do pacote deve ser a negociada
+    if ( !(p->flags & TH_SYN) && p->versao != s->versao )
+    {
+        LOG(NIVEL_DEBUG, "PACOTE COM VERSAO INVALIDA: v%d", p->versao);
+        return 0;
+    }
+
+    // se for um pacote de sincronizacao esperado do 3-way handshake,
+    // possivelmente pedindo a confirmacao seletiva e o cabecalho v2
+    if ( (p->flags & ~(TH_SACK|TH_V2)) == TH_SYN )
+    {
+        uint32_t janela, cookie;
+
+        // um SYN durante a permanencia em CLOSED inicia nova conexao,
+        // da mesma tupla
+        if ( s->state == SDTP_CLOSED )
+        {
+            solta_sincronia(s);
+            inicia_socket_sdtp(s);
+        }
+
+        if ( s->state == SDTP_WAIT_SYN )
+        {
+            // no modo de gravacao, sem arquivo de saida nao ha conexao
+            if ( dir_saida != NULL && abre_saida(s) < 0 )
+                return 0;
+
+            // muda o estado para wait ack
+            s->state = SDTP_WAIT_ACK;
+        }
+
+        // o servidor sempre aceita a confirmacao seletiva e o v2
+        negocia_opcoes(s, p->flags);
+
+        // responde com syn/ack, sempre no cabecalho v1
+        janela = janela_sdtp(w, s); // define o valor da janela
+
+        // o cookie segue mesmo com estado, para que o ACK ainda crie a
+        // conexao caso ela seja removida antes dele
+        cookie = gera_cookie(s->ip, s->porta, opcoes_cookie(p->flags),
+                w->ev.agora / COOKIE_EPOCA);
+
+        p->seqnum   = cookie & 0xffff;
+        p->acknum   = cookie >> 16;
+        p->datalen  = 0;
+        p->flags    = TH_SYN|TH_ACK|(p->flags & (TH_SACK|TH_V2));
+        p->window   = janela < JANELAMAX ? janela : JANELAMAX;
+
+        // habilita devolucao do pacote
+        return 1;
+    }
+    // se for o ack do 3-way handshake esperado
+    else if ( p->flags == TH_ACK )
+    {
+        if ( s->state == SDTP_WAIT_ACK )
+        {
+            // pronto para receber dados, ou finalizar a transferencia
+            s->state = SDTP_ESTABLISHED;
+            CONTA(w->est.handshakes, 1);
+        }
+
+        // nao retorna nada
+        return 0;
+    }
+    // conexao ja estabelecida e pacote de finalizacao
+    else if ( p->flags == TH_FIN 
+                &&
+              (
+               s->state == SDTP_ESTABLISHED 
+                ||
+               s->state == SDTP_CLOSED
+              )
+            )
+    {
+        // no v1, o arquivo lorem_ipsum.txt; no v2, o tamanho e o checksum
+        // informados pelo proprio FIN
+        uint32_t tamanho = s->versao == SDTP_V2 ? p->seqnum : LOREMSIZE;
+        uint16_t soma = s->versao == SDTP_V2 ? p->acknum : datasum;
+        int corretos, gravado;
+
+        // os FINs retransmitidos, ja em CLOSED, nao contam de novo
+        int primeiro = s->state == SDTP_ESTABLISHED;
+
+        // finaliza conexao
+        s->state = SDTP_CLOSED;
+
+        LOG(NIVEL_DEBUG, "size final: %d (esperado %u)", s->recebidos,
+                tamanho);
+
+        LOG(NIVEL_DEBUG, "datasum %d %x", soma, soma);
+
+        if ( primeiro )
+        {
+            // verifica e a validade dos dados recebidos, com o tamanho e a
+            // soma acumulados durante a recepcao
+            corretos = s->recebidos == tamanho 
+                        &&
+                       s->nfora == 0
+                        &&
+                       (uint16_t)~s->soma == soma;
+
+            // no modo de gravacao, o ACK so confirma dados ja no disco: a
+            // resposta pode esperar a sincronizacao (ver conclui_sincronia)
+            gravado = s->fd >= 0 ? fecha_saida(s, corretos) : 0;
+
+            if ( gravado > 0 )
+            {
+                libera_dados(w, s);
+                return 0;
+            }
+
+            if ( gravado < 0 )
+                corretos = 0;
+
+            // o arquivo ja foi fechado (ou descartado): os FINs
+            // retransmitidos recebem a mesma resposta, sem nova verificacao
+            s->veredito = corretos ? TH_ACK : TH_RST;
+
+            if ( corretos )
+                CONTA(w->est.concluidas, 1);
+            else
+                CONTA(w->est.rsts, 1);
+        }
+        else if ( s->sincronia != NULL )
+        {
+            // o arquivo ainda esta sendo sincronizado: a resposta sai ao
+            // fim da sincronizacao
+            return 0;
+        }
+        else
+        {
+            corretos = s->veredito == TH_ACK;
+        }
+
+        if ( corretos )
+        {
+            LOG(NIVEL_INFO, "%x:%d checksum final bateu! (v%d, %u bytes)",
+                    s->ip, s->porta, s->versao, s->recebidos);
+        
+            // se dados corretos, devolve ACK e finaliza
+            p->flags = TH_ACK;
+            
+        }
+        else
+        {
+            LOG(NIVEL_AVISO, "%x:%d erro no checksum final!",
+                    s->ip, s->porta);
+        
+            // se dados errados, devolve RST e finaliza
+            p->flags = TH_RST;
+        }
+
+        // o resultado nao depende mais dos dados, que voltam ao pool
+        libera_dados(w, s);
+            
+        p->seqnum   = 0;
+        p->acknum   = 0;
+        p->datalen  = 0;
+        p->window   = 0;
+
+        // a conexao permanece em CLOSED por PRAZO_LINGER, repetindo
+        // s->veredito aos FINs retransmitidos caso esta resposta se perca,
+        // e so entao e removida (ver expira_socket_sdtp)
+
+        // habilita envio deste pacote
+        return 1;
+
+        
+    }
+    // pacote de dados e conexao estabelecida
+    else if ( p->flags == 0x00 
+                && 
+              (
+                s->state == SDTP_ESTABLISHED 
+                    || 
+                s->state == SDTP_WAIT_ACK 
+              )
+            )
+    {
+        uint32_t ack = s->expseqnum;
+
+        // se o ACK falhar, assumo os dados como meu ack e mudo estado
+        if (s->state == SDTP_WAIT_ACK )
+        {
+            s->state = SDTP_ESTABLISHED;
+            CONTA(w->est.handshakes, 1);
+        }
+
+        // verificando:
+        // - se o pacote traz dados ainda nao recebidos em ordem; os
+        //   adiantados ficam guardados ate a lacuna ser preenchida
+        // - se o pacote cabe na janela anunciada
+        // - se ainda cabe no buffer
+        if ( 
+            p->seqnum < s->limite
+                &&
+            p->seqnum + p->datalen > s->recebidos
+                &&
+            p->seqnum + p->datalen <= s->borda
+                &&
+            p->seqnum + p->datalen < s->limite
+            )
+        {
+            // salva os dados no buffer da conexao, acumulando o tamanho
+            // e a soma, e anda o valor do proximo ack esperado
+            armazena_segmento(w, s,
+                    p->seqnum,  // deslocamento no buffer
+                    p->dados,   // dados
+                    p->datalen  // tamanho informado
+                    );
+        }
+        else if ( p->seqnum + p->datalen <= s->recebidos )
+        {
+            CONTA(w->est.duplicados, 1);
+        }
+        else
+        {
+            CONTA(w->est.fora_janela, 1);
+        }
+
+        // o ack que nao avanca e duplicado para o cliente
+        if ( s->expseqnum == ack )
+            CONTA(w->est.dupacks, 1);
+        
+        // devolve um ack para o cliente
+        // se algum teste acima falhar, este ack sera equivalente 
+        // ao ultimo pacote valido recebido
+        p->seqnum   = 0;
+        p->acknum   = s->expseqnum;
+        p->datalen  = 0;
+        p->flags    = TH_ACK;
+        p->window   = janela_sdtp(w, s); // define o valor da janela
+
+        // com a confirmacao seletiva, os primeiros intervalos adiantados
+        // seguem como blocos SACK, no lugar dos dados
+        if ( s->sack && s->nfora )
+        {
+            struct sackhdr *b = (struct sackhdr *)p->dados;
+            struct sackhdr2 *b2 = (struct sackhdr2 *)p->dados;
+            int i;
+
+            for (i = 0; i < s->nfora && i < SACK_BLOCOS; i++)
+            {
+                if (s->versao == SDTP_V2)
+                {
+                    b2[i].ini = s->fora[i].ini;
+                    b2[i].fim = s->fora[i].fim;
+                }
+                else
+                {
+                    b[i].ini = s->fora[i].ini;
+                    b[i].fim = s->fora[i].fim;
+                }
+            }
+
+            p->datalen = i * (s->versao == SDTP_V2 ? sizeof(struct sackhdr2)
+                                                   : sizeof(struct sackhdr));
+            p->flags  |= TH_SACK;
+        }
+
+        // habilita devolucao do ack no main
+        return 1;
+    }
+    else
+    {
+        LOG(NIVEL_DEBUG, "PACOTE INVALIDO RECEBIDO: flags 0x%x", p->flags);
+    }
+
+    return 0;
+}
+
+/**
+ * Trata um pacote recebido de um cliente, do teste de checksum ate a
+ * preparacao da resposta
+ *
+ * A resposta, quando houver, e formatada no proprio buffer do pacote.
+ *
+ * \param w O worker que recebeu o pacote
+ * \param buffer Buffer contendo o pacote recebido
+ * \param numbytes Quantidade de bytes recebidos
+ * \param endereco_cliente Endereco de origem do pacote
+ *
+ * \return O tamanho da resposta a enviar, ou 0 quando nao houver resposta
+ */
+int trata_pacote(struct worker_sdtp *w, char *buffer, int numbytes,
+        struct sockaddr_in *endereco_cliente)
+{
+    struct pacote_sdtp p;
+
+    struct socket_sdtp *sdtp_sockid;
+
+    // armazena o resultado do checksum para o pacote recebido
+    uint16_t sum = 0;
+
+    int len, estado, resposta, syn;
+
+    // pacote menor que o cabecalho, ou que o tamanho que informa
+    if (sdtp_decodifica(buffer, numbytes, &p) < 0)
+    {
+        LOG(NIVEL_DEBUG, "Servidor: pacote truncado (%d bytes)", numbytes);
+        CONTA(w->est.truncados, 1);
+        return 0;
+    }
+
+    // imprime pacote recebido
+    LOGPACKET(NIVEL_DEBUG, buffer);
+
+    // simula um erro para esta etapa da simulacao (desligada, nada e
+    // sorteado)
+    w->global_error = simulacao.ativa ? simerror(w) : SDTP_ERROR_NONE;
+
+    if (w->global_error != SDTP_ERROR_NONE)
+        LOG(NIVEL_DEBUG, "ERRO GERADO: %x",w->global_error);
+
+    // calculando o valor do checksum
+    //   sum = 0, em caso de sucesso, ou 
+    //   sum > 0, caso contrario
+    len = sdtp_cabecalho(p.versao) + p.datalen;
+    sum = checksum((void *)buffer, len);
+
+    // verdadeiro em caso de checksum invalido
+    //if ( sum != 0xffff )
+    if ( sum )
+    {
+        LOG(NIVEL_DEBUG, "CHECKSUM: calculado %d (%d bytes considerados)",
+                sum, len);
+    }
+
+    // possibilidades de erro neste ponto:
+    // - por perda de pacote na recepcao (simulado, isolada ou em rajada)
+    // - por checksum invalido (simulado)
+    // - por checksum invalido (calculado/real)
+    // nao faz nada com o pacote
+    if (
+        w->global_error == SDTP_ERROR_LOST_IN 
+            ||
+        w->global_error == SDTP_ERROR_BURST
+            ||
+        w->global_error == SDTP_ERROR_SUM_IN 
+            ||
+        sum
+        )
+    {
+        // o erro simulado prevalece sobre o real na contagem
+        if (w->global_error != SDTP_ERROR_NONE)
+        {
+            CONTA(w->est.simulados[(int)w->global_error], 1);
+        }
+        else
+        {
+            CONTA(w->est.checksum_invalidos, 1);
+        }
+
+        // nao envia nada como resposta ao cliente
+        return 0;
+    }
+
+    // obtem o socket sdtp para esta conexao
+    sdtp_sockid = busca_tabela(&w->tabela,
+            endereco_cliente->sin_addr.s_addr,
+            htons(endereco_cliente->sin_port));
+
+    syn = (p.flags & ~(TH_SACK|TH_V2)) == TH_SYN;
+
+    if (syn && dir_saida != NULL && !(p.flags & TH_V2))
+    {
+        // o modo de gravacao so aceita o v2, ja que o v1 confere os dados
+        // com o lorem_ipsum.txt: recusa o SYN, sem criar estado
+        LOG(NIVEL_DEBUG, "Servidor: SYN v1 recusado no modo de gravacao");
+
+        p.seqnum  = 0;
+        p.acknum  = 0;
+        p.datalen = 0;
+        p.flags   = TH_RST;
+        p.window  = 0;
+        resposta  = 1;
+    }
+    else if (sdtp_sockid == NULL && syn && usa_cookies(w))
+    {
+        // sob inundacao de SYNs, responde sem criar estado
+        resposta = responde_cookie(w, endereco_cliente, &p);
+    }
+    else
+    {
+        // sem conexao, apenas o SYN ou um cookie valido criam uma nova
+        if (sdtp_sockid == NULL)
+        {
+            sdtp_sockid = syn ? get_socket_sdtp(w, endereco_cliente)
+                              : aceita_cookie(w, endereco_cliente, &p);
+        }
+
+        // sem memoria para uma nova conexao, descarta o pacote
+        if (sdtp_sockid == NULL)
+        {
+            return 0;
+        }
+
+        if (LOG_ATIVO(NIVEL_DEBUG))
+            print_socket_list(w);
+
+        estado = sdtp_sockid->state;
+
+        // passa o pacote para ser analisado pelo tratador
+        //
+        // em caso de retorno = 1, reenvia pacote formatado dentro da
+        // funcao
+        resposta = handle_socket_sdtp(w, sdtp_sockid, &p);
+
+        // o prazo da conexao segue a atividade e o novo estado
+        conta_semiabertas(w, sdtp_sockid, estado);
+        arma_prazo(w, sdtp_sockid, estado);
+    }
+
+    if ( resposta )
+    {
+        // em caso de envio perdido (simulado), nao faz o envio
+        if ( w->global_error == SDTP_ERROR_LOST_OUT )
+        {
+            CONTA(w->est.simulados[SDTP_ERROR_LOST_OUT], 1);
+            return 0;
+        }
+
+        // a resposta pode levar blocos SACK apos o cabecalho
+        len = sdtp_codifica(buffer, &p);
+
+        // em caso de pacote enviado ser corrompido
+        if ( w->global_error == SDTP_ERROR_SUM_OUT )
+        {
+            CONTA(w->est.simulados[SDTP_ERROR_SUM_OUT], 1);
+            corrupt(w, buffer, sdtp_cabecalho(p.versao));
+        }
+
+        LOG(NIVEL_DEBUG, "IMPRIMINDO PACOTE REPLY");
+        LOGPACKET(NIVEL_DEBUG, buffer);
+
+        // duplicacao, atraso e reordenacao (simulados) adiam a resposta
+        if (simulacao.saida)
+            return adia_resposta(w, buffer, len, endereco_cliente);
+
+        return len;
+    }
+
+    LOG(NIVEL_DEBUG, "Servidor: nao enviou resposta");
+
+    return 0;
+}
+
+/**
+ * Cria o socket UDP de um worker, ligado a PORTA com SO_REUSEPORT, para
+ * que todos os workers possam escutar na mesma porta
+ *
+ * \return O descritor do socket, ou -1 em caso de erro
+ */
+int cria_socket_worker()
+{
+    // descritor do socket do worker
+    int meusocket;
+
+    // habilita o compartilhamento da porta entre os workers
+    int reuso = 1;
+
+    // informacoes do servidor
+    struct sockaddr_in endereco_servidor;
+
+    // criando o socket
+    meusocket = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (meusocket < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    if (setsockopt(meusocket, SOL_SOCKET, SO_REUSEPORT, &reuso,
+                sizeof(reuso)) < 0)
+    {
+        perror("setsockopt(SO_REUSEPORT)");
+        close(meusocket);
+        return -1;
+    }
+
+    endereco_servidor.sin_family = AF_INET;
+    
+    // define qualquer ip da interface de rede
+    endereco_servidor.sin_addr.s_addr = INADDR_ANY;
+    
+    // define a porta de escuta do servidor
+    endereco_servidor.sin_port = htons(PORTA);
+    
+    // zera o resto da estrutura
+    memset(&(endereco_servidor.sin_zero), '\0', 
+            sizeof(endereco_servidor.sin_zero));
+
+    // liga o socket ao enderecamento do servidor
+    if (bind(meusocket, (struct sockaddr *)&endereco_servidor, 
+            sizeof(struct sockaddr)) < 0)
+    {
+        perror("bind");
+        close(meusocket);
+        return -1;
+    }
+
+    return meusocket;
+}
+
+/**
+ * Ativa a recepcao agregada (UDP_GRO) no socket de um worker
+ *
+ * \return 1 se o kernel aceitou a opcao, 0 caso contrario
+ */
+int ativa_gro(int meusocket)
+{
+    int um = 1;
+
+    if (setsockopt(meusocket, SOL_UDP, UDP_GRO, &um, sizeof(um)) < 0)
+    {
+        LOG(NIVEL_AVISO, "setsockopt(UDP_GRO): %s, recebendo um segmento "
+                "por datagrama", strerror(errno));
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Envia de uma so vez (sendmmsg) as respostas acumuladas no lote
+ *
+ * \param w O worker
+ * \param numrespostas Quantidade de respostas acumuladas
+ */
+void envia_respostas(struct worker_sdtp *w, int numrespostas)
+{
+    CONTA(w->est.pacotes_out, numrespostas);
+
+    for (int i = 0; i < numrespostas; )
+    {
+        int n = sendmmsg(w->meusocket, w->msgs_out + i, numrespostas - i, 0);
+
+        CONTA(w->est.envios, 1);
+
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            LOG(NIVEL_ERRO, "sendmmsg: %s", strerror(errno));
+            break;
+        }
+
+        i += n;
+    }
+
+    LOG(NIVEL_DEBUG, "Servidor[%d]: enviou %d respostas", w->id,
+            numrespostas);
+}
+
+/**
+ * Retorna o tamanho de cada segmento agregado na mensagem (UDP_GRO), ou 0
+ * se a mensagem trouxer um unico segmento
+ */
+static int tamanho_gro(struct msghdr *m)
+{
+    struct cmsghdr *cm;
+
+    for (cm = CMSG_FIRSTHDR(m); cm != NULL; cm = CMSG_NXTHDR(m, cm))
+    {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+            return *(int *)CMSG_DATA(cm);
+    }
+
+    return 0;
+}
+
+/**
+ * Recebe e trata um lote de pacotes, chamada pelo laco de eventos quando
+ * o socket do worker possui dados
+ *
+ * - Recebendo um lote de pacotes de clientes (recvmmsg)
+ * - Separando os segmentos agregados pelo kernel (UDP_GRO)
+ * - Passando cada segmento para o tratador
+ * - Recebendo a resposta do tratador
+ * - Devolvendo as respostas do lote de uma so vez (sendmmsg)
+ *
+ * Pacotes que nao couberem no lote continuam na fila do socket, e o laco
+ * de eventos chamara esta funcao novamente.
+ *
+ * A resposta de cada segmento e formatada sobre o proprio segmento. Um
+ * segmento agregado menor que a maior resposta, seguido de outros, e
+ * tratado em uma copia, para que a resposta nao sobrescreva o proximo.
+ *
+ * \param e Registro do socket no laco de eventos
+ * \param eventos Eventos ocorridos no socket
+ */
+void recebe_lote(struct evfd_sdtp *e, uint32_t eventos)
+{
+    struct worker_sdtp *w = (struct worker_sdtp *)e->arg;
+
+    int lote = w->lote;
+
+    // numero de pacotes recebidos e de respostas a enviar no lote
+    int numpacotes, numrespostas;
+
+    // numero de bytes da resposta de um pacote
+    int numbytes;
+
+    for (int i = 0; i < lote; i++)
+    {
+        w->msgs_in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+        if (w->gro)
+            w->msgs_in[i].msg_hdr.msg_controllen = sizeof(w->controles[i]);
+    }
+
+    // leva os pacotes ja na fila, sem bloquear
+    numpacotes = recvmmsg(w->meusocket, w->msgs_in, lote, MSG_DONTWAIT,
+            NULL);
+
+    if (numpacotes <= 0)
+    {
+        if (numpacotes < 0 && errno != EAGAIN && errno != EINTR)
+            LOG(NIVEL_ERRO, "recvmmsg: %s", strerror(errno));
+
+        return;
+    }
+
+    CONTA(w->est.lotes, 1);
+    CONTA(w->est.mensagens, numpacotes);
+
+    LOG(NIVEL_DEBUG, "Servidor[%d]: possui %lu conexoes ativas", w->id,
+            LE(w->est.conexoes));
+    if (LOG_ATIVO(NIVEL_DEBUG))
+        print_tabela_stats(w);
+    LOG(NIVEL_DEBUG, "POOLS (worker %d): sockets %zu/%zu blocos %zu/%zu",
+            w->id, w->pool_sockets.em_uso, w->pool_sockets.total,
+            w->pool_blocos.em_uso, w->pool_blocos.total);
+
+    numrespostas = 0;
+
+    for (int i = 0; i < numpacotes; i++)
+    {
+        char *buf = w->buffers + i * w->tambuf;
+        int len = w->msgs_in[i].msg_len;
+        int tamseg = w->gro ? tamanho_gro(&w->msgs_in[i].msg_hdr) : 0;
+
+        LOG(NIVEL_DEBUG, "Servidor[%d]: pacote recebeu %d bytes "
+                "(segmentos de %d)", w->id, len, tamseg);
+
+        if (tamseg <= 0 || tamseg > len)
+            tamseg = len;
+
+        for (int off = 0; off < len; off += tamseg)
+        {
+            char *seg = buf + off;
+            int n = len - off < tamseg ? len - off : tamseg;
+
+            CONTA(w->est.pacotes_in, 1);
+            CONTA(w->est.bytes_in, n);
+
+            // a resposta (ate RESPOSTA_MAX bytes) e formatada sobre o
+            // segmento: se nao couber antes do proximo, ou antes do fim
+            // do buffer (ultimo segmento de uma mensagem agregada), o
+            // segmento e copiado a parte
+            if ((off + n < len && n < (int)RESPOSTA_MAX)
+                    ||
+                off + RESPOSTA_MAX > w->tambuf)
+            {
+                memcpy(w->pequenos[numrespostas], seg, n);
+                seg = w->pequenos[numrespostas];
+            }
+
+            numbytes = trata_pacote(w, seg, n, &w->enderecos[i]);
+
+            // a resposta sai do mesmo buffer, para o mesmo endereco
+            if (numbytes > 0)
+            {
+                struct msghdr *m = &w->msgs_out[numrespostas].msg_hdr;
+
+                w->iov_out[numrespostas].iov_base = seg;
+                w->iov_out[numrespostas].iov_len  = numbytes;
+                CONTA(w->est.bytes_out, numbytes);
+                m->msg_iov     = &w->iov_out[numrespostas];
+                m->msg_iovlen  = 1;
+                m->msg_name    = &w->enderecos[i];
+                m->msg_namelen = w->msgs_in[i].msg_hdr.msg_namelen;
+
+                if (++numrespostas == w->maxrespostas)
+                {
+                    envia_respostas(w, numrespostas);
+                    numrespostas = 0;
+                }
+            }
+        }
+    }
+
+    LOG(NIVEL_DEBUG, "Servidor[%d]: lote recebeu %d pacotes, %lu segmentos "
+            "(media %.2f pacotes e %.2f segmentos por chamada, de %d)",
+            w->id, numpacotes, LE(w->est.pacotes_in),
+            (double)LE(w->est.mensagens) / LE(w->est.lotes),
+            (double)LE(w->est.pacotes_in) / LE(w->est.lotes), lote);
+
+    // envia todas as respostas do lote
+    envia_respostas(w, numrespostas);
+}
+
+/**
+ * Responde ao FIN da conexao cujo arquivo de saida terminou de ser
+ * sincronizado, com o veredito que passa a ser repetido aos FINs
+ * retransmitidos
+ *
+ * \param w O worker da conexao
+ * \param s Ponteiro para o socket sdtp
+ * \param corretos Se os dados foram gravados
+ */
+void responde_sincronia(struct worker_sdtp *w, struct socket_sdtp *s,
+        int corretos)
+{
+    struct sockaddr_in addr;
+    struct pacote_sdtp p;
+    char buffer[MAXSDTP2];
+    int len;
+
+    s->sincronia = NULL;
+    s->veredito  = corretos ? TH_ACK : TH_RST;
+
+    if ( corretos )
+    {
+        LOG(NIVEL_INFO, "%x:%d checksum final bateu! (v%d, %u bytes)",
+                s->ip, s->porta, s->versao, s->recebidos);
+        CONTA(w->est.concluidas, 1);
+    }
+    else
+    {
+        LOG(NIVEL_AVISO, "%x:%d dados nao gravados", s->ip, s->porta);
+        CONTA(w->est.rsts, 1);
+    }
+
+    memset(&p, 0x0, sizeof(p));
+    p.versao = s->versao;
+    p.flags  = s->veredito;
+    len = sdtp_codifica(buffer, &p);
+
+    memset(&addr, 0x0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = s->ip;
+    addr.sin_port        = htons(s->porta);
+
+    if (sendto(w->meusocket, buffer, len, 0, (struct sockaddr *)&addr,
+            sizeof(addr)) < 0)
+    {
+        LOG(NIVEL_ERRO, "sendto: %s", strerror(errno));
+    }
+
+    CONTA(w->est.pacotes_out, 1);
+    CONTA(w->est.bytes_out, len);
+    CONTA(w->est.envios, 1);
+
+    // a permanencia em CLOSED conta a partir da resposta
+    s->ultimo = w->ev.agora;
+}
+
+/**
+ * Recebe do pipe do worker as sincronizacoes concluidas, respondendo as
+ * conexoes que ainda existem
+ */
+void conclui_sincronia(struct evfd_sdtp *e, uint32_t eventos)
+{
+    struct worker_sdtp *w = (struct worker_sdtp *)e->arg;
+    struct sincronia_sdtp *p;
+
+    (void)eventos;
+
+    while (read(w->sincronizadas[0], &p, sizeof(p)) == sizeof(p))
+    {
+        if (p->s != NULL)
+            responde_sincronia(w, p->s, p->resultado == 0);
+
+        free(p);
+    }
+}
+
+/**
+ * Laco de um worker do servidor
+ *
+ * Nesta ocorre o \a looping infinito de cada worker, aguardando no laco
+ * de eventos pelo seu socket (e pelos temporizadores do worker).
+ *
+ * \param arg Ponteiro para o worker_sdtp
+ */
+void *executa_worker(void *arg)
+{
+    struct worker_sdtp *w = (struct worker_sdtp *)arg;
+
+    int lote = w->lote;
+
+    // com UDP_GRO, cada posicao do lote recebe ate GRO_BUFFER bytes, e
+    // cada segmento agregado pode gerar uma resposta
+    w->gro          = usa_gro && ativa_gro(w->meusocket);
+    w->tambuf       = w->gro ? GRO_BUFFER : MAXSDTP2;
+    w->maxrespostas = w->gro ? lote * GSO_SEGMENTOS : lote;
+
+    // buffers, enderecos e cabecalhos de mensagem de cada posicao do lote
+    w->buffers   = malloc(lote * w->tambuf);
+    w->controles = calloc(lote, sizeof(*w->controles));
+    w->enderecos = malloc(lote * sizeof(*w->enderecos));
+    w->iov_in    = malloc(lote * sizeof(*w->iov_in));
+    w->msgs_in   = calloc(lote, sizeof(*w->msgs_in));
+    w->pequenos  = malloc(w->maxrespostas * sizeof(*w->pequenos));
+    w->iov_out   = malloc(w->maxrespostas * sizeof(*w->iov_out));
+    w->msgs_out  = calloc(w->maxrespostas, sizeof(*w->msgs_out));
+
+    // cada posicao do lote recebe em seu proprio buffer
+    for (int i = 0; i < lote; i++)
+    {
+        w->iov_in[i].iov_base = w->buffers + i * w->tambuf;
+        w->iov_in[i].iov_len  = w->tambuf;
+        w->msgs_in[i].msg_hdr.msg_iov    = &w->iov_in[i];
+        w->msgs_in[i].msg_hdr.msg_iovlen = 1;
+        w->msgs_in[i].msg_hdr.msg_name   = &w->enderecos[i];
+
+        if (w->gro)
+            w->msgs_in[i].msg_hdr.msg_control = w->controles[i];
+    }
+
+    if (evloop_init(&w->ev) < 0
+            ||
+        evloop_add_fd(&w->ev, &w->evsock, w->meusocket, EPOLLIN,
+            recebe_lote, w) < 0
+            ||
+        (dir_saida != NULL
+            &&
+         evloop_add_fd(&w->ev, &w->evsincronia, w->sincronizadas[0],
+            EPOLLIN, conclui_sincronia, w) < 0))
+    {
+        LOG(NIVEL_ERRO, "Servidor[%d]: evloop: %s", w->id, strerror(errno));
+        return NULL;
+    }
+
+    LOG(NIVEL_INFO, "Servidor[%d]: aguardando no laco de eventos%s...",
+            w->id, w->gro ? " (gro)" : "");
+
+    while (evloop_executa(&w->ev, -1) >= 0)
+        ;
+
+    LOG(NIVEL_ERRO, "Servidor[%d]: evloop_executa: %s", w->id,
+            strerror(errno));
+
+    evloop_destroy(&w->ev);
+    close(w->meusocket);
+
+    return NULL;
+}
+
+/**
+ * Metrica exportada por worker, lida de um campo das estatisticas
+ */
+struct metrica_sdtp
+{
+    const char *nome;         ///< Nome da metrica
+    const char *tipo;         ///< counter ou gauge
+    const char *ajuda;        ///< Descricao
+    size_t campo;             ///< Deslocamento do campo em estatisticas_sdtp
+};
+
+/// Descreve a metrica sdtp_nome, lida do campo das estatisticas
+#define METRICA(nome, tipo, campo, ajuda) \
+    { "sdtp_" nome, tipo, ajuda, offsetof(struct estatisticas_sdtp, campo) }
+
+/**
+ * Metricas exportadas por worker, alem das que tem rotulos proprios
+ * (erros simulados e remocoes)
+ */
+const struct metrica_sdtp metricas[] =
+{
+    METRICA("lotes_total", "counter", lotes, "Lotes recebidos (recvmmsg)"),
+    METRICA("mensagens_total", "counter", mensagens,
+            "Mensagens recebidas, antes da separacao do GRO"),
+    METRICA("pacotes_recebidos_total", "counter", pacotes_in,
+            "Segmentos recebidos"),
+    METRICA("bytes_recebidos_total", "counter", bytes_in,
+            "Bytes dos segmentos recebidos"),
+    METRICA("pacotes_enviados_total", "counter", pacotes_out,
+            "Respostas enviadas"),
+    METRICA("bytes_enviados_total", "counter", bytes_out,
+            "Bytes das respostas enviadas"),
+    METRICA("envios_total", "counter", envios,
+            "Chamadas de envio (sendmmsg)"),
+    METRICA("truncados_total", "counter", truncados,
+            "Pacotes menores que o cabecalho ou que o tamanho informado"),
+    METRICA("checksum_invalidos_total", "counter", checksum_invalidos,
+            "Pacotes com checksum invalido (real)"),
+    METRICA("segmentos_duplicados_total", "counter", duplicados,
+            "Segmentos de dados ja recebidos"),
+    METRICA("segmentos_fora_janela_total", "counter", fora_janela,
+            "Segmentos alem da janela anunciada ou do limite da conexao"),
+    METRICA("acks_duplicados_total", "counter", dupacks,
+            "ACKs enviados sem avanco da confirmacao"),
+    METRICA("handshakes_total", "counter", handshakes,
+            "Conexoes estabelecidas"),
+    METRICA("transferencias_corretas_total", "counter", concluidas,
+            "FINs respondidos com ACK"),
+    METRICA("transferencias_rst_total", "counter", rsts,
+            "FINs respondidos com RST"),
+    METRICA("cookies_enviados_total", "counter", cookies_enviados,
+            "SYN-ACKs enviados sem criar estado"),
+    METRICA("cookies_aceitos_total", "counter", cookies_aceitos,
+            "Conexoes criadas por cookie"),
+    METRICA("cookies_invalidos_total", "counter", cookies_invalidos,
+            "Pacotes sem conexao e sem cookie valido"),
+    METRICA("conexoes", "gauge", conexoes, "Conexoes existentes"),
+    METRICA("semiabertas", "gauge", semiabertas,
+            "Conexoes em WAIT_SYN ou WAIT_ACK"),
+    { NULL, NULL, NULL, 0 }
+};
+
+/**
+ * Exportador das estatisticas: uma thread, com o seu laco de eventos, que
+ * reescreve o arquivo e atende as consultas pelo socket Unix
+ */
+struct exportador_sdtp
+{
+    pthread_t thread;         ///< Thread do exportador
+    struct worker_sdtp *workers; ///< Workers do servidor
+    int numworkers;           ///< Quantidade de workers
+    int sock;                 ///< Socket Unix de consulta, ou -1
+    struct evloop_sdtp ev;    ///< Laco de eventos
+    struct evfd_sdtp evsock;  ///< Registro do socket Unix
+    struct timer_sdtp timer;  ///< Reescrita periodica do arquivo
+};
+
+/**
+ * Formata as estatisticas de todos os workers no formato texto do
+ * Prometheus, com o rotulo worker
+ *
+ * Os contadores sao lidos sem sincronizacao com os workers (ver CONTA):
+ * cada valor e consistente, mas valores distintos podem ser de instantes
+ * ligeiramente diferentes.
+ *
+ * \param x O exportador
+ * \param len Recebe o tamanho do texto
+ *
+ * \return O texto (liberado com free), ou NULL em caso de erro
+ */
+char *formata_estatisticas(struct exportador_sdtp *x, size_t *len)
+{
+    const struct metrica_sdtp *m;
+    char *texto = NULL;
+    FILE *f;
+    int i, k;
+
+    if ((f = open_memstream(&texto, len)) == NULL)
+        return NULL;
+
+    for (m = metricas; m->nome != NULL; m++)
     {
-        if ( s->state == SDTP_WAIT_ACK )
+        fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", m->nome, m->ajuda,
+                m->nome, m->tipo);
+
+        for (i = 0; i < x->numworkers; i++)
         {
-            // pronto para receber dados, ou finalizar a transferencia
-            s->state = SDTP_ESTABLISHED;
-        }
+            _Atomic unsigned long *c = (_Atomic unsigned long *)
+                ((char *)&x->workers[i].est + m->campo);
 
-        // nao retorna nada
-        return 0;
+            fprintf(f, "%s{worker=\"%d\"} %lu\n", m->nome, i, LE(*c));
+        }
     }
-    // conexao ja estabelecida e pacote de finalizacao
-    else if ( p->flags == TH_FIN 
-                &&
-              (
-               s->state == SDTP_ESTABLISHED 
-                ||
-               s->state == SDTP_CLOSED
-              )
-            )
-    {
-        // finaliza conexao
-        s->state = SDTP_CLOSED;
-
-        printf("size final: %d\n",strlen(s->data));
 
-        printf("datasum %d %x\n",datasum,datasum);
-        printf("checksum final %d\n",checksum((void *)s->data, LOREMSIZE));
+    fprintf(f, "# HELP sdtp_erros_simulados_total Erros simulados, por "
+            "tipo\n# TYPE sdtp_erros_simulados_total counter\n");
 
-        // verifica e a validade dos dados recebidos
-        if (
-            strlen(s->data) == LOREMSIZE 
-                &&
-            checksum((void *)s->data, LOREMSIZE) == datasum
-            )
+    for (i = 0; i < x->numworkers; i++)
+    {
+        for (k = SDTP_ERROR_NONE + 1; k < SDTP_ERRORS; k++)
         {
-            printf("checksum final bateu!\n\n\n");
-        
-            // se dados corretos, devolve ACK e finaliza
-            p->flags = TH_ACK;
-            
+            fprintf(f, "sdtp_erros_simulados_total{worker=\"%d\","
+                    "tipo=\"%s\"} %lu\n", i, nomes_erro[k],
+                    LE(x->workers[i].est.simulados[k]));
         }
-        else
+    }
+
+    fprintf(f, "# HELP sdtp_removidas_total Conexoes removidas por prazo, "
+            "por motivo\n# TYPE sdtp_removidas_total counter\n");
+
+    for (i = 0; i < x->numworkers; i++)
+    {
+        for (k = 0; k < REMOCOES; k++)
         {
-            printf("erro no checksum final!\n\n\n");
-        
-            // se dados errados, devolve RST e finaliza
-            p->flags = TH_RST;
+            fprintf(f, "sdtp_removidas_total{worker=\"%d\",motivo=\"%s\"} "
+                    "%lu\n", i, motivos_remocao[k],
+                    LE(x->workers[i].est.removidas[k]));
         }
-            
-        p->seqnum   = 0;
-        p->acknum   = 0;
-        p->window   = 0;
-        p->checksum = 0;
-        p->checksum = checksum((void *)p, sizeof(struct sdtphdr));
+    }
 
-        // se nao houver nenhum erro programado, pode finalizar
-        // o socket da conexao
-        if ( global_error == SDTP_ERROR_NONE )
-        {
-            // libera o espaco do socket sdtp desta conexao
-            // reorganizar a fila de conexoes, ver se precisa de um 
-            remove_socket_sdtp(s);
-        
-            print_socket_list();
+    fprintf(f, "# HELP sdtp_memoria_bytes Memoria ocupada pelos blocos de "
+            "dados\n# TYPE sdtp_memoria_bytes gauge\n"
+            "sdtp_memoria_bytes %zu\n", (size_t)memoria_usada);
+    fprintf(f, "# HELP sdtp_orcamento_bytes Memoria global para os blocos "
+            "de dados\n# TYPE sdtp_orcamento_bytes gauge\n"
+            "sdtp_orcamento_bytes %zu\n", orcamento);
 
-            printf("REALMENTE FINALIZOU!\n\n");
-        }
+    if (fclose(f) != 0)
+    {
+        free(texto);
+        return NULL;
+    }
 
-        // habilita envio deste pacote
-        return 1;
+    return texto;
+}
 
-        
+/**
+ * Reescreve o arquivo das estatisticas, chamada pelo temporizador do
+ * exportador a cada ESTAT_PERIODO
+ *
+ * O texto e gravado em um arquivo temporario, renomeado em seguida, de
+ * modo que o leitor (por exemplo, o textfile collector do node_exporter)
+ * nunca encontra um arquivo incompleto.
+ */
+void grava_estatisticas(struct timer_sdtp *t)
+{
+    struct exportador_sdtp *x = (struct exportador_sdtp *)t->arg;
+    char tmp[4096];
+    size_t len, feito = 0;
+    char *texto;
+    int fd;
+
+    timer_arma(&x->ev, t, ESTAT_PERIODO);
+
+    if ((texto = formata_estatisticas(x, &len)) == NULL)
+        return;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", arquivo_estat);
+
+    if ((fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644)) < 0)
+    {
+        LOG(NIVEL_ERRO, "estatisticas: %s: %s", tmp, strerror(errno));
+        free(texto);
+        return;
     }
-    // pacote de dados e conexao estabelecida
-    else if ( p->flags == 0x00 
-                && 
-              (
-                s->state == SDTP_ESTABLISHED 
-                    || 
-                s->state == SDTP_WAIT_ACK 
-              )
-            )
+
+    while (feito < len)
     {
-        // se o ACK falhar, assumo os dados como meu ack e mudo estado
-        if (s->state == SDTP_WAIT_ACK )
-        {
-            s->state = SDTP_ESTABLISHED;
-        }
+        ssize_t n = write(fd, texto + feito, len - feito);
 
-        // verificando:
-        // - se o pacote esta na ordem correta
-        // - se o tamanho esta de acordo com a janela
-        if ( 
-            s->expseqnum == p->seqnum 
-                &&
-            s->window >= p->datalen
-            )
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0)
+            break;
+
+        feito += n;
+    }
+
+    if (close(fd) < 0 || feito < len || rename(tmp, arquivo_estat) < 0)
+    {
+        LOG(NIVEL_ERRO, "estatisticas: %s: %s", arquivo_estat,
+                strerror(errno));
+        unlink(tmp);
+    }
+
+    free(texto);
+}
+
+/**
+ * Atende as consultas pelo socket Unix, chamada pelo laco de eventos do
+ * exportador: cada cliente aceito recebe as estatisticas e e desconectado
+ */
+void atende_estatisticas(struct evfd_sdtp *e, uint32_t eventos)
+{
+    struct exportador_sdtp *x = (struct exportador_sdtp *)e->arg;
+    struct timeval limite = { 1, 0 };
+    int i, c;
+
+    for (i = 0; i < ESTAT_CLIENTES
+            && (c = accept4(x->sock, NULL, NULL, SOCK_CLOEXEC)) >= 0; i++)
+    {
+        size_t len, feito = 0;
+        char *texto;
+
+        // um cliente lento nao prende o exportador
+        setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &limite, sizeof(limite));
+
+        if ((texto = formata_estatisticas(x, &len)) != NULL)
         {
-            // verifica se ainda cabe no buffer
-            if ( strlen(s->data) + p->datalen < 2*LOREMSIZE )
+            while (feito < len)
             {
-                // salva os dados no buffer da conexao
-                memcpy(
-                    s->data + p->seqnum, // deslocamento no buffer
-                    (uint8_t *)p + sizeof(struct sdtphdr), // dados
-                    p->datalen  // tamanho informado
-                   );
+                ssize_t n = send(c, texto + feito, len - feito,
+                        MSG_NOSIGNAL);
+
+                if (n <= 0)
+                    break;
 
-                // anda o valor do proximo ack esperado
-                s->expseqnum += p->datalen; // a ser retornado no ack
+                feito += n;
             }
+
+            free(texto);
         }
-        
-        // devolve um ack para o cliente
-        // se algum teste acima falhar, este ack sera equivalente 
-        // ao ultimo pacote valido recebido
-        p->seqnum   = 0;
-        p->acknum   = s->expseqnum;
-        p->datalen  = 0;;
-        p->flags    = TH_ACK;
-        s->window   = WINDOW(); // define o valor da janela
-        p->window   = s->window;
-        p->checksum = 0;
-        p->checksum = checksum((void *)p, sizeof(struct sdtphdr));
 
-        // habilita devolucao do ack no main
-        return 1;
+        close(c);
     }
-    else
+}
+
+/**
+ * Cria o socket Unix de consulta das estatisticas, substituindo um socket
+ * antigo no mesmo caminho
+ *
+ * \return O descritor do socket, ou -1 em caso de erro
+ */
+int cria_socket_estat(const char *caminho)
+{
+    struct sockaddr_un end;
+    int sock;
+
+    if (strlen(caminho) >= sizeof(end.sun_path))
     {
-        printf("DEBUG - PACOTE INVALIDO RECEBIDO:\n");
-        printpacket(p);
+        errno = ENAMETOOLONG;
+        return -1;
     }
 
-    return 0;
+    if ((sock = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0))
+            < 0)
+    {
+        return -1;
+    }
+
+    memset(&end, 0x0, sizeof(end));
+    end.sun_family = AF_UNIX;
+    strcpy(end.sun_path, caminho);
+
+    unlink(caminho);
+
+    if (bind(sock, (struct sockaddr *)&end, sizeof(end)) < 0
+            ||
+        listen(sock, ESTAT_CLIENTES) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/**
+ * Laco do exportador das estatisticas
+ *
+ * Roda fora dos workers, e apenas le os seus contadores: a exportacao nao
+ * passa pelo caminho dos pacotes.
+ */
+void *executa_exportador(void *arg)
+{
+    struct exportador_sdtp *x = (struct exportador_sdtp *)arg;
+
+    if (evloop_init(&x->ev) < 0
+            ||
+        (x->sock >= 0
+            &&
+         evloop_add_fd(&x->ev, &x->evsock, x->sock, EPOLLIN,
+             atende_estatisticas, x) < 0))
+    {
+        LOG(NIVEL_ERRO, "estatisticas: evloop: %s", strerror(errno));
+        return NULL;
+    }
+
+    timer_init(&x->timer, grava_estatisticas, x);
+
+    if (arquivo_estat != NULL)
+        grava_estatisticas(&x->timer);
+
+    while (evloop_executa(&x->ev, -1) >= 0)
+        ;
+
+    LOG(NIVEL_ERRO, "estatisticas: evloop_executa: %s", strerror(errno));
+
+    evloop_destroy(&x->ev);
+
+    return NULL;
 }
 
+#ifndef SERVIDOR_SEM_MAIN
 /**
  * Funcao principal do servidor
  *
- * Nesta ocorre o \a looping infinito do servidor:
- * - Recebendo pacotes de clientes
- * - Passando para o tratador
- * - Recebendo a resposta do tratador
- * - Devolvendo ou nao uma resposta ao cliente
+ * Prepara e inicia os workers, cada um com seu proprio socket, tabela de
+ * conexoes, pools, gerador de erros e estatisticas, e aguarda por eles.
+ *
+ * Opcoes:
+ * - -b N: quantidade maxima de pacotes por lote (padrao LOTE)
+ * - -w N: quantidade de workers (padrao 1, 0 para um por nucleo)
+ * - -l N: nivel de log (0 erro, 1 aviso, 2 info (padrao), 3 debug)
+ * - -L arquivo: grava o log no arquivo (rotacionado), e nao na tela
+ * - -M N: memoria global para os dados das conexoes (MB, padrao ORCAMENTO)
+ * - -c N: conexoes semiabertas, por worker, a partir das quais os SYN
+ *   sao respondidos com cookies, sem criar estado (padrao COOKIE_LIMIAR,
+ *   0 para sempre; ver \ref cookies)
+ * - -G: nao pede a recepcao agregada (UDP_GRO) ao kernel
+ * - -o dir: modo de gravacao, com os dados de cada conexao gravados em
+ *   dir/ip-porta-instante (ver grava_saida); apenas conexoes v2
+ * - -P arquivo: grava as estatisticas dos workers (ver \ref estatisticas)
+ *   no arquivo, no formato texto do Prometheus, a cada ESTAT_PERIODO
+ * - -U caminho: responde as estatisticas, no mesmo formato, a cada conexao
+ *   ao socket Unix no caminho (por exemplo, socat - UNIX:caminho)
+ * - -r: modo de teste, com janelas aleatorias (WINDOW)
+ * - -e lista: erros simulados (ver configura_simulacao e
+ *   \ref simulacao); sem a opcao, o perfil legado (o original). Por
+ *   exemplo, "nenhum", "legado,duplica=1" ou
+ *   "ge_p=1,ge_r=25,atraso=20,semente=42"
+ * - -E: nao simula erros (o mesmo que -e nenhum), para capturas que o
+ *   replay_sdtp possa conferir
  */
 int main(int argc, char *argv[])
 {
-    char buffer[MAXSDTP];
+    // quantidade maxima de pacotes por lote
+    int lote = LOTE;
 
-    struct sdtphdr *p;
+    // quantidade de workers
+    int numworkers = 1;
 
-    struct socket_sdtp *sdtp_sockid;
-    
-    // abrindo o arquivo lorem_ipsum.txt e calculando seu checksum
-    FILE *loremfile = fopen("./lorem_ipsum.txt", "r");
-    char loremdata[LOREMSIZE];
-    fread(loremdata, 1, LOREMSIZE, loremfile);
-    datasum = checksum((void *)loremdata, LOREMSIZE);
+    struct worker_sdtp *workers;
 
-    printf("Checksum do arquivo: %d\n",datasum);
+    // exportador das estatisticas
+    struct exportador_sdtp exportador;
 
-    // reiniciando a semente
-    srand(time(NULL));
+    // nivel e arquivo de log
+    int nivel = NIVEL_INFO;
+    char *arquivo_log = NULL;
 
-    // descritor do socket do servidor
-    int meusocket;
+    // descricao da simulacao de erros, para o log
+    char descricao[256];
 
-    // recebe o tamanho da estrutura sockaddr_in
-    int sockettamanho;
+    int opt;
 
-    // numero de bytes recebidos pelo socket
-    int numbytes;
-    
-    // informacoes do cliente
-    struct sockaddr_in endereco_cliente;
+    while ((opt = getopt(argc, argv, "b:w:l:L:M:c:Go:P:U:re:E")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                lote = atoi(optarg);
+                break;
+            case 'w':
+                numworkers = atoi(optarg);
+                break;
+            case 'l':
+                nivel = atoi(optarg);
+                break;
+            case 'L':
+                arquivo_log = optarg;
+                break;
+            case 'M':
+                orcamento = (size_t)atol(optarg) << 20;
+                break;
+            case 'c':
+                limiar_cookies = atoi(optarg);
+                break;
+            case 'G':
+                usa_gro = 0;
+                break;
+            case 'o':
+                dir_saida = optarg;
+                break;
+            case 'P':
+                arquivo_estat = optarg;
+                break;
+            case 'U':
+                socket_estat = optarg;
+                break;
+            case 'r':
+                janela_aleatoria = 1;
+                break;
+            case 'e':
+                if (configura_simulacao(&simulacao, optarg) < 0)
+                    return 1;
+                break;
+            case 'E':
+                configura_simulacao(&simulacao, "nenhum");
+                break;
+            default:
+                printf("Erro: uso correto: ./servidor_sdtp [-b lote] "
+                        "[-w workers] [-l nivel] [-L arquivo] "
+                        "[-M memoria_mb] [-c semiabertas] [-G] [-o dir] "
+                        "[-P arquivo] [-U socket] [-r] [-e erros] [-E]\n");
+                return 1;
+        }
+    }
 
-    // informacoes do servidor
-    struct sockaddr_in endereco_servidor;
+    if (lote < 1 || lote > LOTEMAX)
+    {
+        printf("Erro: o lote deve estar entre 1 e %d\n", LOTEMAX);
+        return 1;
+    }
 
-    // tamanho da estrutura de endereco do socket usado
-    sockettamanho = sizeof(endereco_cliente);
-    
-    // criando o socket
-    meusocket = socket(AF_INET, SOCK_DGRAM, 0);
+    // um worker por nucleo
+    if (numworkers == 0)
+    {
+        numworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
 
-    endereco_servidor.sin_family = AF_INET;
-    
-    // define qualquer ip da interface de rede
-    endereco_servidor.sin_addr.s_addr = INADDR_ANY;
-    
-    // define a porta de escuta do servidor
-    endereco_servidor.sin_port = htons(PORTA);
-    
-    // zera o resto da estrutura
-    memset(&(endereco_servidor.sin_zero), '\0', 
-            sizeof(endereco_servidor.sin_zero));
+    if (numworkers < 1 || numworkers > WORKERSMAX)
+    {
+        printf("Erro: os workers devem estar entre 1 e %d\n", WORKERSMAX);
+        return 1;
+    }
 
-    // liga o socket ao enderecamento do servidor
-    bind(meusocket, (struct sockaddr *)&endereco_servidor, 
-            sizeof(struct sockaddr));
-    
-    printf("Servidor escutando conexoes UDP na porta: %d\n", PORTA);
-        
-    // apontando para o inicio da estrutura
-    p = (struct sdtphdr *)&buffer;
+    if (nivel < NIVEL_ERRO || nivel > NIVEL_DEBUG)
+    {
+        printf("Erro: o nivel de log deve estar entre %d e %d\n",
+                NIVEL_ERRO, NIVEL_DEBUG);
+        return 1;
+    }
+
+    if (prepara_simulacao(&simulacao) < 0)
+    {
+        return 1;
+    }
 
-    int state = 0;
+    if (log_init(arquivo_log, nivel) < 0)
+    {
+        perror("log_init");
+        return 1;
+    }
 
-    // armazena o resultado do checksum para cada pacote recebido
-    uint16_t sum = 0;
+    // chave dos SYN cookies, distinta a cada execucao
+    if (getrandom(chave_cookie, sizeof(chave_cookie), 0)
+            != sizeof(chave_cookie))
+    {
+        perror("getrandom");
+        return 1;
+    }
+
+    // abrindo o arquivo lorem_ipsum.txt e calculando seu checksum
+    FILE *loremfile = fopen("./lorem_ipsum.txt", "r");
+    char loremdata[LOREMSIZE];
+    fread(loremdata, 1, LOREMSIZE, loremfile);
+    datasum = checksum((void *)loremdata, LOREMSIZE);
+
+    LOG(NIVEL_INFO, "Checksum do arquivo: %d",datasum);
 
-    while(1)
+    // as estatisticas de cada worker ocupam linhas de cache proprias
+    workers = aligned_alloc(_Alignof(struct worker_sdtp),
+            numworkers * sizeof(struct worker_sdtp));
+    memset(workers, 0x0, numworkers * sizeof(struct worker_sdtp));
+
+    for (int i = 0; i < numworkers; i++)
     {
-        printf("Servidor: esperando no recvfrom...\n");
+        struct worker_sdtp *w = &workers[i];
 
-        // limpa o buffer para o novo pacote
-        memset(buffer, 0x0, MAXSDTP);
+        w->id   = i;
+        w->lote = lote;
 
-	    numbytes = recvfrom(meusocket, buffer, MAXSDTP, 0,
-		    (struct sockaddr *)&endereco_cliente, &sockettamanho);
+        // gerador distinto para cada worker, a partir da mesma semente
+        semeia_gerador(w, simulacao.semente, i);
 
-    	printf("Servidor: pacote recebeu %d bytes\n", numbytes);
-    	printf("Servidor: possui %d conexoes ativas\n", numsockets);
+        // tabela de conexoes ativas
+        if (init_tabela(&w->tabela) < 0)
+        {
+            LOG(NIVEL_ERRO, "Servidor: sem memoria para a tabela");
+            log_finaliza();
+            return 1;
+        }
 
-        //printf("teste de campo: %x\n",p->flags);
-        //printf("\tip: %x\n",endereco_cliente.sin_addr.s_addr);
-        //printf("\tporta: %d\n",htons(endereco_cliente.sin_port));
-    
-        // imprime pacote recebido
-        printpacket(p);
+        // pools das estruturas e dos blocos de dados das conexoes
+        pool_init(&w->pool_sockets, sizeof(struct socket_sdtp),
+                SOCKETS_SLAB);
+        pool_init(&w->pool_blocos, BLOCO, BLOCOS_SLAB);
+        pool_init(&w->pool_adiadas, sizeof(struct adiada_sdtp), SIM_SLAB);
 
-        // simula um erro para esta etapa da simulacao
-        global_error = simerror();
-      
-        printf("ERRO GERADO: %x\n",global_error);
-    
-        // calculando o valor do checksum
-        //   sum = 0, em caso de sucesso, ou 
-        //   sum > 0, caso contrario
-        sum = checksum((void *)p, p->datalen+sizeof(struct sdtphdr));
-    
-        // verdadeiro em caso de checksum invalido
-        //if ( sum != 0xffff )
-        if ( sum )
-        {
-            printf("DEBUG de CHECKSUM\n");
-            printf("\tRecebido:  %d\n",p->checksum);
-            printf("\tCalculado: %d\n",sum);
-            printf("\tNum bytes considerados %d\n\n",
-                    p->datalen+sizeof(struct sdtphdr));
-        }
-
-        // possibilidades de erro neste ponto:
-        // - por perda de pacote na recepcao (simulado)
-        // - por checksum invalido (simulado)
-        // - por checksum invalido (calculado/real)
-        // nao faz nada com o pacote
-        if (
-            global_error == SDTP_ERROR_LOST_IN 
-                ||
-            global_error == SDTP_ERROR_SUM_IN 
+        if ((w->meusocket = cria_socket_worker()) < 0)
+        {
+            log_finaliza();
+            return 1;
+        }
+
+        // as sincronizacoes concluidas voltam ao worker por um pipe
+        if (dir_saida != NULL
+                &&
+            (pipe2(w->sincronizadas, O_CLOEXEC) < 0
                 ||
-            sum
-            )
+             fcntl(w->sincronizadas[0], F_SETFL, O_NONBLOCK) < 0))
         {
-            // nao envia nada como resposta ao cliente
-            continue;
+            LOG(NIVEL_ERRO, "Servidor: pipe: %s", strerror(errno));
+            log_finaliza();
+            return 1;
         }
+    }
 
-        // obtem o socket sdtp para esta conexao
-        sdtp_sockid = get_socket_sdtp(&endereco_cliente);
+    // no modo de gravacao, os arquivos sao sincronizados fora dos workers
+    // (ver fecha_saida); o pipe dos pedidos nao bloqueia os workers
+    if (dir_saida != NULL)
+    {
+        pthread_t thread;
 
-        print_socket_list();
+        if ((fd_dir_saida = open(dir_saida, O_RDONLY|O_DIRECTORY|O_CLOEXEC))
+                < 0
+                ||
+            pipe2(sincronia, O_CLOEXEC) < 0
+                ||
+            fcntl(sincronia[1], F_SETFL, O_NONBLOCK) < 0)
+        {
+            LOG(NIVEL_ERRO, "Servidor: %s: %s", dir_saida, strerror(errno));
+            log_finaliza();
+            return 1;
+        }
 
-        // passa o pacote para ser analisado pelo tratador
-        //
-        // em caso de retorno = 1, reenvia pacote formatado dentro da funcao
-        if ( handle_socket_sdtp(sdtp_sockid, p) )
+        for (int i = 0; i < SINCRONIA_THREADS; i++)
         {
-            // em caso de envio perdido (simulado), nao faz o envio
-            if ( global_error == SDTP_ERROR_LOST_OUT )
-            {
-                continue;
-            }
+            pthread_create(&thread, NULL, executa_sincronia, NULL);
+            pthread_detach(thread);
+        }
+    }
 
-            // em caso de pacote enviado ser corrompido
-            if ( global_error == SDTP_ERROR_SUM_OUT )
-            {
-                corrupt(buffer, sizeof(struct sdtphdr));
-            }
+    LOG(NIVEL_INFO, "Servidor escutando conexoes UDP na porta: %d "
+            "(lote %d, %d workers, janela %s, memoria %lu MB)", PORTA, lote,
+            numworkers, janela_aleatoria ? "aleatoria" : "real",
+            (unsigned long)(orcamento >> 20));
 
-            printf("IMPRIMINDO PACOTE REPLY\n");
-            printpacket(p);
+    descreve_simulacao(&simulacao, descricao, sizeof(descricao));
+    LOG(NIVEL_INFO, "Simulacao: %s", descricao);
 
-            numbytes = sendto(meusocket, buffer, sizeof(struct sdtphdr), 0,
-			 (struct sockaddr *)&endereco_cliente, sockettamanho);
+    for (int i = 0; i < numworkers; i++)
+    {
+        pthread_create(&workers[i].thread, NULL, executa_worker, &workers[i]);
+    }
 
-            printf("Servidor: enviou %d bytes\n\n", numbytes);
-        }
-        else
+    if (arquivo_estat != NULL || socket_estat != NULL)
+    {
+        exportador.workers    = workers;
+        exportador.numworkers = numworkers;
+        exportador.sock       = -1;
+
+        if (socket_estat != NULL
+                &&
+            (exportador.sock = cria_socket_estat(socket_estat)) < 0)
         {
-            printf("Servidor: nao enviou resposta\n\n");
+            LOG(NIVEL_ERRO, "estatisticas: %s: %s", socket_estat,
+                    strerror(errno));
         }
+
+        pthread_create(&exportador.thread, NULL, executa_exportador,
+                &exportador);
     }
-	
-    close(meusocket);
+
+    for (int i = 0; i < numworkers; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    log_finaliza();
 
     return 0;
 }
+#endif
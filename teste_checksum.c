@@ -0,0 +1,225 @@
+/**
+ * @file teste_checksum.c
+ * @brief Teste das implementacoes do checksum contra a de referencia
+ * @author Joao Borges
+ *
+ * Compara a soma de cada implementacao disponivel em checksum_impls com a
+ * da implementacao escalar, para:
+ * - dados aleatorios com deslocamentos de 0 a 15 bytes do alinhamento;
+ * - tamanhos pares e impares, de 0 ate TESTE_MAXIMO bytes;
+ * - somas iniciais nula, maxima e aleatorias;
+ * - dados so com 0x00 e so com 0xff.
+ *
+ * Tambem confere checksum() apos selecionar cada implementacao com
+ * checksum_seleciona. Imprime uma linha por implementacao e termina com
+ * codigo 1 na primeira divergencia, mostrando o caso que a provocou.
+ *
+ * Opcoes:
+ * - -s N: semente dos dados aleatorios (padrao: o horario atual)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "sdtp.h"
+
+/// \defgroup teste Parametros do teste do checksum
+/// \{
+#define TESTE_MAXIMO    (384 * 1024)    ///< Maior tamanho testado (bytes)
+#define TESTE_FOLGA     16              ///< Deslocamentos testados
+#define TESTE_SORTEIOS  2000            ///< Tamanhos sorteados por padrao
+/// \}
+
+/// Implementacao de referencia
+static const struct checksum_impl *referencia;
+
+/**
+ * Compara uma implementacao com a de referencia em um trecho
+ *
+ * @param impl Implementacao testada
+ * @param buf Dados
+ * @param len Tamanho dos dados em bytes
+ * @param sum Soma inicial
+ * @param caso Descricao dos dados, para a mensagem de erro
+ *
+ * @return 0 se as somas coincidem, ou -1
+ */
+static int compara(const struct checksum_impl *impl, const uint8_t *buf,
+        int len, uint32_t sum, const char *caso)
+{
+    uint32_t esperado = referencia->soma(buf, len, sum);
+    uint32_t obtido   = impl->soma(buf, len, sum);
+
+    if (obtido == esperado)
+        return 0;
+
+    fprintf(stderr, "%s: %s, deslocamento %u, %d bytes, soma inicial "
+            "0x%x: 0x%x, esperado 0x%x\n", impl->nome, caso,
+            (unsigned)((uintptr_t)buf % TESTE_FOLGA), len, sum, obtido,
+            esperado);
+
+    return -1;
+}
+
+/**
+ * Testa uma implementacao em todos os casos
+ *
+ * @param impl Implementacao testada
+ * @param base Area de TESTE_MAXIMO + TESTE_FOLGA bytes, alinhada a
+ * TESTE_FOLGA
+ *
+ * @return Quantidade de casos comparados, ou -1 na primeira divergencia
+ */
+static int testa(const struct checksum_impl *impl, uint8_t *base)
+{
+    static const uint32_t somas[] = { 0, 0xffff, 0x1234 };
+    int casos = 0;
+    int len, off, i, s;
+
+    // dados aleatorios: todos os tamanhos pequenos, em todos os
+    // deslocamentos e com todas as somas iniciais
+    for (i = 0; i < TESTE_MAXIMO + TESTE_FOLGA; i++)
+        base[i] = rand();
+
+    for (len = 0; len <= 1024; len++)
+        for (off = 0; off < TESTE_FOLGA; off++)
+            for (s = 0; s < 3; s++, casos++)
+                if (compara(impl, base + off, len, somas[s],
+                            "aleatorio") < 0)
+                    return -1;
+
+    // tamanhos maiores sorteados, metade pares e metade impares, alem
+    // do maior tamanho nas duas paridades
+    for (i = 0; i < TESTE_SORTEIOS; i++, casos++)
+    {
+        len = rand() % (TESTE_MAXIMO - 1) + 1;
+        len = (len & ~1) | (i & 1);
+        off = rand() % TESTE_FOLGA;
+
+        if (compara(impl, base + off, len, rand() & 0xffff,
+                    "aleatorio") < 0)
+            return -1;
+    }
+
+    for (off = 0; off < TESTE_FOLGA; off++, casos += 2)
+        if (compara(impl, base + off, TESTE_MAXIMO, 0, "aleatorio") < 0
+                ||
+            compara(impl, base + off, TESTE_MAXIMO - 1, 0, "aleatorio") < 0)
+            return -1;
+
+    // extremos: a soma nunca transporta (0x00) e sempre transporta (0xff)
+    for (i = 0; i < 2; i++)
+    {
+        const char *caso = i ? "0xff" : "0x00";
+
+        memset(base, i ? 0xff : 0x00, TESTE_MAXIMO + TESTE_FOLGA);
+
+        for (off = 0; off < TESTE_FOLGA; off++)
+        {
+            for (len = 0; len <= 1024; len++, casos++)
+                if (compara(impl, base + off, len, 0xffff, caso) < 0)
+                    return -1;
+
+            for (len = TESTE_MAXIMO - 1; len <= TESTE_MAXIMO; len++)
+                for (s = 0; s < 3; s++, casos++)
+                    if (compara(impl, base + off, len, somas[s], caso) < 0)
+                        return -1;
+        }
+    }
+
+    // o mesmo resultado pela funcao usada pelo servidor e pelo cliente
+    if (checksum_seleciona(impl->nome) == NULL)
+        return casos;
+
+    for (i = 0; i < TESTE_MAXIMO + TESTE_FOLGA; i++)
+        base[i] = rand();
+
+    for (i = 0; i < TESTE_SORTEIOS; i++, casos++)
+    {
+        len = rand() % TESTE_MAXIMO + 1;
+        off = rand() % TESTE_FOLGA;
+
+        if (checksum(base + off, len) !=
+                (uint16_t)~referencia->soma(base + off, len, 0))
+        {
+            fprintf(stderr, "%s: checksum(), deslocamento %d, %d bytes\n",
+                    impl->nome, off, len);
+            return -1;
+        }
+    }
+
+    return casos;
+}
+
+int main(int argc, char **argv)
+{
+    const struct checksum_impl *impl;
+    unsigned semente = (unsigned) time(NULL);
+    uint8_t *base;
+    int opt, casos, falhas = 0;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                semente = (unsigned) strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "uso: %s [-s semente]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    for (impl = checksum_impls; impl->nome != NULL; impl++)
+        if (strcmp(impl->nome, "escalar") == 0)
+            referencia = impl;
+
+    if (referencia == NULL)
+    {
+        fprintf(stderr, "implementacao escalar ausente\n");
+        return 2;
+    }
+
+    base = aligned_alloc(TESTE_FOLGA, TESTE_MAXIMO + TESTE_FOLGA);
+
+    if (base == NULL)
+    {
+        perror("aligned_alloc");
+        return 2;
+    }
+
+    printf("# semente %u\n", semente);
+
+    for (impl = checksum_impls; impl->nome != NULL; impl++)
+    {
+        if (!impl->disponivel())
+        {
+            printf("%-8s indisponivel\n", impl->nome);
+            continue;
+        }
+
+        // a mesma sequencia de dados para cada implementacao
+        srand(semente);
+
+        casos = testa(impl, base);
+
+        if (casos < 0)
+        {
+            printf("%-8s FALHOU\n", impl->nome);
+            falhas++;
+            break;
+        }
+
+        printf("%-8s ok (%d casos)\n", impl->nome, casos);
+    }
+
+    checksum_seleciona(NULL);
+    free(base);
+
+    return falhas ? 1 : 0;
+}
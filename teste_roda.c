@@ -0,0 +1,225 @@
+/**
+ * @file teste_roda.c
+ * @brief Teste da roda hierarquica de temporizadores com relogio simulado
+ * @author Joao Borges
+ *
+ * Arma TESTE_TIMERS temporizadores com prazos de 1 ms ate alem do alcance
+ * do ultimo nivel da roda, desarma parte deles e avanca a roda
+ * (evloop_avanca) por um relogio simulado, que salta a cada vez a espera
+ * calculada por evloop_proximo ou, as vezes, apenas parte dela. Durante o
+ * avanco, os temporizadores disparados e outros sorteados sao rearmados
+ * ou desarmados.
+ *
+ * Confere que cada temporizador dispara exatamente no instante do seu
+ * prazo (nem antes, nem depois, o que denunciaria uma espera que saltou a
+ * expiracao), uma unica vez por armacao, e que, ao final, nenhum ficou
+ * armado. Termina com codigo 1 na primeira divergencia, mostrando o
+ * temporizador e o instante.
+ *
+ * Opcoes:
+ * - -s N: semente dos prazos e das operacoes (padrao: o horario atual)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "sdtp.h"
+
+/// \defgroup teste Parametros do teste da roda
+/// \{
+#define TESTE_TIMERS    20000   ///< Temporizadores armados no inicio
+#define TESTE_ALEM      (1u << 22) ///< Maior excesso alem do alcance da
+                                   ///< roda (ms)
+#define TESTE_PASSOS    2000000 ///< Maximo de avancos do relogio
+/// \}
+
+/// Alcance da roda: prazos alem dele aguardam na ultima posicao
+#define ALCANCE ((uint64_t)1 << (RODA_BITS * RODA_NIVEIS))
+
+/**
+ * Temporizador do teste, com o estado esperado
+ */
+struct teste_timer
+{
+    struct timer_sdtp timer;    ///< Temporizador da roda
+    int armado;                 ///< Armado, segundo o teste
+    uint64_t prazo;             ///< Instante esperado do disparo
+};
+
+/// Laco de eventos, usado apenas pela roda
+static struct evloop_sdtp ev;
+
+/// Temporizadores do teste
+static struct teste_timer timers[TESTE_TIMERS];
+
+/// Disparos e falhas observados
+static unsigned long disparos, falhas;
+
+/**
+ * Sorteia um prazo (ms), espalhado por todos os niveis da roda e alem
+ * do seu alcance
+ */
+static uint64_t sorteia_prazo(void)
+{
+    switch (rand() % 6)
+    {
+        case 0:
+            return rand() % 4;
+        case 1:
+            return rand() % RODA_POSICOES;
+        case 2:
+            return rand() % (RODA_POSICOES * RODA_POSICOES);
+        case 3:
+            return (uint64_t)rand() % (ALCANCE / RODA_POSICOES);
+        case 4:
+            return (uint64_t)rand() % ALCANCE;
+        default:
+            return ALCANCE - 1 + (uint64_t)rand() % TESTE_ALEM;
+    }
+}
+
+/**
+ * Arma um temporizador do teste, registrando o instante esperado
+ */
+static void arma(struct teste_timer *t, uint64_t ms)
+{
+    timer_arma(&ev, &t->timer, ms);
+
+    // timer_arma trata o prazo 0 como 1 ms
+    t->prazo  = ev.agora + (ms ? ms : 1);
+    t->armado = 1;
+}
+
+/**
+ * Disparo de um temporizador: confere o instante e, as vezes, o rearma
+ */
+static void dispara(struct timer_sdtp *timer)
+{
+    struct teste_timer *t = (struct teste_timer *)timer->arg;
+
+    disparos++;
+
+    if (!t->armado || ev.agora != t->prazo)
+    {
+        if (falhas++ == 0)
+            fprintf(stderr, "temporizador %ld: disparou em %llu, %s %llu\n",
+                    (long)(t - timers), (unsigned long long)ev.agora,
+                    t->armado ? "prazo" : "desarmado desde",
+                    (unsigned long long)t->prazo);
+    }
+
+    t->armado = 0;
+
+    if (rand() % 4 == 0)
+        arma(t, sorteia_prazo());
+}
+
+int main(int argc, char **argv)
+{
+    unsigned semente = (unsigned) time(NULL);
+    unsigned long passos = 0, parciais = 0, i;
+    int opt, espera, salto;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1)
+    {
+        switch (opt)
+        {
+            case 's':
+                semente = (unsigned) strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "uso: %s [-s semente]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    printf("# semente %u\n", semente);
+    srand(semente);
+
+    if (evloop_init(&ev) < 0)
+    {
+        perror("evloop_init");
+        return 2;
+    }
+
+    for (i = 0; i < TESTE_TIMERS; i++)
+    {
+        timer_init(&timers[i].timer, dispara, &timers[i]);
+        arma(&timers[i], sorteia_prazo());
+    }
+
+    // um decimo e desarmado antes de a roda avancar
+    for (i = 0; i < TESTE_TIMERS; i += 10)
+    {
+        timer_desarma(&ev, &timers[i].timer);
+        timers[i].armado = 0;
+    }
+
+    while ((espera = evloop_proximo(&ev)) >= 0 && passos++ < TESTE_PASSOS)
+    {
+        if (espera < 1)
+        {
+            fprintf(stderr, "espera %d com a roda em dia, em %llu\n",
+                    espera, (unsigned long long)ev.agora);
+            falhas++;
+            break;
+        }
+
+        // salta a espera inteira, ou as vezes so parte dela
+        salto = espera;
+        if (espera > 1 && rand() % 8 == 0)
+        {
+            salto = 1 + rand() % (espera - 1);
+            parciais++;
+        }
+
+        evloop_avanca(&ev, ev.agora + salto);
+
+        // entre os avancos, rearma ou desarma um temporizador qualquer
+        if (rand() % 16 == 0)
+        {
+            struct teste_timer *t = &timers[rand() % TESTE_TIMERS];
+
+            if (rand() % 2)
+            {
+                arma(t, sorteia_prazo());
+            }
+            else
+            {
+                timer_desarma(&ev, &t->timer);
+                t->armado = 0;
+            }
+        }
+
+        if (falhas)
+            break;
+    }
+
+    for (i = 0; i < TESTE_TIMERS && !falhas; i++)
+    {
+        if (timers[i].armado || timer_armado(&timers[i].timer))
+        {
+            fprintf(stderr, "temporizador %lu ainda armado, prazo %llu\n",
+                    i, (unsigned long long)timers[i].prazo);
+            falhas++;
+        }
+    }
+
+    if (!falhas && ev.ntimers != 0)
+    {
+        fprintf(stderr, "%d temporizadores ainda na roda\n", ev.ntimers);
+        falhas++;
+    }
+
+    printf("%-8s %s (%lu disparos, %lu avancos, %lu parciais, %llu ms)\n",
+            "roda", falhas ? "FALHOU" : "ok", disparos, passos, parciais,
+            (unsigned long long)ev.agora);
+
+    evloop_destroy(&ev);
+
+    return falhas ? 1 : 0;
+}
@@ -12,9 +12,23 @@ flags = ProtoField.uint8("sdtp.flags", "flags", base.HEX)
 window = ProtoField.uint16("sdtp.window", "window", base.DEC)
 checksum = ProtoField.uint16("sdtp.checksum", "checksum", base.HEX)
 data = ProtoField.string("sdtp.data", "data", base.ASCII)
+sack_left = ProtoField.uint16("sdtp.sack.left", "left edge", base.DEC)
+sack_right = ProtoField.uint16("sdtp.sack.right", "right edge", base.DEC)
+
+-- v2 header fields (32-bit sequence numbers and window, 16-bit datalen)
+version = ProtoField.uint8("sdtp.version", "version", base.DEC)
+seqnum2 = ProtoField.uint32("sdtp.v2.seqnum", "seqnum", base.DEC)
+acknum2 = ProtoField.uint32("sdtp.v2.acknum", "acknum", base.DEC)
+datalen2 = ProtoField.uint16("sdtp.v2.datalen", "datalen", base.DEC)
+window2 = ProtoField.uint32("sdtp.v2.window", "window", base.DEC)
+reserved2 = ProtoField.uint16("sdtp.v2.reserved", "reserved", base.HEX)
+sack_left2 = ProtoField.uint32("sdtp.v2.sack.left", "left edge", base.DEC)
+sack_right2 = ProtoField.uint32("sdtp.v2.sack.right", "right edge", base.DEC)
 
 -- adding fields
-sdtp_proto.fields = { seqnum, acknum, datalen, flags, window, checksum, data }
+sdtp_proto.fields = { seqnum, acknum, datalen, flags, window, checksum, data,
+                      sack_left, sack_right, version, seqnum2, acknum2,
+                      datalen2, window2, reserved2, sack_left2, sack_right2 }
 
 -- testing if a flag is defined
 function test_flag(flag, code)
@@ -35,6 +49,8 @@ function get_flag_name(flag)
   if test_flag(flag, 0x8) == 1 then flag_name = flag_name .. "PUSH " end
   if test_flag(flag, 0x10) == 1 then flag_name = flag_name .. "ACK " end
   if test_flag(flag, 0x20) == 1 then flag_name = flag_name .. "URG " end
+  if test_flag(flag, 0x40) == 1 then flag_name = flag_name .. "SACK " end
+  if test_flag(flag, 0x80) == 1 then flag_name = flag_name .. "V2 " end
 
   return flag_name
 end
@@ -45,14 +61,32 @@ function sdtp_proto.dissector(buffer,pinfo,tree)
     pinfo.cols.protocol = "SDTP"
 
     local subtree = tree:add(sdtp_proto,buffer(),"SDTP - Simple Data Transfer Protocol")
-    
-    local datalength = buffer(4,1):le_uint()
 
     local flags_name = get_flag_name(buffer(5,1):uint())
 
-    subtree:add_le(seqnum, buffer(0,2))
-    subtree:add_le(acknum, buffer(2,2))
-    subtree:add_le(datalen, buffer(4,1))
+    -- the flags byte sits at offset 5 in both headers; every v2 packet
+    -- carries V2 without SYN (the SYN that asks for v2 is still v1)
+    local v2 = bit.band(buffer(5,1):uint(), 0x82) == 0x80 and buffer:len() >= 20
+
+    local datalength
+    local hdrlen
+
+    if v2 then
+        datalength = buffer(16,2):le_uint()
+        hdrlen = 20
+
+        subtree:append_text(" v2")
+        subtree:add_le(seqnum2, buffer(0,4))
+        subtree:add(version, buffer(4,1))
+    else
+        datalength = buffer(4,1):le_uint()
+        hdrlen = 10
+
+        subtree:add_le(seqnum, buffer(0,2))
+        subtree:add_le(acknum, buffer(2,2))
+        subtree:add_le(datalen, buffer(4,1))
+    end
+
     subtree_flags = subtree:add_le(flags, buffer(5,1)):append_text(" (" .. flags_name:sub(1, -2) .. ")")
     
     -- getting the flags
@@ -92,11 +126,51 @@ function sdtp_proto.dissector(buffer,pinfo,tree)
         subtree_flags:add(buffer(5,1),"..0.....: URG: Not set")
     end
 
-    subtree:add_le(window, buffer(6,2))
-    subtree:add(checksum, buffer(8,2))
+    if (test_flag(buffer(5,1):uint(), 0x40) == 1) then
+        subtree_flags:add(buffer(5,1),".1......: SACK: Set")
+    else
+        subtree_flags:add(buffer(5,1),".0......: SACK: Not set")
+    end
+
+    if (test_flag(buffer(5,1):uint(), 0x80) == 1) then
+        subtree_flags:add(buffer(5,1),"1.......: V2: Set")
+    else
+        subtree_flags:add(buffer(5,1),"0.......: V2: Not set")
+    end
+
+    if v2 then
+        subtree:add(checksum, buffer(6,2))
+        subtree:add_le(acknum2, buffer(8,4))
+        subtree:add_le(window2, buffer(12,4))
+        subtree:add_le(datalen2, buffer(16,2))
+        subtree:add_le(reserved2, buffer(18,2))
+    else
+        subtree:add_le(window, buffer(6,2))
+        subtree:add(checksum, buffer(8,2))
+    end
 
-    if datalength > 0 then
-        subtree:add_le(data, buffer(10,datalength))
+    -- an ACK with SACK (and without SYN) carries blocks instead of data:
+    -- the [left, right) ranges received beyond acknum, with 16-bit edges
+    -- in v1 and 32-bit edges in v2
+    local flagbits = buffer(5,1):uint()
+    local edge = v2 and 4 or 2
+    local left_field = v2 and sack_left2 or sack_left
+    local right_field = v2 and sack_right2 or sack_right
+
+    if datalength > 0 and bit.band(flagbits, 0x52) == 0x50 then
+        local sacktree = subtree:add(buffer(hdrlen,datalength), "SACK blocks")
+        local i = 0
+
+        while i + 2*edge <= datalength do
+            local block = sacktree:add(buffer(hdrlen+i,2*edge),
+                "[" .. buffer(hdrlen+i,edge):le_uint() .. ", " ..
+                buffer(hdrlen+i+edge,edge):le_uint() .. ")")
+            block:add_le(left_field, buffer(hdrlen+i,edge))
+            block:add_le(right_field, buffer(hdrlen+i+edge,edge))
+            i = i + 2*edge
+        end
+    elseif datalength > 0 then
+        subtree:add_le(data, buffer(hdrlen,datalength))
     end
 
 end